@@ -0,0 +1,60 @@
+// Lanczos2 resampling with 4x4 taps, use with the nearest option.
+#version 130
+
+#if defined(VERTEX)
+
+in vec4 VertexCoord;
+in vec4 TexCoord;
+out vec2 TEX0;
+uniform mat4 MVPMatrix;
+
+void main()
+{
+    gl_Position = MVPMatrix * VertexCoord;
+    TEX0 = TexCoord.xy;
+}
+
+#elif defined(FRAGMENT)
+
+#define PI 3.14159265358979
+
+out vec4 FragColor;
+uniform sampler2D Texture;
+uniform vec2 TextureSize;
+in vec2 TEX0;
+
+float lanczos2(float x)
+{
+    x = abs(x);
+    if (x < 0.00001)
+        return 1.0;
+    if (x >= 2.0)
+        return 0.0;
+
+    float px = PI * x;
+    return 2.0 * sin(px) * sin(px / 2.0) / (px * px);
+}
+
+void main()
+{
+    vec2 texel = TEX0 * TextureSize - 0.5;
+    vec2 base = floor(texel);
+    vec2 f = texel - base;
+
+    vec3 color = vec3(0.0);
+    float weightSum = 0.0;
+
+    for (int y = -1; y <= 2; y++)
+    {
+        for (int x = -1; x <= 2; x++)
+        {
+            float weight = lanczos2(float(x) - f.x) * lanczos2(float(y) - f.y);
+            color += weight * texture(Texture, (base + vec2(x, y) + 0.5) / TextureSize).rgb;
+            weightSum += weight;
+        }
+    }
+
+    FragColor = vec4(clamp(color / weightSum, 0.0, 1.0), 1.0);
+}
+
+#endif
@@ -0,0 +1,29 @@
+// Plain copy, combine with the int/linear/nearest options of ShaderChain
+// for integer prescaling followed by a smooth stretch to the window.
+#version 130
+
+#if defined(VERTEX)
+
+in vec4 VertexCoord;
+in vec4 TexCoord;
+out vec2 TEX0;
+uniform mat4 MVPMatrix;
+
+void main()
+{
+    gl_Position = MVPMatrix * VertexCoord;
+    TEX0 = TexCoord.xy;
+}
+
+#elif defined(FRAGMENT)
+
+out vec4 FragColor;
+uniform sampler2D Texture;
+in vec2 TEX0;
+
+void main()
+{
+    FragColor = vec4(texture(Texture, TEX0).rgb, 1.0);
+}
+
+#endif
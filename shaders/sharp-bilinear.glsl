@@ -0,0 +1,39 @@
+// Sharp bilinear: nearest neighbour inside each source pixel and a linear
+// blend only on the edges, use with the linear option.
+#version 130
+
+#if defined(VERTEX)
+
+in vec4 VertexCoord;
+in vec4 TexCoord;
+out vec2 TEX0;
+uniform mat4 MVPMatrix;
+
+void main()
+{
+    gl_Position = MVPMatrix * VertexCoord;
+    TEX0 = TexCoord.xy;
+}
+
+#elif defined(FRAGMENT)
+
+out vec4 FragColor;
+uniform sampler2D Texture;
+uniform vec2 TextureSize;
+uniform vec2 InputSize;
+uniform vec2 OutputSize;
+in vec2 TEX0;
+
+void main()
+{
+    vec2 texel = TEX0 * TextureSize;
+    vec2 scale = max(floor(OutputSize / InputSize), vec2(1.0));
+
+    vec2 regionRange = 0.5 - 0.5 / scale;
+    vec2 centerDist = fract(texel) - 0.5;
+    vec2 f = (centerDist - clamp(centerDist, -regionRange, regionRange)) * scale + 0.5;
+
+    FragColor = vec4(texture(Texture, (floor(texel) + f) / TextureSize).rgb, 1.0);
+}
+
+#endif
@@ -17,8 +17,16 @@
 #include "main.h"
 #include "IDirectDraw.h"
 #include "IDirectDrawClipper.h"
+#include "IDirectDrawPalette.h"
 #include "IDirectDrawSurface.h"
-#include <tlhelp32.h>
+#include "childwin.h"
+#include "surfacepool.h"
+#include "frameexport.h"
+#include "screenshot.h"
+#include "affinity.h"
+#include "Settings.h"
+#include "modes.h"
+#include "vblank.h"
 
  // use these to enable stretching for testing
  // works only fullscreen right now
@@ -26,6 +34,7 @@
 bool MaintainAspectRatio = false;
 bool Windowboxing = false;
 bool StretchToFullscreen = false;
+bool Borderless = false;
 int StretchToWidth = 0;
 int StretchToHeight = 0;
 
@@ -44,6 +53,9 @@ IDirectDrawImpl *IDirectDrawImpl_construct()
     timeBeginPeriod(1);
     ddraw = this;
 
+    InitializeCriticalSection(&this->geometry.writeLock);
+    VBlank_Init();
+
     this->glInfo.glSupported = false;
     this->glInfo.initialized = false;
     this->glInfo.pboSupported = false;
@@ -87,6 +99,9 @@ static ULONG __stdcall _Release(IDirectDrawImpl *this)
         if (this->ref == 0)
         {
             timeEndPeriod(1);
+            SurfacePool_Flush();
+            FrameExport_Free();
+            DeleteCriticalSection(&this->geometry.writeLock);
             free(this);
         }
     }
@@ -110,7 +125,14 @@ static HRESULT __stdcall _CreatePalette(IDirectDrawImpl *this, DWORD dwFlags, LP
         "--> IDirectDraw::CreatePalette(this=%p, dwFlags=%d, lpDDColorArray=%p, lplpDDPalette=%p, pUnkOuter=%p)\n",
         this, (int)dwFlags, lpDDColorArray, lplpDDPalette, pUnkOuter);
 
-    HRESULT ret = IDirectDraw_CreatePalette(this->real, dwFlags, lpDDColorArray, lplpDDPalette, pUnkOuter);
+    HRESULT ret = DD_OK;
+    IDirectDrawPaletteImpl *impl = IDirectDrawPaletteImpl_construct(dwFlags, lpDDColorArray);
+    *lplpDDPalette = (IDirectDrawPalette *)impl;
+
+    if (PROXY)
+    {
+        ret = IDirectDraw_CreatePalette(this->real, dwFlags, lpDDColorArray, &impl->real, pUnkOuter);
+    }
 
     dprintf(
         "<-- IDirectDraw::CreatePalette(this=%p, dwFlags=%d, lpDDColorArray=%p, lplpDDPalette=%p, pUnkOuter=%p) -> %08X\n",
@@ -190,68 +212,55 @@ static HRESULT __stdcall _EnumDisplayModes(IDirectDrawImpl *this, DWORD dwFlags,
     }
     else
     {
-        //set up some filters to keep the list short
-        DWORD refreshRate = 0;
-        DWORD bpp = 0;
-        DWORD flags = 99998;
-        DWORD fixedOutput = 99998;
-        DWORD i = 0;
+        // One resolution per refresh rate, bpp and fixed output, picked by the mode table
+        ModeSize sizes[MODES_MAX_SIZES];
+        int count = Modes_EnumSizes(sizes, MODES_MAX_SIZES);
         DDSURFACEDESC s;
-        DEVMODE m;
-        memset(&m, 0, sizeof(DEVMODE));
-        m.dmSize = sizeof(DEVMODE);
 
-        while (EnumDisplaySettings(NULL, i, &m))
+        for (int i = 0; i < count; i++)
         {
-            if (refreshRate != 60 && m.dmDisplayFrequency >= 50)
-                refreshRate = m.dmDisplayFrequency;
-
-            if (bpp != 32 && m.dmBitsPerPel >= 16)
-                bpp = m.dmBitsPerPel;
+            memset(&s, 0, sizeof(DDSURFACEDESC));
+            s.dwSize = sizeof(DDSURFACEDESC);
+            s.dwFlags = DDSD_HEIGHT | DDSD_REFRESHRATE | DDSD_WIDTH | DDSD_PIXELFORMAT;
+            s.dwHeight = sizes[i].height;
+            s.dwWidth = sizes[i].width;
+            s.dwRefreshRate = 60;
+            s.ddpfPixelFormat.dwSize = sizeof(DDPIXELFORMAT);
+            s.ddpfPixelFormat.dwFlags = DDPF_RGB;
+            s.ddpfPixelFormat.dwRGBBitCount = 16;
+            s.ddpfPixelFormat.dwRBitMask = 0xF800;
+            s.ddpfPixelFormat.dwGBitMask = 0x07E0;
+            s.ddpfPixelFormat.dwBBitMask = 0x001F;
+
+            if (lpEnumModesCallback(&s, lpContext) == DDENUMRET_CANCEL)
+            {
+                dprintf("    DDENUMRET_CANCEL returned, stopping\n");
+                break;
+            }
 
-            if (flags != 0)
-                flags = m.dmDisplayFlags;
+            s.ddpfPixelFormat.dwFlags = DDPF_RGB | DDPF_PALETTEINDEXED8;
+            s.ddpfPixelFormat.dwRGBBitCount = 8;
+            s.ddpfPixelFormat.dwRBitMask = 0;
+            s.ddpfPixelFormat.dwGBitMask = 0;
+            s.ddpfPixelFormat.dwBBitMask = 0;
 
-            if (fixedOutput != DMDFO_DEFAULT)
-                fixedOutput = m.dmDisplayFixedOutput;
+            if (lpEnumModesCallback(&s, lpContext) == DDENUMRET_CANCEL)
+            {
+                dprintf("    DDENUMRET_CANCEL returned, stopping\n");
+                break;
+            }
 
-            memset(&m, 0, sizeof(DEVMODE));
-            m.dmSize = sizeof(DEVMODE);
-            i++;
-        }
+            s.ddpfPixelFormat.dwFlags = DDPF_RGB;
+            s.ddpfPixelFormat.dwRGBBitCount = 32;
+            s.ddpfPixelFormat.dwRBitMask = 0x00FF0000;
+            s.ddpfPixelFormat.dwGBitMask = 0x0000FF00;
+            s.ddpfPixelFormat.dwBBitMask = 0x000000FF;
 
-        memset(&m, 0, sizeof(DEVMODE));
-        m.dmSize = sizeof(DEVMODE);
-        i = 0;
-        while (EnumDisplaySettings(NULL, i, &m))
-        {
-            if (refreshRate == m.dmDisplayFrequency &&
-                bpp == m.dmBitsPerPel &&
-                flags == m.dmDisplayFlags &&
-                fixedOutput == m.dmDisplayFixedOutput)
+            if (lpEnumModesCallback(&s, lpContext) == DDENUMRET_CANCEL)
             {
-                memset(&s, 0, sizeof(DDSURFACEDESC));
-                s.dwSize = sizeof(DDSURFACEDESC);
-                s.dwFlags = DDSD_HEIGHT | DDSD_REFRESHRATE | DDSD_WIDTH | DDSD_PIXELFORMAT;
-                s.dwHeight = m.dmPelsHeight;
-                s.dwWidth = m.dmPelsWidth;
-                s.dwRefreshRate = 60;
-                s.ddpfPixelFormat.dwSize = sizeof(DDPIXELFORMAT);
-                s.ddpfPixelFormat.dwFlags = DDPF_RGB;
-                s.ddpfPixelFormat.dwRGBBitCount = 16;
-                s.ddpfPixelFormat.dwRBitMask = 0xF800;
-                s.ddpfPixelFormat.dwGBitMask = 0x07E0;
-                s.ddpfPixelFormat.dwBBitMask = 0x001F;
-
-                if (lpEnumModesCallback(&s, lpContext) == DDENUMRET_CANCEL)
-                {
-                    dprintf("    DDENUMRET_CANCEL returned, stopping\n");
-                    break;
-                }
+                dprintf("    DDENUMRET_CANCEL returned, stopping\n");
+                break;
             }
-            memset(&m, 0, sizeof(DEVMODE));
-            m.dmSize = sizeof(DEVMODE);
-            i++;
         }
     }
 
@@ -374,7 +383,21 @@ static HRESULT __stdcall _GetGDISurface(IDirectDrawImpl *this, LPDIRECTDRAWSURFA
 static HRESULT __stdcall _GetMonitorFrequency(IDirectDrawImpl *this, LPDWORD lpdwFrequency)
 {
     dprintf("--> IDirectDraw::GetMonitorFrequency(this=%p, lpdwFrequency=%p)\n", this, lpdwFrequency);
-    HRESULT ret = IDirectDraw_GetMonitorFrequency(this->real, lpdwFrequency);
+    HRESULT ret = DD_OK;
+
+    if (PROXY)
+    {
+        ret = IDirectDraw_GetMonitorFrequency(this->real, lpdwFrequency);
+    }
+    else if (!lpdwFrequency)
+    {
+        ret = DDERR_INVALIDPARAMS;
+    }
+    else
+    {
+        // The rate the renderer presents at, which is what the vblank emulation follows
+        *lpdwFrequency = VBlank_Rate();
+    }
     dprintf("<-- IDirectDraw::GetMonitorFrequency(this=%p, lpdwFrequency=%p) -> %08X\n", this, lpdwFrequency, (int)ret);
     return ret;
 }
@@ -382,7 +405,20 @@ static HRESULT __stdcall _GetMonitorFrequency(IDirectDrawImpl *this, LPDWORD lpd
 static HRESULT __stdcall _GetScanLine(IDirectDrawImpl *this, LPDWORD lpdwScanLine)
 {
     dprintf("--> IDirectDraw::GetScanLine(this=%p, lpdwScanLine=%p)\n", this, lpdwScanLine);
-    HRESULT ret = IDirectDraw_GetScanLine(this->real, lpdwScanLine);
+    HRESULT ret = DD_OK;
+
+    if (PROXY)
+    {
+        ret = IDirectDraw_GetScanLine(this->real, lpdwScanLine);
+    }
+    else if (!lpdwScanLine)
+    {
+        ret = DDERR_INVALIDPARAMS;
+    }
+    else if (!VBlank_ScanLine(this->height, lpdwScanLine))
+    {
+        ret = DDERR_VERTICALBLANKINPROGRESS;
+    }
     dprintf("<-- IDirectDraw::GetScanLine(this=%p, lpdwScanLine=%p) -> %08X\n", this, lpdwScanLine, (int)ret);
     return ret;
 }
@@ -390,12 +426,21 @@ static HRESULT __stdcall _GetScanLine(IDirectDrawImpl *this, LPDWORD lpdwScanLin
 static HRESULT __stdcall _GetVerticalBlankStatus(IDirectDrawImpl *this, LPBOOL lpbIsInVB)
 {
     dprintf("--> IDirectDraw::GetVerticalBlankStatus(this=%p, lpbIsInVB=%s)\n", this, (lpbIsInVB ? "TRUE" : "FALSE"));
-    HRESULT ret = DDERR_UNSUPPORTED;
+    HRESULT ret = DD_OK;
 
     if (PROXY)
     {
         ret = IDirectDraw_GetVerticalBlankStatus(this->real, lpbIsInVB);
     }
+    else if (!lpbIsInVB)
+    {
+        ret = DDERR_INVALIDPARAMS;
+    }
+    else
+    {
+        DWORD line;
+        *lpbIsInVB = !VBlank_ScanLine(this->height, &line);
+    }
 
     dprintf("<-- IDirectDraw::GetVerticalBlankStatus(this=%p, lpbIsInVB=%s) -> %08X\n", this, (lpbIsInVB ? "TRUE" : "FALSE"), (int)ret);
     return ret;
@@ -425,9 +470,9 @@ static HRESULT __stdcall _RestoreDisplayMode(IDirectDrawImpl *this)
     {
         ret = IDirectDraw_RestoreDisplayMode(this->real);
     }
-    else
+    else if (!Borderless)
     {
-        ChangeDisplaySettings(&this->winMode, 0);
+        Modes_Change(&this->winMode, 0);
     }
 
     dprintf("<-- IDirectDraw::RestoreDisplayMode(this=%p) -> %08X\n", this, (int)ret);
@@ -442,7 +487,8 @@ void SetWindowSize(IDirectDrawImpl *this, DWORD width, DWORD height)
     this->render.width = StretchToWidth;
     this->render.height = StretchToHeight;
 
-    if (StretchToFullscreen)
+    // Borderless keeps the desktop mode, the game is always scaled up to it
+    if (StretchToFullscreen || (Borderless && (this->dwFlags & DDSCL_FULLSCREEN)))
     {
         this->render.width = this->screenWidth;
         this->render.height = this->screenHeight;
@@ -510,6 +556,7 @@ void SetWindowSize(IDirectDrawImpl *this, DWORD width, DWORD height)
     else
         SetWindowPos(this->hWnd, HWND_TOP, 0, 0, this->render.width, this->render.height, SWP_SHOWWINDOW);
 
+    Geometry_Update(this);
     this->render.invalidate = TRUE;
 }
 
@@ -525,9 +572,16 @@ static HRESULT __stdcall _SetDisplayMode(IDirectDrawImpl *this, DWORD width, DWO
     }
     else
     {
-        if (bpp != 16)
+        if (bpp != 8 && bpp != 16 && bpp != 32)
             return DDERR_INVALIDMODE;
 
+        if (Borderless)
+        {
+            // Drop the frame first so SetWindowSize lays out the client area without it
+            SetWindowLong(this->hWnd, GWL_STYLE, GetWindowLong(this->hWnd, GWL_STYLE) & ~(WS_CAPTION | WS_THICKFRAME));
+            SetWindowPos(this->hWnd, NULL, 0, 0, 0, 0, SWP_FRAMECHANGED|SWP_NOMOVE|SWP_NOSIZE|SWP_NOZORDER);
+        }
+
         SetWindowSize(this, width, height);
 
         this->bpp = bpp;
@@ -541,7 +595,8 @@ static HRESULT __stdcall _SetDisplayMode(IDirectDrawImpl *this, DWORD width, DWO
 
             this->pfd.dwFlags = PFD_DRAW_TO_WINDOW|PFD_DOUBLEBUFFER|(InterlockedExchangeAdd(&Renderer, 0) == RENDERER_OPENGL ? PFD_SUPPORT_OPENGL : 0);
             this->pfd.iPixelType = PFD_TYPE_RGBA;
-            this->pfd.cColorBits = this->bpp;
+            // 8 bpp surfaces are expanded by the renderer, the window itself is never palettized
+            this->pfd.cColorBits = this->bpp > 8 ? this->bpp : 16;
             this->pfd.iLayerType = PFD_MAIN_PLANE;
             if (!SetPixelFormat(this->hDC, ChoosePixelFormat(this->hDC, &this->pfd), &this->pfd))
             {
@@ -553,122 +608,55 @@ static HRESULT __stdcall _SetDisplayMode(IDirectDrawImpl *this, DWORD width, DWO
         if (IsWine())
             SetWindowLong(this->hWnd, GWL_STYLE, GetWindowLong(this->hWnd, GWL_STYLE) | WS_MINIMIZEBOX);
 
-        int index = 0;
-        DEVMODE dm;
-        DWORD maxFreq = 0;
-        int bestDM = 0;
-        BOOL foundDevMode = false;
-        while ( 0 != EnumDisplaySettings(NULL, index++, &dm))
+        if (Borderless)
         {
-            if ((dm.dmFields & (DM_PELSWIDTH|DM_PELSHEIGHT|DM_DISPLAYFREQUENCY|DM_BITSPERPEL)) == (DM_PELSWIDTH|DM_PELSHEIGHT|DM_DISPLAYFREQUENCY|DM_BITSPERPEL))
-            {
-                if (dm.dmPelsWidth == this->width && dm.dmPelsHeight == this->height
-                    && dm.dmDisplayFrequency > maxFreq && dm.dmBitsPerPel == 32)
-                {
-                    if ((dm.dmFields & DM_DISPLAYFIXEDOUTPUT) && dm.dmDisplayFixedOutput == FixedOutput)
-                    {
-                        maxFreq = dm.dmDisplayFrequency;
-                        foundDevMode = true;
-                        bestDM = index;
-                        memcpy(&this->mode, &dm, sizeof(this->mode));
-                    }
-                    else if (FixedOutput == DMDFO_DEFAULT)
-                    {
-                        maxFreq = dm.dmDisplayFrequency;
-                        foundDevMode = true;
-                        bestDM = index;
-                        memcpy(&this->mode, &dm, sizeof(this->mode));
-                    }
-                }
-            }
+            // The desktop mode stays, the window covers the screen and the renderer scales into the viewport
+            memcpy(&this->mode, &this->winMode, sizeof(this->mode));
         }
-
-        // If there as no display mode with out desired FixedOutput, then we'll just take any matching display mode
-        index = 0;
-        if (!foundDevMode)
+        else
         {
-            while ( 0 != EnumDisplaySettings(NULL, index++, &dm))
-            {
-                if ((dm.dmFields & (DM_PELSWIDTH|DM_PELSHEIGHT|DM_DISPLAYFREQUENCY|DM_BITSPERPEL)) == (DM_PELSWIDTH|DM_PELSHEIGHT|DM_DISPLAYFREQUENCY|DM_BITSPERPEL))
-                {
-                    if (dm.dmPelsWidth == this->width && dm.dmPelsHeight == this->height
-                        && dm.dmDisplayFrequency > maxFreq && dm.dmBitsPerPel == 32)
-                    {
-                        maxFreq = dm.dmDisplayFrequency;
-                        foundDevMode = true;
-                        bestDM = index;
-                        memcpy(&this->mode, &dm, sizeof(this->mode));
-                    }
-                }
-            }
-        }
+            // If there is no display mode with our desired FixedOutput, then we'll just take any matching display mode
+            BOOL foundDevMode = Modes_Find(this->width, this->height, FixedOutput, &this->mode);
+            if (foundDevMode)
+                dprintf("    selected %dx%d-%d %dhz\n", (int)this->mode.dmPelsWidth, (int)this->mode.dmPelsHeight, (int)this->mode.dmBitsPerPel, (int)this->mode.dmDisplayFrequency);
 
-        (void)bestDM;
-        index = 0;
-        while ( 0 != EnumDisplaySettings(NULL, index++, &dm))
-        {
-            if (dm.dmFields & DM_DISPLAYFIXEDOUTPUT)
-            {
-                switch (dm.dmDisplayFixedOutput)
-                {
-                case DMDFO_DEFAULT:
-                    dprintf("        %dx%d-%d %dhz DMDFO_DEFAULT %s\n", dm.dmPelsWidth, dm.dmPelsHeight, dm.dmBitsPerPel, dm.dmDisplayFrequency, bestDM == index ? "*Selected*" : "");
-                    break;
-                case DMDFO_CENTER:
-                    dprintf("        %dx%d-%d %dhz DMDFO_CENTER %s\n", dm.dmPelsWidth, dm.dmPelsHeight, dm.dmBitsPerPel, dm.dmDisplayFrequency, bestDM == index ? "*Selected*" : "");
-                    break;
-                case DMDFO_STRETCH:
-                    dprintf("        %dx%d-%d %dhz DMDFO_STRETCH %s\n", dm.dmPelsWidth, dm.dmPelsHeight, dm.dmBitsPerPel, dm.dmDisplayFrequency, bestDM == index ? "*Selected*" : "");
-                    break;
-                default:
-                    break;
-                }
-            }
-            else
+            if (!foundDevMode)
             {
-                dprintf("        %dx%d-%d %dhz               %s\n", dm.dmPelsWidth, dm.dmPelsHeight, dm.dmBitsPerPel, dm.dmDisplayFrequency, bestDM == index ? "*Selected*" : "");
+                memcpy(&this->mode, &this->winMode, sizeof(this->mode));
+                this->render.width = this->mode.dmPelsWidth;
+                this->render.height = this->mode.dmPelsHeight;
+                this->width = this->mode.dmPelsWidth;
+                this->height = this->mode.dmPelsHeight;
             }
-        }
 
-        if (!foundDevMode)
-        {
-            memcpy(&this->mode, &this->winMode, sizeof(this->mode));
-            this->render.width = this->mode.dmPelsWidth;
-            this->render.height = this->mode.dmPelsHeight;
-            this->width = this->mode.dmPelsWidth;
-            this->height = this->mode.dmPelsHeight;
-        }
-
-        // Only use the full screen hack in wine since it might disrupt OBS and recording software.
-        if (IsWine())
-            SetWindowPos(this->hWnd, HWND_TOP, 0, 0, this->screenWidth, this->screenHeight, SWP_SHOWWINDOW);
-        else
-            SetWindowPos(this->hWnd, HWND_TOP, 0, 0, this->render.width, this->render.height, SWP_SHOWWINDOW);
+            // Only use the full screen hack in wine since it might disrupt OBS and recording software.
+            if (IsWine())
+                SetWindowPos(this->hWnd, HWND_TOP, 0, 0, this->screenWidth, this->screenHeight, SWP_SHOWWINDOW);
+            else
+                SetWindowPos(this->hWnd, HWND_TOP, 0, 0, this->render.width, this->render.height, SWP_SHOWWINDOW);
 
-        if (ChangeDisplaySettings(&this->mode, CDS_FULLSCREEN) != DISP_CHANGE_SUCCESSFUL)
-        {
-            // odd height or half screenWidth/Height trigger scaling on invalid resolutions (hidden feature)
-            if (this->height % 2 != 0 || (this->width * 2 == this->screenWidth && this->height * 2 == this->screenHeight))
+            if (Modes_Change(&this->mode, CDS_FULLSCREEN) != DISP_CHANGE_SUCCESSFUL)
             {
-                this->mode.dmPelsWidth = StretchToWidth = this->screenWidth;
-                this->mode.dmPelsHeight = StretchToHeight = this->screenHeight;
+                // odd height or half screenWidth/Height trigger scaling on invalid resolutions (hidden feature)
+                if (this->height % 2 != 0 || (this->width * 2 == this->screenWidth && this->height * 2 == this->screenHeight))
+                {
+                    this->mode.dmPelsWidth = StretchToWidth = this->screenWidth;
+                    this->mode.dmPelsHeight = StretchToHeight = this->screenHeight;
 
-                if (ChangeDisplaySettings(&this->mode, CDS_FULLSCREEN) != DISP_CHANGE_SUCCESSFUL)
+                    if (Modes_Change(&this->mode, CDS_FULLSCREEN) != DISP_CHANGE_SUCCESSFUL)
+                        return DDERR_INVALIDMODE;
+                }
+                else
+                {
+                    dprintf("    mode change failed!\n");
                     return DDERR_INVALIDMODE;
-            }
-            else
-            {
-                dprintf("    mode change failed!\n");
-                return DDERR_INVALIDMODE;
+                }
             }
         }
-        SetWindowPos(ddraw->hWnd, HWND_TOP, 0, 0, 0, 0, SWP_NOSIZE|SWP_SHOWWINDOW);
 
-        POINT p = { 0, 0 };
-        ClientToScreen(this->dd->hWnd, &p);
-        GetClientRect(this->dd->hWnd, &this->winRect);
-        OffsetRect(&this->winRect, p.x, p.y);
+        SetWindowPos(ddraw->hWnd, HWND_TOP, 0, 0, 0, 0, SWP_NOSIZE|SWP_SHOWWINDOW);
 
+        Geometry_Update(this);
         mouse_lock(this);
     }
 
@@ -679,6 +667,9 @@ static HRESULT __stdcall _SetDisplayMode(IDirectDrawImpl *this, DWORD width, DWO
 
 BOOL WINAPI fake_SetWindowPos(HWND hWnd, HWND hWndInsertAfter, int X, int Y, int cx, int cy, UINT uFlags)
 {
+    if (ddraw && hWnd != ddraw->hWnd)
+        ChildWindows_Invalidate();
+
     if (!(uFlags & SWP_NOSIZE) && ddraw && hWnd == ddraw->hWnd)
     {
         SetWindowSize(ddraw, cx, cy);
@@ -700,22 +691,66 @@ BOOL WINAPI fake_MoveWindow(HWND hWnd, int X, int Y, int nWidth, int nHeight, BO
             ddraw->height = rc.bottom - rc.top;
         }
     }
+    else if (ddraw)
+    {
+        ChildWindows_Invalidate();
+    }
 
     return MoveWindow(hWnd, X, Y, nWidth, nHeight, bRepaint);
 }
 
-BOOL WINAPI fake_GetCursorPos(LPPOINT lpPoint)
+BOOL WINAPI fake_ShowWindow(HWND hWnd, int nCmdShow)
 {
-    if (InterlockedExchangeAdd(&ddraw->mouseIsLocked, 0) != 0)
-        return GetCursorPos(lpPoint);
+    if (ddraw && hWnd != ddraw->hWnd)
+        ChildWindows_Invalidate();
 
+    return ShowWindow(hWnd, nCmdShow);
+}
+
+/* Stretched output, a point relative to the client area to the game's resolution */
+void Viewport_ToGame(IDirectDrawImpl *this, POINT *pt)
+{
+    if (!this->render.stretched)
+        return;
+
+    pt->x = (LONG)((pt->x - this->render.viewport.x) / this->render.scaleW);
+    pt->y = (LONG)((pt->y - this->render.viewport.y) / this->render.scaleH);
+
+    pt->x = pt->x < 0 ? 0 : pt->x >= (LONG)this->width ? (LONG)this->width - 1 : pt->x;
+    pt->y = pt->y < 0 ? 0 : pt->y >= (LONG)this->height ? (LONG)this->height - 1 : pt->y;
+}
+
+/* And back, the pixel center so that Viewport_ToGame gives the same point again */
+void Viewport_FromGame(IDirectDrawImpl *this, POINT *pt)
+{
+    if (!this->render.stretched)
+        return;
+
+    pt->x = this->render.viewport.x + (LONG)((pt->x + 0.5f) * this->render.scaleW);
+    pt->y = this->render.viewport.y + (LONG)((pt->y + 0.5f) * this->render.scaleH);
+}
+
+BOOL WINAPI fake_GetCursorPos(LPPOINT lpPoint)
+{
     BOOL ret = GetCursorPos(lpPoint);
 
-    POINT tl = { 0, 0 };
-    POINT br = { ddraw->width, ddraw->height };
+    WindowGeometry geometry;
+    Geometry_Read(ddraw, &geometry);
 
-    ClientToScreen(ddraw->hWnd, &tl);
-    ClientToScreen(ddraw->hWnd, &br);
+    if (ret && ddraw->render.stretched)
+    {
+        POINT pt = { lpPoint->x - geometry.client.left, lpPoint->y - geometry.client.top };
+        Viewport_ToGame(ddraw, &pt);
+
+        lpPoint->x = geometry.client.left + pt.x;
+        lpPoint->y = geometry.client.top + pt.y;
+    }
+
+    if (InterlockedExchangeAdd(&ddraw->mouseIsLocked, 0) != 0)
+        return ret;
+
+    POINT tl = { geometry.client.left, geometry.client.top };
+    POINT br = { geometry.client.left + ddraw->width, geometry.client.top + ddraw->height };
 
     if (ret)
     {
@@ -729,6 +764,21 @@ BOOL WINAPI fake_GetCursorPos(LPPOINT lpPoint)
     return ret;
 }
 
+/* Games that warp the cursor do it in their own resolution */
+BOOL WINAPI fake_SetCursorPos(int X, int Y)
+{
+    if (!ddraw->render.stretched)
+        return SetCursorPos(X, Y);
+
+    WindowGeometry geometry;
+    Geometry_Read(ddraw, &geometry);
+
+    POINT pt = { X - geometry.client.left, Y - geometry.client.top };
+    Viewport_FromGame(ddraw, &pt);
+
+    return SetCursorPos(geometry.client.left + pt.x, geometry.client.top + pt.y);
+}
+
 BOOL UnadjustWindowRectEx(LPRECT prc, DWORD dwStyle, BOOL fMenu, DWORD dwExStyle)
 {
     RECT rc;
@@ -750,26 +800,20 @@ bool CaptureMouse = false;
 
 void mouse_lock(IDirectDrawImpl *this)
 {
-    RECT rc;
+    WindowGeometry geometry;
+    Geometry_Read(this, &geometry);
 
-    GetClientRect(this->hWnd, &rc);
+    // The client area in screen coordinates, only the picture when it is stretched
+    RECT rc = geometry.client;
 
-    if (ddraw->render.stretched)
+    if (this->render.stretched)
     {
-        rc.right = ddraw->width;
-        rc.bottom = ddraw->height;
+        SetRect(&rc, this->render.viewport.x, this->render.viewport.y,
+            this->render.viewport.x + this->render.viewport.width, this->render.viewport.y + this->render.viewport.height);
+        OffsetRect(&rc, geometry.client.left, geometry.client.top);
     }
-
-    // Convert the client area to screen coordinates.
-    POINT pt = { rc.left, rc.top };
-    POINT pt2 = { rc.right, rc.bottom };
-    ClientToScreen(this->hWnd, &pt);
-    ClientToScreen(this->hWnd, &pt2);
-
-    if (this->dwFlags & DDSCL_FULLSCREEN)
+    else if (this->dwFlags & DDSCL_FULLSCREEN)
         SetRect(&rc, 0, 0, this->width, this->height);
-    else
-        SetRect(&rc, pt.x, pt.y, pt2.x, pt2.y);
 
     ClipCursor(&rc);
     CaptureMouse = true;
@@ -789,19 +833,61 @@ void mouse_unlock(BOOL showCursor)
 
 void center_mouse(HWND hWnd)
 {
-    RECT size;
-    GetClientRect(hWnd, &size);
+    WindowGeometry geometry;
+    Geometry_Read(ddraw, &geometry);
+
+    int x = (geometry.client.right - geometry.client.left) / 2;
+    int y = (geometry.client.bottom - geometry.client.top) / 2;
 
     if (ddraw->render.stretched)
     {
-        size.right = ddraw->width;
-        size.bottom = ddraw->height;
+        x = ddraw->render.viewport.x + ddraw->render.viewport.width / 2;
+        y = ddraw->render.viewport.y + ddraw->render.viewport.height / 2;
     }
 
-    POINT pos = { 0, 0 };
-    ClientToScreen(hWnd, &pos);
+    SetCursorPos(x + geometry.client.left, y + geometry.client.top);
+}
 
-    SetCursorPos(size.right / 2 + pos.x, size.bottom / 2 + pos.y);
+/* Window thread. Queries the window once so that the cursor hooks and the
+ * renderer don't have to, winRect is kept in step for the old readers. */
+void Geometry_Update(IDirectDrawImpl *this)
+{
+    if (!this->hWnd)
+        return;
+
+    RECT client;
+    POINT p = { 0, 0 };
+    ClientToScreen(this->hWnd, &p);
+    GetClientRect(this->hWnd, &client);
+    OffsetRect(&client, p.x, p.y);
+
+    EnterCriticalSection(&this->geometry.writeLock);
+    InterlockedIncrement(&this->geometry.sequence);
+
+    this->geometry.data.client = client;
+    this->winRect = client;
+
+    InterlockedIncrement(&this->geometry.sequence);
+    LeaveCriticalSection(&this->geometry.writeLock);
+}
+
+/* Any thread, retries while Geometry_Update is in the middle of a write */
+void Geometry_Read(IDirectDrawImpl *this, WindowGeometry *geometry)
+{
+    for (;;)
+    {
+        LONG sequence = InterlockedExchangeAdd(&this->geometry.sequence, 0);
+
+        if (!(sequence & 1))
+        {
+            *geometry = this->geometry.data;
+
+            if (InterlockedExchangeAdd(&this->geometry.sequence, 0) == sequence)
+                return;
+        }
+
+        YieldProcessor();
+    }
 }
 
 
@@ -814,18 +900,32 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
 
     static BOOL fsActive = true;
 
+    // The game sees mouse messages in its own resolution, the wheel ones carry screen coordinates
+    if (((uMsg >= WM_MOUSEMOVE && uMsg <= WM_MBUTTONDBLCLK) || (uMsg >= WM_XBUTTONDOWN && uMsg <= WM_XBUTTONDBLCLK)) &&
+        this->render.stretched)
+    {
+        POINT pt = { (short)LOWORD(lParam), (short)HIWORD(lParam) };
+        Viewport_ToGame(this, &pt);
+        lParam = MAKELPARAM(pt.x, pt.y);
+    }
+
     switch(uMsg)
     {
         //Workaround for invisible menu on Load/Save/Delete in Tiberian Sun
         static int redrawCount = 0;
         case WM_PARENTNOTIFY:
         {
+            ChildWindows_Invalidate();
+
             if (LOWORD(wParam) == WM_DESTROY)
                 redrawCount = 2;
             break;
         }
         case WM_PAINT:
         {
+            InterlockedExchange(&this->render.repaint, TRUE);
+            ChildWindows_Repaint();
+
             if (redrawCount > 0)
             {
                 redrawCount--;
@@ -844,7 +944,17 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
         case WM_ACTIVATE:
             if (this->dwFlags & DDSCL_FULLSCREEN)
             {
-                if (wParam == WA_ACTIVE || wParam == WA_CLICKACTIVE)
+                if (Borderless)
+                {
+                    // No mode switch and no minimize, the window only needs its viewport back
+                    fsActive = wParam == WA_ACTIVE || wParam == WA_CLICKACTIVE;
+                    if (fsActive)
+                    {
+                        SetWindowSize(this, this->width, this->height);
+                        mouse_lock(this);
+                    }
+                }
+                else if (wParam == WA_ACTIVE || wParam == WA_CLICKACTIVE)
                 {
                     fsActive = true;
                     this->lpVtbl->SetDisplayMode(this, this->mode.dmPelsWidth, this->mode.dmPelsHeight, this->bpp);
@@ -856,7 +966,7 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
                 {
                     fsActive = false;
                     ShowWindow(this->hWnd, SW_MINIMIZE);
-                    ChangeDisplaySettings(&this->winMode, 0);
+                    Modes_Change(&this->winMode, 0);
                 }
             }
             else // windowed
@@ -888,8 +998,15 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
             wParam = WA_ACTIVE;
             break;
 
+        case WM_DISPLAYCHANGE:
+            Modes_DisplayChanged();
+            break;
+
         case WM_WINDOWPOSCHANGED:
         {
+            ChildWindows_Invalidate();
+            Geometry_Update(this);
+
             WINDOWPOS *pos = (WINDOWPOS *)lParam;
             if ((this->dwFlags & DDSCL_FULLSCREEN) && fsActive && IsWine()
                 && (pos->x > 1 || pos->y > 1))
@@ -918,23 +1035,14 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
             break;
 
         case WM_SIZE:
-            switch (wParam)
-            {
-            case SIZE_MAXIMIZED:
-            case SIZE_MAXSHOW:
-            case SIZE_RESTORED:
-                center_mouse(hWnd);
-            default: break;
-            }
         case WM_MOVE:
-            {
-                POINT p = { 0, 0 };
-                ClientToScreen(this->dd->hWnd, &p);
-                GetClientRect(this->dd->hWnd, &this->winRect);
-                OffsetRect(&this->winRect, p.x, p.y);
-                RedrawWindow(hWnd, NULL, NULL, RDW_INVALIDATE | RDW_ALLCHILDREN);
-                break;
-            }
+            Geometry_Update(this);
+
+            if (uMsg == WM_SIZE && (wParam == SIZE_MAXIMIZED || wParam == SIZE_MAXSHOW || wParam == SIZE_RESTORED))
+                center_mouse(hWnd);
+
+            RedrawWindow(hWnd, NULL, NULL, RDW_INVALIDATE | RDW_ALLCHILDREN);
+            break;
 
         /* don't ever tell they lose focus for real so they keep drawing
            Used for windowed mode but also fixes YR menus on alt+tab */
@@ -978,16 +1086,42 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
             if ((wParam == 0x52) && (GetAsyncKeyState(VK_RCONTROL) & 0x8000))
                 DrawFPS = !DrawFPS;
 
+            if ((wParam == 0x53) && (GetAsyncKeyState(VK_RCONTROL) & 0x8000))
+            {
+                if (ScreenshotScaled && InterlockedExchangeAdd(&Renderer, 0) == RENDERER_OPENGL)
+                {
+                    // The render thread reads back what it draws next
+                    Screenshot_Request();
+                }
+                else if (this->primary && this->primary->surface)
+                {
+                    IDirectDrawSurfaceImpl *primary = this->primary;
+                    PALETTEENTRY entries[256];
+
+                    IDirectDrawSurfaceImpl_FlushGpuBlits(primary);
+
+                    EnterCriticalSection(&primary->lock);
+                    if (primary->bpp == 8 && primary->palette)
+                        IDirectDrawPaletteImpl_Snapshot(primary->palette, entries);
+
+                    Screenshot_Capture((BYTE *)primary->surface + this->winRect.top * primary->lPitch + this->winRect.left * primary->lXPitch,
+                        primary->lPitch, this->width, this->height, primary->bpp, primary->palette ? entries : NULL);
+                    LeaveCriticalSection(&primary->lock);
+                }
+            }
+
             if ((wParam == VK_PRIOR) && (GetAsyncKeyState(VK_RCONTROL) & 0x8000))
             {
                 TargetFPS = TargetFPS + 20.0;
                 TargetFrameLen = 1000.0 / TargetFPS;
+                SettingsSaveInt("TargetFPS", (int)TargetFPS);
             }
 
             if ((wParam == VK_NEXT) && (GetAsyncKeyState(VK_RCONTROL) & 0x8000))
             {
                 TargetFPS = TargetFPS > 20.0 ? TargetFPS - 20.0 : TargetFPS;
                 TargetFrameLen = 1000.0 / TargetFPS;
+                SettingsSaveInt("TargetFPS", (int)TargetFPS);
             }
 
             if ((wParam == VK_END) && (GetAsyncKeyState(VK_RCONTROL) & 0x8000) && AutoRenderer == true)
@@ -1155,35 +1289,10 @@ static HRESULT __stdcall _SetCooperativeLevel(IDirectDrawImpl *this, HWND hWnd,
                 }
             }
 
-            POINT p = { 0, 0 };
-            ClientToScreen(this->hWnd, &p);
-            GetClientRect(this->hWnd, &this->winRect);
-            OffsetRect(&this->winRect, p.x, p.y);
+            Geometry_Update(this);
 
             if (SystemAffinity && ProcAffinity)
-            {
-                /* Sets all the threads of this process to CPU 1 */
-                HANDLE hThreadSnap = INVALID_HANDLE_VALUE;
-                DWORD dwOwnerPID = GetCurrentProcessId();
-                THREADENTRY32 te32;
-                te32.dwSize = sizeof(THREADENTRY32 );
-
-                // Take a snapshot of all running threads
-                hThreadSnap = CreateToolhelp32Snapshot( TH32CS_SNAPTHREAD, 0 );
-                if( hThreadSnap != INVALID_HANDLE_VALUE && Thread32First( hThreadSnap, &te32 ) )
-                {
-                    do
-                    {
-                        if( te32.th32OwnerProcessID == dwOwnerPID )
-                        {
-                            HANDLE thread = OpenThread(THREAD_ALL_ACCESS, FALSE, te32.th32ThreadID);
-                            if (thread)
-                                SetThreadAffinityMask(thread, ProcAffinity);
-                        }
-                    } while( Thread32Next(hThreadSnap, &te32 ) );
-                }
-                CloseHandle( hThreadSnap );
-            }
+                Affinity_PinGameThreads();
         }
     }
 
@@ -1196,7 +1305,25 @@ static HRESULT __stdcall _SetCooperativeLevel(IDirectDrawImpl *this, HWND hWnd,
 static HRESULT __stdcall _WaitForVerticalBlank(IDirectDrawImpl *this, DWORD dwFlags, HANDLE hEvent)
 {
     dprintf("--> IDirectDraw::WaitForVerticalBlank(this=%p, dwFlags=%08X, hEvent=%08X)\n", this, (int)dwFlags, (int)hEvent);
-    HRESULT ret = IDirectDraw_WaitForVerticalBlank(this->real, dwFlags, hEvent);
+    HRESULT ret = DD_OK;
+
+    if (PROXY)
+    {
+        ret = IDirectDraw_WaitForVerticalBlank(this->real, dwFlags, hEvent);
+    }
+    else if (dwFlags == DDWAITVB_BLOCKBEGIN || dwFlags == DDWAITVB_BLOCKEND)
+    {
+        // Lines up with the render thread's presents instead of a real retrace
+        VBlank_Wait(dwFlags == DDWAITVB_BLOCKEND, this->height);
+    }
+    else if (dwFlags == DDWAITVB_BLOCKBEGINEVENT)
+    {
+        ret = DDERR_UNSUPPORTED;
+    }
+    else
+    {
+        ret = DDERR_INVALIDPARAMS;
+    }
     dprintf("<-- IDirectDraw::WaitForVerticalBlank(this=%p, dwFlags=%08X, hEvent=%08X) -> %08X\n", this, (int)dwFlags, (int)hEvent, (int)ret);
     return ret;
 }
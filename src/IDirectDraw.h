@@ -27,12 +27,15 @@
 extern bool MaintainAspectRatio;
 extern bool Windowboxing;
 extern bool StretchToFullscreen;
+extern bool Borderless;
 extern int StretchToWidth;
 extern int StretchToHeight;
 
 BOOL WINAPI fake_SetWindowPos(HWND hWnd, HWND hWndInsertAfter, int X, int Y, int cx, int cy, UINT uFlags);
 BOOL WINAPI fake_MoveWindow(HWND hWnd, int X, int Y, int nWidth, int nHeight, BOOL bRepaint);
 BOOL WINAPI fake_GetCursorPos(LPPOINT lpPoint);
+BOOL WINAPI fake_ShowWindow(HWND hWnd, int nCmdShow);
+BOOL WINAPI fake_SetCursorPos(int X, int Y);
 
 BOOL UnadjustWindowRectEx(LPRECT prc, DWORD dwStyle, BOOL fMenu, DWORD dwExStyle);
 
@@ -67,6 +70,12 @@ struct IDirectDrawImplVtbl
     HRESULT(__stdcall *WaitForVerticalBlank)(IDirectDrawImpl *, DWORD, HANDLE);
 };
 
+/* Window position, published by Geometry_Update with a seqlock */
+typedef struct
+{
+    RECT client;
+} WindowGeometry;
+
 struct IDirectDrawImpl
 {
     struct IDirectDrawImplVtbl *lpVtbl;
@@ -95,6 +104,7 @@ struct IDirectDrawImpl
     struct
     {
         BOOL invalidate;
+        LONG repaint;
         BOOL stretched;
         int width;
         int height;
@@ -116,12 +126,22 @@ struct IDirectDrawImpl
         BOOL primaryPBO;
     } glInfo;
 
+    struct IDirectDrawSurfaceImpl *primary;
+
     LONG focusGained;
     LONG mouseIsLocked;
 
     LONG edgeDimension;
     LONG edgeValue;
     LONG edgeTimeoutMs;
+
+    // Written from the window messages and SetWindowSize only, odd sequence while writing
+    struct
+    {
+        volatile LONG sequence;
+        WindowGeometry data;
+        CRITICAL_SECTION writeLock;
+    } geometry;
 };
 
 #define EDGE_NULL 1
@@ -130,6 +150,10 @@ struct IDirectDrawImpl
 
 IDirectDrawImpl *IDirectDrawImpl_construct();
 void mouse_lock(IDirectDrawImpl *this);
+void Geometry_Update(IDirectDrawImpl *this);
+void Viewport_ToGame(IDirectDrawImpl *this, POINT *pt);
+void Viewport_FromGame(IDirectDrawImpl *this, POINT *pt);
+void Geometry_Read(IDirectDrawImpl *this, WindowGeometry *geometry);
 
 #define TIMER_FIX_WINDOWPOS 78
 #define TIMER_EDGE 79
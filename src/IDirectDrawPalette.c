@@ -0,0 +1,205 @@
+/*
+ * Copyright (c) 2013 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "main.h"
+#include "IDirectDrawPalette.h"
+
+static IDirectDrawPaletteImplVtbl Vtbl;
+
+IDirectDrawPaletteImpl *IDirectDrawPaletteImpl_construct(DWORD dwFlags, LPPALETTEENTRY lpColorTable)
+{
+    dprintf("--> IDirectDrawPalette::construct(dwFlags=%08X, lpColorTable=%p)\n", (int)dwFlags, lpColorTable);
+
+    IDirectDrawPaletteImpl *this = calloc(1, sizeof(IDirectDrawPaletteImpl));
+    this->lpVtbl = &Vtbl;
+    this->dwCaps = dwFlags;
+    InitializeCriticalSection(&this->lock);
+
+    if (lpColorTable)
+    {
+        int count = (dwFlags & DDPCAPS_4BIT) ? 16 : (dwFlags & DDPCAPS_2BIT) ? 4 : (dwFlags & DDPCAPS_1BIT) ? 2 : 256;
+        memcpy(this->entries, lpColorTable, count * sizeof(PALETTEENTRY));
+    }
+
+    this->ref++;
+
+    dprintf("<-- IDirectDrawPalette::construct() -> %p\n", this);
+    return this;
+}
+
+/* Copies the current entries for the renderer, returns the generation they belong to */
+LONG IDirectDrawPaletteImpl_Snapshot(IDirectDrawPaletteImpl *this, PALETTEENTRY *entries)
+{
+    EnterCriticalSection(&this->lock);
+    LONG generation = this->generation;
+    memcpy(entries, this->entries, sizeof(this->entries));
+    LeaveCriticalSection(&this->lock);
+    return generation;
+}
+
+static HRESULT __stdcall _QueryInterface(IDirectDrawPaletteImpl *this, REFIID riid, void **obj)
+{
+    dprintf("--> IDirectDrawPalette::QueryInterface(this=%p, riid=%08X, obj=%p)\n", this, (unsigned int)riid, obj);
+
+    HRESULT ret = DDERR_UNSUPPORTED;
+
+    if (this->real)
+    {
+        ret = IDirectDrawPalette_QueryInterface(this->real, riid, obj);
+    }
+
+    dprintf("<-- IDirectDrawPalette::QueryInterface(this=%p, riid=%08X, obj=%p) -> %08X\n", this, (unsigned int)riid, obj, (int)ret);
+    return ret;
+}
+
+static ULONG __stdcall _AddRef(IDirectDrawPaletteImpl *this)
+{
+    dprintf("--> IDirectDrawPalette::AddRef(this=%p)\n", this);
+
+    ULONG ret = InterlockedIncrement((LONG *)&this->ref);
+
+    if (this->real)
+    {
+        ret = IDirectDrawPalette_AddRef(this->real);
+    }
+
+    dprintf("<-- IDirectDrawPalette::AddRef(this=%p) -> %08X\n", this, (int)ret);
+    return ret;
+}
+
+static ULONG __stdcall _Release(IDirectDrawPaletteImpl *this)
+{
+    dprintf("--> IDirectDrawPalette::Release(this=%p)\n", this);
+
+    ULONG ret = InterlockedDecrement((LONG *)&this->ref);
+
+    if (this->real)
+    {
+        ret = IDirectDrawPalette_Release(this->real);
+    }
+
+    if (this->ref == 0)
+    {
+        DeleteCriticalSection(&this->lock);
+        free(this);
+    }
+
+    dprintf("<-- IDirectDrawPalette::Release(this=%p) -> %08X\n", this, (int)ret);
+    return ret;
+}
+
+static HRESULT __stdcall _GetCaps(IDirectDrawPaletteImpl *this, LPDWORD lpdwCaps)
+{
+    dprintf("--> IDirectDrawPalette::GetCaps(this=%p, lpdwCaps=%p)\n", this, lpdwCaps);
+
+    HRESULT ret = DD_OK;
+
+    if (this->real)
+    {
+        ret = IDirectDrawPalette_GetCaps(this->real, lpdwCaps);
+    }
+    else if (lpdwCaps)
+    {
+        *lpdwCaps = this->dwCaps;
+    }
+    else
+    {
+        ret = DDERR_INVALIDPARAMS;
+    }
+
+    dprintf("<-- IDirectDrawPalette::GetCaps(this=%p, lpdwCaps=%p) -> %08X\n", this, lpdwCaps, (int)ret);
+    return ret;
+}
+
+static HRESULT __stdcall _GetEntries(IDirectDrawPaletteImpl *this, DWORD dwFlags, DWORD dwBase, DWORD dwNumEntries, LPPALETTEENTRY lpEntries)
+{
+    dprintf("--> IDirectDrawPalette::GetEntries(this=%p, dwFlags=%08X, dwBase=%d, dwNumEntries=%d, lpEntries=%p)\n", this, (int)dwFlags, (int)dwBase, (int)dwNumEntries, lpEntries);
+
+    HRESULT ret = DD_OK;
+
+    if (this->real)
+    {
+        ret = IDirectDrawPalette_GetEntries(this->real, dwFlags, dwBase, dwNumEntries, lpEntries);
+    }
+    else if (!lpEntries || dwBase > 255 || dwNumEntries > 256 - dwBase)
+    {
+        ret = DDERR_INVALIDPARAMS;
+    }
+    else
+    {
+        EnterCriticalSection(&this->lock);
+        memcpy(lpEntries, &this->entries[dwBase], dwNumEntries * sizeof(PALETTEENTRY));
+        LeaveCriticalSection(&this->lock);
+    }
+
+    dprintf("<-- IDirectDrawPalette::GetEntries(this=%p, dwFlags=%08X, dwBase=%d, dwNumEntries=%d, lpEntries=%p) -> %08X\n", this, (int)dwFlags, (int)dwBase, (int)dwNumEntries, lpEntries, (int)ret);
+    return ret;
+}
+
+static HRESULT __stdcall _Initialize(IDirectDrawPaletteImpl *this, LPDIRECTDRAW lpDD, DWORD dwFlags, LPPALETTEENTRY lpDDColorTable)
+{
+    dprintf("--> IDirectDrawPalette::Initialize(this=%p, lpDD=%p, dwFlags=%08X, lpDDColorTable=%p)\n", this, lpDD, (int)dwFlags, lpDDColorTable);
+
+    /* palettes are always created initialized through IDirectDraw::CreatePalette */
+    HRESULT ret = DDERR_ALREADYINITIALIZED;
+
+    if (this->real)
+    {
+        ret = IDirectDrawPalette_Initialize(this->real, lpDD, dwFlags, lpDDColorTable);
+    }
+
+    dprintf("<-- IDirectDrawPalette::Initialize(this=%p, lpDD=%p, dwFlags=%08X, lpDDColorTable=%p) -> %08X\n", this, lpDD, (int)dwFlags, lpDDColorTable, (int)ret);
+    return ret;
+}
+
+static HRESULT __stdcall _SetEntries(IDirectDrawPaletteImpl *this, DWORD dwFlags, DWORD dwStartingEntry, DWORD dwCount, LPPALETTEENTRY lpEntries)
+{
+    dprintf("--> IDirectDrawPalette::SetEntries(this=%p, dwFlags=%08X, dwStartingEntry=%d, dwCount=%d, lpEntries=%p)\n", this, (int)dwFlags, (int)dwStartingEntry, (int)dwCount, lpEntries);
+
+    HRESULT ret = DD_OK;
+
+    if (this->real)
+    {
+        ret = IDirectDrawPalette_SetEntries(this->real, dwFlags, dwStartingEntry, dwCount, lpEntries);
+    }
+    else if (!lpEntries || dwStartingEntry > 255 || dwCount > 256 - dwStartingEntry)
+    {
+        ret = DDERR_INVALIDPARAMS;
+    }
+    else
+    {
+        EnterCriticalSection(&this->lock);
+        memcpy(&this->entries[dwStartingEntry], lpEntries, dwCount * sizeof(PALETTEENTRY));
+        this->generation++;
+        LeaveCriticalSection(&this->lock);
+    }
+
+    dprintf("<-- IDirectDrawPalette::SetEntries(this=%p, dwFlags=%08X, dwStartingEntry=%d, dwCount=%d, lpEntries=%p) -> %08X\n", this, (int)dwFlags, (int)dwStartingEntry, (int)dwCount, lpEntries, (int)ret);
+    return ret;
+}
+
+static struct IDirectDrawPaletteImplVtbl Vtbl =
+{
+    /* IUnknown */
+    _QueryInterface,
+    _AddRef,
+    _Release,
+    /* IDirectDrawPalette */
+    _GetCaps,
+    _GetEntries,
+    _Initialize,
+    _SetEntries
+};
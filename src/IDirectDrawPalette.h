@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2013 Toni Spets <toni.spets@iki.fi>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <windows.h>
+#include "ddraw.h"
+#include "main.h"
+
+#ifndef IDIRECTDRAWPALETTE_H
+#define IDIRECTDRAWPALETTE_H
+
+typedef struct IDirectDrawPaletteImplVtbl IDirectDrawPaletteImplVtbl;
+typedef struct IDirectDrawPaletteImpl IDirectDrawPaletteImpl;
+
+struct IDirectDrawPaletteImplVtbl
+{
+    /* IUnknown */
+    HRESULT (__stdcall *QueryInterface)(IDirectDrawPaletteImpl *, REFIID, void **);
+    ULONG (__stdcall *AddRef)(IDirectDrawPaletteImpl *);
+    ULONG (__stdcall *Release)(IDirectDrawPaletteImpl *);
+
+    /* IDirectDrawPalette */
+    HRESULT (__stdcall *GetCaps)(IDirectDrawPaletteImpl *, LPDWORD);
+    HRESULT (__stdcall *GetEntries)(IDirectDrawPaletteImpl *, DWORD, DWORD, DWORD, LPPALETTEENTRY);
+    HRESULT (__stdcall *Initialize)(IDirectDrawPaletteImpl *, LPDIRECTDRAW, DWORD, LPPALETTEENTRY);
+    HRESULT (__stdcall *SetEntries)(IDirectDrawPaletteImpl *, DWORD, DWORD, DWORD, LPPALETTEENTRY);
+};
+
+struct IDirectDrawPaletteImpl
+{
+    struct IDirectDrawPaletteImplVtbl *lpVtbl;
+
+    IDirectDrawPalette *real;
+
+    int ref;
+    DWORD dwCaps;
+
+    CRITICAL_SECTION lock;
+    /* bumped on every SetEntries so the renderer only re-uploads on change */
+    LONG generation;
+    PALETTEENTRY entries[256];
+};
+
+IDirectDrawPaletteImpl *IDirectDrawPaletteImpl_construct(DWORD dwFlags, LPPALETTEENTRY lpColorTable);
+LONG IDirectDrawPaletteImpl_Snapshot(IDirectDrawPaletteImpl *this, PALETTEENTRY *entries);
+
+#endif
@@ -17,6 +17,11 @@
 #include "main.h"
 #include "IDirectDrawClipper.h"
 #include "IDirectDrawSurface.h"
+#include "convert.h"
+#include "surfacepool.h"
+#include "guardpage.h"
+#include "counter.h"
+#include "pool.h"
 #include <stdint.h>
 #include <stdio.h>
 
@@ -24,6 +29,40 @@ DWORD WINAPI render(IDirectDrawSurfaceImpl *this);
 
 static IDirectDrawSurfaceImplVtbl Vtbl;
 
+static LONG surfaceIdCounter = 0;
+
+/* Tiberian Sun sometimes tries to access lines that are past the bottom of the screen,
+ * with GuardPages they are only committed once touched */
+static const int guardLines = 200;
+
+static void FillPixelFormat(IDirectDrawSurfaceImpl *this, LPDDPIXELFORMAT lpDDPixelFormat)
+{
+    lpDDPixelFormat->dwSize = 32;
+    lpDDPixelFormat->dwRGBBitCount = this->bpp;
+
+    if (this->bpp == 8)
+    {
+        lpDDPixelFormat->dwFlags = DDPF_RGB | DDPF_PALETTEINDEXED8;
+        lpDDPixelFormat->dwRBitMask = 0;
+        lpDDPixelFormat->dwGBitMask = 0;
+        lpDDPixelFormat->dwBBitMask = 0;
+    }
+    else if (this->bpp == 32)
+    {
+        lpDDPixelFormat->dwFlags = DDPF_RGB;
+        lpDDPixelFormat->dwRBitMask = 0x00FF0000;
+        lpDDPixelFormat->dwGBitMask = 0x0000FF00;
+        lpDDPixelFormat->dwBBitMask = 0x000000FF;
+    }
+    else
+    {
+        lpDDPixelFormat->dwFlags = DDPF_RGB;
+        lpDDPixelFormat->dwRBitMask = 0xF800;
+        lpDDPixelFormat->dwGBitMask = 0x07E0;
+        lpDDPixelFormat->dwBBitMask = 0x001F;
+    }
+}
+
 /* the TS hack itself */
 
 IDirectDrawSurfaceImpl *IDirectDrawSurfaceImpl_construct(IDirectDrawImpl *lpDDImpl, LPDDSURFACEDESC lpDDSurfaceDesc)
@@ -39,7 +78,7 @@ IDirectDrawSurfaceImpl *IDirectDrawSurfaceImpl_construct(IDirectDrawImpl *lpDDIm
 
     if (lpDDSurfaceDesc->dwWidth && lpDDSurfaceDesc->dwHeight)
     {
-        this->width = (lpDDSurfaceDesc->dwWidth +1) / 2 * 2;
+        this->width = lpDDSurfaceDesc->dwWidth;
         this->height = lpDDSurfaceDesc->dwHeight;
     }
     else
@@ -48,6 +87,12 @@ IDirectDrawSurfaceImpl *IDirectDrawSurfaceImpl_construct(IDirectDrawImpl *lpDDIm
         this->height = this->dd->screenHeight;
     }
 
+    // DIB rows are DWORD aligned, keep lPitch equal to the DIB stride
+    if (this->bpp == 8)
+        this->width = (this->width + 3) / 4 * 4;
+    else
+        this->width = (this->width + 1) / 2 * 2;
+
     if (lpDDSurfaceDesc->dwFlags & DDSD_CAPS)
     {
         this->dwCaps = lpDDSurfaceDesc->ddsCaps.dwCaps;
@@ -67,54 +112,84 @@ IDirectDrawSurfaceImpl *IDirectDrawSurfaceImpl_construct(IDirectDrawImpl *lpDDIm
     this->lXPitch = this->bpp / 8;
     this->lPitch = this->width * this->lXPitch;
 
-    /* Tiberian Sun sometimes tries to access lines that are past the bottom of the screen */
-    int guardLines = 200;
-
-    this->hDC = CreateCompatibleDC(this->dd->hDC);
+    if (AlignedPitch)
+    {
+        // DIB sections are page aligned, so a padded pitch puts every row on a cache line
+        this->lPitch = (this->lPitch + SURFACE_ROW_ALIGN - 1) & ~(SURFACE_ROW_ALIGN - 1);
+    }
 
     this->desc.dwFlags = DDSD_WIDTH | DDSD_HEIGHT | DDSD_PITCH | DDSD_PIXELFORMAT | DDSD_LPSURFACE;
     this->desc.dwWidth = this->width;
     this->desc.dwHeight = this->height;
     this->desc.lPitch = this->lPitch;
-    this->desc.ddpfPixelFormat.dwSize = 32;
-    this->desc.ddpfPixelFormat.dwFlags = DDPF_RGB;
-    this->desc.ddpfPixelFormat.dwRGBBitCount = this->bpp;
-    this->desc.ddpfPixelFormat.dwRBitMask = 0xF800;
-    this->desc.ddpfPixelFormat.dwGBitMask = 0x07E0;
-    this->desc.ddpfPixelFormat.dwBBitMask = 0x001F;
+    FillPixelFormat(this, &this->desc.ddpfPixelFormat);
 
     this->desc.dwFlags = 0x0000100F;
     this->desc.ddsCaps.dwCaps = this->dwCaps;
 
-    this->bmi = calloc(1, sizeof(BITMAPINFO) + (sizeof(RGBQUAD) * 3));
-    this->bmi->bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
-    this->bmi->bmiHeader.biWidth = this->width;
-    this->bmi->bmiHeader.biHeight = -(this->height + guardLines);
-    this->bmi->bmiHeader.biPlanes = 1;
-    this->bmi->bmiHeader.biBitCount = this->bpp;
-    this->bmi->bmiHeader.biCompression = BI_BITFIELDS;
+    SurfaceMemory mem;
 
-    ((DWORD *)this->bmi->bmiColors)[0] = this->desc.ddpfPixelFormat.dwRBitMask;
-    ((DWORD *)this->bmi->bmiColors)[1] = this->desc.ddpfPixelFormat.dwGBitMask;
-    ((DWORD *)this->bmi->bmiColors)[2] = this->desc.ddpfPixelFormat.dwBBitMask;
+    // The primary is set up for the renderer, only offscreen surfaces are recycled
+    if (!(this->dwCaps & DDSCAPS_PRIMARYSURFACE) && SurfacePool_Acquire(this->width, this->height, this->bpp, &mem))
+    {
+        this->hDC = mem.hDC;
+        this->bitmap = mem.bitmap;
+        this->section = mem.section;
+        this->defaultBM = mem.defaultBM;
+        this->bmi = mem.bmi;
+        this->surface = mem.bits;
+
+        // New surfaces have always been zeroed
+        GuardPages_Clear(this->surface, mem.bytes);
+    }
+    else
+    {
+        this->hDC = CreateCompatibleDC(this->dd->hDC);
 
-    this->bitmap = CreateDIBSection(this->hDC, this->bmi, DIB_RGB_COLORS, (void **)&this->surface, NULL, 0);
-    this->defaultBM = SelectObject(this->hDC, this->bitmap);
-    this->bmi->bmiHeader.biHeight = -this->height;
+        this->bmi = calloc(1, sizeof(BITMAPINFOHEADER) + (sizeof(RGBQUAD) * 256));
+        this->bmi->bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+        this->bmi->bmiHeader.biWidth = this->lPitch / this->lXPitch;
+        this->bmi->bmiHeader.biHeight = -(this->height + guardLines);
+        this->bmi->bmiHeader.biPlanes = 1;
+        this->bmi->bmiHeader.biBitCount = this->bpp;
+
+        if (this->bpp == 8)
+        {
+            // Color table is filled in from the palette by the renderer (primary) or GetDC
+            this->bmi->bmiHeader.biCompression = BI_RGB;
+            this->bmi->bmiHeader.biClrUsed = 256;
+        }
+        else
+        {
+            this->bmi->bmiHeader.biCompression = BI_BITFIELDS;
+
+            ((DWORD *)this->bmi->bmiColors)[0] = this->desc.ddpfPixelFormat.dwRBitMask;
+            ((DWORD *)this->bmi->bmiColors)[1] = this->desc.ddpfPixelFormat.dwGBitMask;
+            ((DWORD *)this->bmi->bmiColors)[2] = this->desc.ddpfPixelFormat.dwBBitMask;
+        }
+
+        this->bitmap = GuardPages_CreateDIBSection(this->hDC, this->bmi, (size_t)this->lPitch * this->height,
+            (void **)&this->surface, &this->section);
+        this->defaultBM = SelectObject(this->hDC, this->bitmap);
+        this->bmi->bmiHeader.biHeight = -this->height;
+    }
 
     this->usingPBO = false;
     this->systemSurface = this->surface;
 
     InitializeCriticalSection(&this->lock);
 
+    this->id = InterlockedIncrement(&surfaceIdCounter);
+
     if (this->dwCaps & DDSCAPS_PRIMARYSURFACE)
     {
+        this->dd->primary = this;
+
         this->syncEvent = CreateEvent(NULL, true, false, NULL);
         this->pSurfaceReady = CreateEvent(NULL, true, false, NULL);
 
         dprintf("Starting renderer.\n");
         this->thread = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)render, (LPVOID)this, 0, NULL);
-        SetThreadAffinityMask(this->thread, SystemAffinity);
         SetThreadPriorityBoost(this->thread, TRUE);
         WaitForSingleObject(this->pSurfaceReady, INFINITE);
     }
@@ -161,6 +236,15 @@ static ULONG __stdcall _Release(IDirectDrawSurfaceImpl *this)
 
     if (this->ref == 0)
     {
+        if (this->gpuBlitPending > 0 && this->dd->primary)
+            IDirectDrawSurfaceImpl_FlushGpuBlits(this->dd->primary);
+
+        if (this->dd->primary == this)
+        {
+            IDirectDrawSurfaceImpl_FlushGpuBlits(this);
+            this->dd->primary = NULL;
+        }
+
         if (this->thread)
         {
             HANDLE thread = this->thread;
@@ -171,8 +255,20 @@ static ULONG __stdcall _Release(IDirectDrawSurfaceImpl *this)
         }
 
         DeleteCriticalSection(&this->lock);
-        DeleteObject(this->bitmap);
-        DeleteDC(this->hDC);
+
+        SurfaceMemory mem = {
+            this->width, this->height, this->bpp, (size_t)this->lPitch * (this->height + guardLines),
+            this->hDC, this->bitmap, this->section, this->defaultBM, this->bmi, this->systemSurface
+        };
+
+        if ((this->dwCaps & DDSCAPS_PRIMARYSURFACE) || !SurfacePool_Release(&mem))
+        {
+            SelectObject(this->hDC, this->defaultBM);
+            GuardPages_DeleteDIBSection(this->bitmap, this->section);
+            DeleteDC(this->hDC);
+            free(this->bmi);
+        }
+
         if (this->overlayBitmap)
         {
             this->overlay = NULL;
@@ -186,6 +282,10 @@ static ULONG __stdcall _Release(IDirectDrawSurfaceImpl *this)
         {
             free(this->pbo);
         }
+        if (this->palette)
+        {
+            this->palette->lpVtbl->Release(this->palette);
+        }
         free(this);
     }
 
@@ -205,6 +305,193 @@ HRESULT __stdcall _AddOverlayDirtyRect(IDirectDrawSurfaceImpl *this, LPRECT a)
     return DD_OK;
 }
 
+/* Copies the blits that were left for the OpenGL renderer into the primary memory.
+ * Has to happen before anything writes to the primary or to one of the sources. */
+void IDirectDrawSurfaceImpl_FlushGpuBlits(IDirectDrawSurfaceImpl *this)
+{
+    EnterCriticalSection(&this->lock);
+
+    for (int i = 0; i < this->gpuBlitCount; i++)
+    {
+        GpuBlitEntry *e = &this->gpuBlits[i];
+
+        int byte_width = (e->dstRect.right - e->dstRect.left) * this->lXPitch;
+        int h = e->dstRect.bottom - e->dstRect.top;
+
+        uint8_t *dest_base = (uint8_t*)this->surface + (e->dstRect.left * this->lXPitch) + (this->lPitch * e->dstRect.top);
+        uint8_t *src_base = (uint8_t*)e->src->surface + (e->srcRect.left * e->src->lXPitch) + (e->src->lPitch * e->srcRect.top);
+
+        while (h-- > 0)
+        {
+            memcpy((void *)dest_base, (void *)src_base, byte_width);
+
+            dest_base += this->lPitch;
+            src_base += e->src->lPitch;
+        }
+
+        InterlockedDecrement(&e->src->gpuBlitPending);
+    }
+
+    // Deferred blits that ended up copied after all, GpuBlit_Prepare logs them
+    InterlockedExchangeAdd(&this->gpuBlitFlushed, this->gpuBlitCount);
+    this->gpuBlitCount = 0;
+
+    LeaveCriticalSection(&this->lock);
+}
+
+static void BeginWrite(IDirectDrawSurfaceImpl *this)
+{
+    if (this->gpuBlitCount > 0)
+        IDirectDrawSurfaceImpl_FlushGpuBlits(this);
+
+    if (this->gpuBlitPending > 0 && this->dd->primary)
+        IDirectDrawSurfaceImpl_FlushGpuBlits(this->dd->primary);
+
+    InterlockedIncrement(&this->writeGeneration);
+}
+
+/* Offscreen surfaces that are blitted to the primary over and over without being
+ * written to are left to the renderer, it keeps them as textures and draws the
+ * blits as quads on top of the primary. */
+static BOOL DeferBlt(IDirectDrawSurfaceImpl *this, IDirectDrawSurfaceImpl *srcImpl, RECT *src, RECT *dst, DWORD dwFlags)
+{
+    if (!GpuBlitCache || !InterlockedExchangeAdd(&this->gpuBlitEnabled, 0))
+        return FALSE;
+
+    if (!(this->dwCaps & DDSCAPS_PRIMARYSURFACE) || (srcImpl->dwCaps & DDSCAPS_PRIMARYSURFACE) ||
+        (dwFlags & DDBLT_COLORFILL) || srcImpl->bpp != this->bpp || !srcImpl->surface)
+        return FALSE;
+
+    if (dst->right - dst->left != src->right - src->left || dst->bottom - dst->top != src->bottom - src->top ||
+        dst->left < 0 || dst->top < 0 || src->left < 0 || src->top < 0 ||
+        dst->right <= dst->left || dst->bottom <= dst->top)
+        return FALSE;
+
+    if (srcImpl->blitGeneration != srcImpl->writeGeneration)
+    {
+        srcImpl->blitGeneration = srcImpl->writeGeneration;
+        srcImpl->staticBlits = 0;
+        return FALSE;
+    }
+
+    if (srcImpl->staticBlits < GPU_BLIT_MIN_REPEATS)
+    {
+        srcImpl->staticBlits++;
+        return FALSE;
+    }
+
+    EnterCriticalSection(&this->lock);
+
+    // Blits that are completely covered by this one will never be seen again
+    int count = 0;
+    for (int i = 0; i < this->gpuBlitCount; i++)
+    {
+        GpuBlitEntry *e = &this->gpuBlits[i];
+
+        if (e->dstRect.left >= dst->left && e->dstRect.top >= dst->top &&
+            e->dstRect.right <= dst->right && e->dstRect.bottom <= dst->bottom)
+        {
+            InterlockedDecrement(&e->src->gpuBlitPending);
+            continue;
+        }
+
+        this->gpuBlits[count++] = *e;
+    }
+    this->gpuBlitCount = count;
+
+    if (this->gpuBlitCount == GPU_BLIT_MAX)
+        IDirectDrawSurfaceImpl_FlushGpuBlits(this);
+
+    GpuBlitEntry *e = &this->gpuBlits[this->gpuBlitCount++];
+    e->src = srcImpl;
+    e->srcId = srcImpl->id;
+    e->srcGeneration = srcImpl->writeGeneration;
+    e->srcRect = *src;
+    e->dstRect = *dst;
+    InterlockedIncrement(&srcImpl->gpuBlitPending);
+
+    LeaveCriticalSection(&this->lock);
+    return TRUE;
+}
+
+/* GDI would color match palettized DIBs and the PBO primary has no DIB behind it,
+ * those rows are copied by hand. A pitch that isn't the DIB stride (the odd pitch
+ * radar surface) would make BitBlt read the wrong rows as well. */
+static BOOL CanBitBlt(IDirectDrawSurfaceImpl *this)
+{
+    LONG dibPitch = ((this->bmi->bmiHeader.biWidth * this->bpp + 31) / 32) * 4;
+    return !this->usingPBO && this->bpp != 8 && this->lPitch == dibPitch;
+}
+
+/* Large fills and 8 bpp stretches are split into row bands on the pixel pool */
+typedef struct
+{
+    IDirectDrawSurfaceImpl *dst;
+    IDirectDrawSurfaceImpl *src;
+    RECT dstRect;
+    RECT srcRect;
+    DWORD color;
+} BltJob;
+
+static void FillRows(void *ctx, int y0, int y1)
+{
+    BltJob *job = ctx;
+    IDirectDrawSurfaceImpl *this = job->dst;
+    int dst_w = job->dstRect.right - job->dstRect.left;
+
+    for (int y = y0; y < y1; y++)
+    {
+        uint8_t *row = (uint8_t *)this->surface + this->lPitch * (y + job->dstRect.top) + job->dstRect.left * this->lXPitch;
+
+        if (this->bpp == 8)
+        {
+            memset(row, (uint8_t)job->color, dst_w);
+        }
+        else if (this->bpp == 32)
+        {
+            for (int x = 0; x < dst_w; x++)
+            {
+                ((uint32_t *)row)[x] = job->color;
+            }
+        }
+        else
+        {
+            for (int x = 0; x < dst_w; x++)
+            {
+                ((uint16_t *)row)[x] = job->color;
+            }
+        }
+    }
+}
+
+static void StretchRows8(void *ctx, int y0, int y1)
+{
+    BltJob *job = ctx;
+    int dst_w = job->dstRect.right - job->dstRect.left;
+    int dst_h = job->dstRect.bottom - job->dstRect.top;
+    int src_w = job->srcRect.right - job->srcRect.left;
+    int src_h = job->srcRect.bottom - job->srcRect.top;
+
+    for (int y = y0; y < y1; y++)
+    {
+        uint8_t *dest_row = (uint8_t *)job->dst->surface + job->dst->lPitch * (job->dstRect.top + y) + job->dstRect.left;
+        uint8_t *src_row = (uint8_t *)job->src->surface + job->src->lPitch * (job->srcRect.top + y * src_h / dst_h) + job->srcRect.left;
+
+        for (int x = 0; x < dst_w; x++)
+            dest_row[x] = src_row[x * src_w / dst_w];
+    }
+}
+
+#ifdef _DEBUG
+/* copy blit throughput, logged to compare pitch layouts */
+static struct
+{
+    double time;
+    double bytes;
+    int count;
+} bltStats;
+#endif
+
 static HRESULT __stdcall _Blt(IDirectDrawSurfaceImpl *this, LPRECT lpDestRect, LPDIRECTDRAWSURFACE lpDDSrcSurface, LPRECT lpSrcRect, DWORD dwFlags, LPDDBLTFX lpDDBltFx)
 {
     ENTER;
@@ -246,27 +533,24 @@ static HRESULT __stdcall _Blt(IDirectDrawSurfaceImpl *this, LPRECT lpDestRect, L
                 dst.bottom = this->height;
         }
 
+        if (srcImpl && srcImpl->gpuBlitCount > 0)
+            IDirectDrawSurfaceImpl_FlushGpuBlits(srcImpl);
+
+        BOOL deferred = srcImpl && DeferBlt(this, srcImpl, &src, &dst, dwFlags);
+        if (!deferred)
+            BeginWrite(this);
+
         if ((dwFlags & DDBLT_COLORFILL) && this->surface)
         {
             EnterCriticalSection(&this->lock);
 
-            int dst_w = dst.right - dst.left;
-            int dst_h = dst.bottom - dst.top;
-
-            for (int y = 0; y < dst_h; y++)
-            {
-                int ydst = this->width * (y + dst.top);
-
-                for (int x = 0; x < dst_w; x++)
-                {
-                    this->surface[x + dst.left + ydst] = lpDDBltFx->dwFillColor;
-                }
-            }
+            BltJob job = { this, NULL, dst, dst, lpDDBltFx->dwFillColor };
+            Pool_ParallelRows(dst.bottom - dst.top, (dst.right - dst.left) * this->lXPitch, FillRows, &job);
 
             LeaveCriticalSection(&this->lock);
         }
 
-        if (lpDDSrcSurface)
+        if (lpDDSrcSurface && !deferred)
         {
             EnterCriticalSection(&this->lock);
 
@@ -278,13 +562,17 @@ static HRESULT __stdcall _Blt(IDirectDrawSurfaceImpl *this, LPRECT lpDestRect, L
 
             int dst_byte_width = dst_w * this->lXPitch;
 
+#ifdef _DEBUG
+            QPCounter bltCounter;
+            CounterStart(&bltCounter);
+#endif
+
             if (dst_w == src_w && dst_h == src_h)
             {
-                if (this->usingPBO)
+                if (!CanBitBlt(this) || !CanBitBlt(srcImpl))
                 {
-                    // Sometimes radar surface will have an odd lPitch, BitBlt won't work in those cases
                     uint8_t *dest_base = (uint8_t*)this->surface + (dst.left * this->lXPitch) + (this->lPitch * dst.top);
-                    uint8_t *src_base = (uint8_t*)srcImpl->surface + (src.left * this->lXPitch) + (srcImpl->lPitch * src.top);
+                    uint8_t *src_base = (uint8_t*)srcImpl->surface + (src.left * srcImpl->lXPitch) + (srcImpl->lPitch * src.top);
 
                     while (dst_h-- > 0)
                     {
@@ -297,10 +585,27 @@ static HRESULT __stdcall _Blt(IDirectDrawSurfaceImpl *this, LPRECT lpDestRect, L
                 else
                     BitBlt(this->hDC, dst.left, dst.top, dst_w, dst_h, srcImpl->hDC, src.left, src.top, SRCCOPY);
             }
+            else if (this->bpp == 8)
+            {
+                BltJob job = { this, srcImpl, dst, src, 0 };
+                Pool_ParallelRows(dst_h, dst_w, StretchRows8, &job);
+            }
             else
             {
                 StretchBlt(this->hDC, dst.left, dst.top, dst_w, dst_h, srcImpl->hDC, src.left, src.top, src_w, src_h, SRCCOPY);
             }
+
+#ifdef _DEBUG
+            bltStats.time += CounterGet(&bltCounter);
+            bltStats.bytes += (double)dst_byte_width * (dst.bottom - dst.top);
+
+            if (++bltStats.count == 1000)
+            {
+                dprintf("Blt: %d blits, %.1f MB/s, pitch %d\n", bltStats.count,
+                    bltStats.time > 0.0 ? bltStats.bytes / 1048.576 / bltStats.time : 0.0, (int)this->lPitch);
+                memset(&bltStats, 0, sizeof(bltStats));
+            }
+#endif
             LeaveCriticalSection(&this->lock);
         }
     }
@@ -409,12 +714,7 @@ static HRESULT __stdcall _GetSurfaceDesc(IDirectDrawSurfaceImpl *this, LPDDSURFA
         lpDDSurfaceDesc->dwWidth = this->width;
         lpDDSurfaceDesc->dwHeight = this->height;
         lpDDSurfaceDesc->lPitch = this->lPitch;
-        lpDDSurfaceDesc->ddpfPixelFormat.dwSize = 32;
-        lpDDSurfaceDesc->ddpfPixelFormat.dwFlags = DDPF_RGB;
-        lpDDSurfaceDesc->ddpfPixelFormat.dwRGBBitCount = this->bpp;
-        lpDDSurfaceDesc->ddpfPixelFormat.dwRBitMask = 0xF800;
-        lpDDSurfaceDesc->ddpfPixelFormat.dwGBitMask = 0x07E0;
-        lpDDSurfaceDesc->ddpfPixelFormat.dwBBitMask = 0x001F;
+        FillPixelFormat(this, &lpDDSurfaceDesc->ddpfPixelFormat);
 
         lpDDSurfaceDesc->dwFlags = 0x0000100F;
         lpDDSurfaceDesc->ddsCaps.dwCaps = this->dwCaps;
@@ -495,6 +795,55 @@ HRESULT __stdcall _GetColorKey(IDirectDrawSurfaceImpl *this, DWORD a, LPDDCOLORK
     return DD_OK;
 }
 
+/* The renderer keeps the primary's color tables in sync. Offscreen 8 bpp surfaces
+ * refresh their overlay table from the attached palette, or the primary's, whenever
+ * GetDC hands it out, otherwise GDI would draw against an all black table. */
+static void SyncOverlayColors(IDirectDrawSurfaceImpl *this)
+{
+    IDirectDrawSurfaceImpl *primary = this->dd->primary;
+    IDirectDrawPaletteImpl *palette = this->palette;
+
+    if (this->bpp != 8 || (this->dwCaps & DDSCAPS_PRIMARYSURFACE))
+        return;
+
+    if (!palette && primary)
+    {
+        EnterCriticalSection(&primary->lock);
+        palette = primary->palette;
+        if (palette)
+            palette->lpVtbl->AddRef(palette);
+        LeaveCriticalSection(&primary->lock);
+    }
+    else if (palette)
+    {
+        palette->lpVtbl->AddRef(palette);
+    }
+
+    if (!palette)
+        return;
+
+    if (palette != this->overlayPalette || palette->generation != this->overlayGeneration)
+    {
+        PALETTEENTRY entries[256];
+
+        this->overlayPalette = palette;
+        this->overlayGeneration = IDirectDrawPaletteImpl_Snapshot(palette, entries);
+
+        for (int i = 0; i < 256; i++)
+        {
+            this->bmi->bmiColors[i].rgbRed = entries[i].peRed;
+            this->bmi->bmiColors[i].rgbGreen = entries[i].peGreen;
+            this->bmi->bmiColors[i].rgbBlue = entries[i].peBlue;
+            this->bmi->bmiColors[i].rgbReserved = 0;
+        }
+
+        if (this->overlayDC)
+            SetDIBColorTable(this->overlayDC, 0, 256, this->bmi->bmiColors);
+    }
+
+    palette->lpVtbl->Release(palette);
+}
+
 HRESULT __stdcall _GetDC(IDirectDrawSurfaceImpl *this, HDC FAR *lphDC)
 {
     dprintf("--> IDirectDrawSurface::GetDC(this=%p, lphDC=%p)\n", this, lphDC);
@@ -509,13 +858,21 @@ HRESULT __stdcall _GetDC(IDirectDrawSurfaceImpl *this, HDC FAR *lphDC)
     {
         if (!this->overlayDC)
         {
+            // A new overlay always takes the current palette below
+            this->overlayPalette = NULL;
             this->overlayDC = CreateCompatibleDC(this->dd->hDC);
             this->overlayBitmap = CreateDIBSection(this->overlayDC, this->bmi, DIB_RGB_COLORS, (void **)&this->overlay, NULL, 0);
         }
 
+        BeginWrite(this);
+
         EnterCriticalSection(&this->lock);
         *lphDC = this->overlayDC;
         SelectObject(this->overlayDC, this->overlayBitmap);
+        SyncOverlayColors(this);
+
+        // ReleaseDC only merges what was drawn in between
+        SetBoundsRect(this->overlayDC, NULL, DCB_RESET | DCB_ENABLE);
     }
 
     dprintf("<-- IDirectDrawSurface::GetDC(this=%p, lphDC=%p) -> %08X\n", this, lphDC, (int)ret);
@@ -536,19 +893,38 @@ HRESULT __stdcall _GetOverlayPosition(IDirectDrawSurfaceImpl *this, LPLONG a, LP
 
 HRESULT __stdcall _GetPalette(IDirectDrawSurfaceImpl *this, LPDIRECTDRAWPALETTE FAR *lplpDDPalette)
 {
-    dprintf("IDirectDrawSurface::GetPalette(this=%p, lplpDDPalette=%p)\n", this, lplpDDPalette);
-    return DD_OK;
+    dprintf("--> IDirectDrawSurface::GetPalette(this=%p, lplpDDPalette=%p)\n", this, lplpDDPalette);
+
+    HRESULT ret = DD_OK;
+
+    if (PROXY)
+    {
+        ret = IDirectDrawSurface_GetPalette(this->real, lplpDDPalette);
+    }
+    else if (!lplpDDPalette)
+    {
+        ret = DDERR_INVALIDPARAMS;
+    }
+    else
+    {
+        EnterCriticalSection(&this->lock);
+        *lplpDDPalette = (LPDIRECTDRAWPALETTE)this->palette;
+        if (this->palette)
+            this->palette->lpVtbl->AddRef(this->palette);
+        else
+            ret = DDERR_NOPALETTEATTACHED;
+        LeaveCriticalSection(&this->lock);
+    }
+
+    dprintf("<-- IDirectDrawSurface::GetPalette(this=%p, lplpDDPalette=%p) -> %08X\n", this, lplpDDPalette, (int)ret);
+    return ret;
 }
 
 HRESULT __stdcall _GetPixelFormat(IDirectDrawSurfaceImpl *this, LPDDPIXELFORMAT lpDDPixelFormat)
 {
     dprintf("--> IDirectDrawSurface::GetPixelFormat(this=%p, lpDDPixelFormat=%p)\n", this, lpDDPixelFormat);
 
-    lpDDPixelFormat->dwFlags = DDPF_RGB;
-    lpDDPixelFormat->dwRGBBitCount = this->bpp;
-    lpDDPixelFormat->dwRBitMask = 0xF800;
-    lpDDPixelFormat->dwGBitMask = 0x07E0;
-    lpDDPixelFormat->dwBBitMask = 0x001F;
+    FillPixelFormat(this, lpDDPixelFormat);
 
     dprintf("<-- IDirectDrawSurface::GetPixelFormat(this=%p, lpDDPixelFormat=%p)\n", this, lpDDPixelFormat);
     return DD_OK;
@@ -594,17 +970,14 @@ static HRESULT __stdcall _Lock(IDirectDrawSurfaceImpl *this, LPRECT lpDestRect,
     }
     else
     {
+        BeginWrite(this);
+
         lpDDSurfaceDesc->dwFlags |= DDSD_WIDTH|DDSD_HEIGHT|DDSD_PITCH|DDSD_PIXELFORMAT|DDSD_LPSURFACE;
         lpDDSurfaceDesc->dwWidth = this->width;
         lpDDSurfaceDesc->dwHeight = this->height;
         lpDDSurfaceDesc->lPitch = this->lPitch;
         lpDDSurfaceDesc->lpSurface = this->surface;
-        lpDDSurfaceDesc->ddpfPixelFormat.dwSize = 32;
-        lpDDSurfaceDesc->ddpfPixelFormat.dwFlags = DDPF_RGB;
-        lpDDSurfaceDesc->ddpfPixelFormat.dwRGBBitCount = this->bpp;
-        lpDDSurfaceDesc->ddpfPixelFormat.dwRBitMask = 0xF800;
-        lpDDSurfaceDesc->ddpfPixelFormat.dwGBitMask = 0x07E0;
-        lpDDSurfaceDesc->ddpfPixelFormat.dwBBitMask = 0x001F;
+        FillPixelFormat(this, &lpDDSurfaceDesc->ddpfPixelFormat);
         lpDDSurfaceDesc->dwFlags = 0x0000100F;
         lpDDSurfaceDesc->ddsCaps.dwCaps = 0x10004000;
         lpDDSurfaceDesc->ddsCaps.dwCaps = this->dwCaps;
@@ -621,8 +994,7 @@ static HRESULT __stdcall _Lock(IDirectDrawSurfaceImpl *this, LPRECT lpDestRect,
     return ret;
 }
 
-#define OVERLAY_TRANSPARENCY_RGB RGB(0,0,0)
-#define OVERLAY_TRANSPARENCY_WORD 0x0000
+#define OVERLAY_TRANSPARENCY_BYTE 0x00
 
 HRESULT __stdcall _ReleaseDC(IDirectDrawSurfaceImpl *this, HDC hDC)
 {
@@ -637,9 +1009,34 @@ HRESULT __stdcall _ReleaseDC(IDirectDrawSurfaceImpl *this, HDC hDC)
     }
     else
     {
-        StretchBlt(this->hDC, 0, 0, this->width, this->height, this->overlayDC, 0, 0, this->width, this->height, SRCPAINT);
-        RECT rc = { 0, 0, this->width, this->height };
-        FillRect(this->overlayDC, &rc, CreateSolidBrush(OVERLAY_TRANSPARENCY_RGB));
+        RECT rc;
+        RECT surface = { 0, 0, this->width, this->height };
+        UINT bounds = GetBoundsRect(this->overlayDC, &rc, DCB_RESET);
+
+        // DCB_SET is DCB_RESET | DCB_ACCUMULATE, only DCB_RESET alone means nothing was drawn
+        if (bounds == 0)
+            rc = surface;
+        else if ((bounds & DCB_SET) == DCB_RESET)
+            SetRectEmpty(&rc);
+
+        if (IntersectRect(&rc, &rc, &surface) && this->overlay)
+        {
+            GdiFlush();
+
+            int byte_left = rc.left * this->lXPitch;
+            int byte_width = (rc.right - rc.left) * this->lXPitch;
+
+            // OR the touched area onto the surface like SRCPAINT did and clear it back to transparent
+            for (int y = rc.top; y < rc.bottom; y++)
+            {
+                uint8_t *overlay_row = (uint8_t *)this->overlay + this->lPitch * y + byte_left;
+
+                Convert_OrBytes((uint8_t *)this->surface + this->lPitch * y + byte_left, overlay_row, byte_width);
+                memset(overlay_row, OVERLAY_TRANSPARENCY_BYTE, byte_width);
+            }
+        }
+
+        SetBoundsRect(this->overlayDC, NULL, DCB_DISABLE);
         LeaveCriticalSection(&this->lock);
     }
 
@@ -688,8 +1085,38 @@ HRESULT __stdcall _SetOverlayPosition(IDirectDrawSurfaceImpl *this, LONG a, LONG
 
 HRESULT __stdcall _SetPalette(IDirectDrawSurfaceImpl *this, LPDIRECTDRAWPALETTE lpDDPalette)
 {
-    dprintf("IDirectDrawSurface::SetPalette(this=%p, lpDDPalette=%p)\n", this, lpDDPalette);
-    return DD_OK;
+    dprintf("--> IDirectDrawSurface::SetPalette(this=%p, lpDDPalette=%p)\n", this, lpDDPalette);
+
+    HRESULT ret = DD_OK;
+    IDirectDrawPaletteImpl *impl = (IDirectDrawPaletteImpl *)lpDDPalette;
+
+    if (PROXY)
+    {
+        ret = IDirectDrawSurface_SetPalette(this->real, impl ? impl->real : NULL);
+    }
+    else if (this->bpp != 8)
+    {
+        ret = DDERR_NOTPALETTIZED;
+    }
+    else
+    {
+        if (impl)
+            impl->lpVtbl->AddRef(impl);
+
+        EnterCriticalSection(&this->lock);
+        IDirectDrawPaletteImpl *old = this->palette;
+        this->palette = impl;
+        // force the renderer to pick up the new entries
+        this->paletteGeneration = impl ? impl->generation - 1 : 0;
+        this->overlayPalette = NULL;
+        LeaveCriticalSection(&this->lock);
+
+        if (old)
+            old->lpVtbl->Release(old);
+    }
+
+    dprintf("<-- IDirectDrawSurface::SetPalette(this=%p, lpDDPalette=%p) -> %08X\n", this, lpDDPalette, (int)ret);
+    return ret;
 }
 
 static HRESULT __stdcall _Unlock(IDirectDrawSurfaceImpl *this, LPVOID lpRect)
@@ -19,6 +19,7 @@
 #include "ddraw.h"
 #include "main.h"
 #include "IDirectDraw.h"
+#include "IDirectDrawPalette.h"
 
 #define FRAME_SAMPLES 30
 #define WM_SWITCHRENDERER WM_USER+112
@@ -26,6 +27,19 @@
 typedef struct IDirectDrawSurfaceImplVtbl IDirectDrawSurfaceImplVtbl;
 typedef struct IDirectDrawSurfaceImpl IDirectDrawSurfaceImpl;
 
+/* offscreen blits to the primary that are composed by the OpenGL renderer (GpuBlitCache) */
+#define GPU_BLIT_MAX 64
+#define GPU_BLIT_MIN_REPEATS 3
+
+typedef struct
+{
+    IDirectDrawSurfaceImpl *src;
+    LONG srcId;
+    LONG srcGeneration;
+    RECT srcRect;
+    RECT dstRect;
+} GpuBlitEntry;
+
 struct IDirectDrawSurfaceImpl
 {
     IDirectDrawSurfaceImplVtbl *lpVtbl;
@@ -47,6 +61,7 @@ struct IDirectDrawSurfaceImpl
     DDSURFACEDESC desc;
     PBITMAPINFO bmi;
     HBITMAP bitmap;
+    HANDLE section;
     HDC hDC;
     CRITICAL_SECTION lock;
     HANDLE thread;
@@ -55,6 +70,23 @@ struct IDirectDrawSurfaceImpl
     HDC overlayDC;
     HBITMAP overlayBitmap;
 
+    IDirectDrawPaletteImpl *palette;
+    LONG paletteGeneration;
+    /* palette the overlay color table was last filled from (offscreen surfaces) */
+    IDirectDrawPaletteImpl *overlayPalette;
+    LONG overlayGeneration;
+
+    LONG id;
+    LONG writeGeneration;
+    LONG blitGeneration;
+    int staticBlits;
+    LONG gpuBlitPending;
+
+    LONG gpuBlitEnabled;
+    int gpuBlitCount;
+    LONG gpuBlitFlushed;
+    GpuBlitEntry gpuBlits[GPU_BLIT_MAX];
+
     HANDLE syncEvent;
     HANDLE pSurfaceReady;
 
@@ -114,3 +146,4 @@ struct IDirectDrawSurfaceImplVtbl
 };
 
 IDirectDrawSurfaceImpl *IDirectDrawSurfaceImpl_construct(IDirectDrawImpl*, LPDDSURFACEDESC);
+void IDirectDrawSurfaceImpl_FlushGpuBlits(IDirectDrawSurfaceImpl *this);
@@ -1,40 +1,299 @@
 #include <windows.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
 #include "IDirectDraw.h"
 #include "main.h"
+#include "affinity.h"
+#include "Settings.h"
 
 static bool GetBool(LPCTSTR key, bool defaultValue);
+static int GetInt(LPCSTR key, int defaultValue, int min, int max);
+static DWORD GetString(LPCSTR key, LPCSTR defaultValue, char *value, DWORD size);
 LONG GetRenderer(LPCSTR key, char *defaultValue, bool *autoRenderer);
 LONG GetFixedOutput(LPCSTR key, char *defaultValue);
-#define GetInt(a,b) GetPrivateProfileInt(SettingsSection,a,b,SettingsPath)
-#define GetString(a,b,c,d) GetPrivateProfileString(SettingsSection,a,b,c,d,SettingsPath)
+LONG GetGdiScaler(LPCSTR key, char *defaultValue);
 
 static const char SettingsSection[] = "ddraw";
 static const char SettingsPath[] = ".\\ddraw.ini";
 
+#define SETTINGS_MAX_KEYS 256
+
+/* ddraw.ini is read once into this table instead of once per key by the
+ * GetPrivateProfile functions, the values point into text. Keys from the
+ * [ddraw.<exe name>] profile come before the ones from [ddraw]. */
+static struct
+{
+    char *text;
+    int count;
+    struct
+    {
+        const char *key;
+        const char *value;
+        bool profile;
+    } entries[SETTINGS_MAX_KEYS];
+
+    char exeName[MAX_PATH];
+    char profile[MAX_PATH];
+    bool hasProfile;
+
+    CRITICAL_SECTION lock;
+    bool lockReady;
+    HANDLE watch;
+    FILETIME written;
+} ini;
+
+/* Settings the render thread can apply while the game runs */
+typedef struct
+{
+    int targetFPS;
+    int drawFPS;
+    bool vsync;
+    LONG gdiScaler;
+    char shaderChain[sizeof(ShaderChain)];
+    bool glFinish;
+    bool glFenceSync;
+} LiveSettings;
+
+static LiveSettings live;
+
+static char *Trim(char *str)
+{
+    while (*str == ' ' || *str == '\t')
+        str++;
+
+    char *end = str + strlen(str);
+    while (end > str && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r'))
+        *--end = 0;
+
+    return str;
+}
+
+/* [ddraw.game] or [ddraw.game.exe] for game.exe */
+static bool IsProfile(const char *section)
+{
+    size_t prefix = sizeof(SettingsSection) - 1;
+    size_t length = strlen(ini.exeName);
+
+    if (!ini.exeName[0] || _strnicmp(section, SettingsSection, prefix) != 0 || section[prefix] != '.')
+        return false;
+
+    section += prefix + 1;
+    return _strnicmp(section, ini.exeName, length) == 0 && (section[length] == 0 || _strcmpi(section + length, ".exe") == 0);
+}
+
+/* The profile is picked once, by the executable that loaded us */
+static void FindProfile()
+{
+    char path[MAX_PATH] = { 0 };
+    GetModuleFileName(NULL, path, sizeof(path) - 1);
+
+    char *name = strrchr(path, '\\');
+    name = name ? name + 1 : path;
+
+    char *ext = strrchr(name, '.');
+    if (ext && _strcmpi(ext, ".exe") == 0)
+        *ext = 0;
+
+    _snprintf(ini.exeName, sizeof(ini.exeName) - 1, "%s", name);
+    _snprintf(ini.profile, sizeof(ini.profile) - 1, "%s.%s", SettingsSection, name);
+}
+
+static void SettingsParse()
+{
+    free(ini.text);
+    ini.text = NULL;
+    ini.count = 0;
+    ini.hasProfile = false;
+
+    FILE *fp = fopen(SettingsPath, "rb");
+    if (!fp)
+        return;
+
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    ini.text = size >= 0 ? malloc(size + 1) : NULL;
+    if (!ini.text || fread(ini.text, 1, size, fp) != (size_t)size)
+    {
+        fclose(fp);
+        free(ini.text);
+        ini.text = NULL;
+        return;
+    }
+
+    fclose(fp);
+    ini.text[size] = 0;
+
+    bool inSection = false, inProfile = false;
+    char *next = ini.text;
+
+    while (next)
+    {
+        char *line = next;
+
+        next = strchr(line, '\n');
+        if (next)
+            *next++ = 0;
+
+        line = Trim(line);
+
+        if (*line == ';' || *line == '#' || *line == 0)
+            continue;
+
+        if (*line == '[')
+        {
+            char *end = strchr(line, ']');
+            if (end)
+                *end = 0;
+
+            char *name = Trim(line + 1);
+            inSection = _strcmpi(name, SettingsSection) == 0;
+            inProfile = IsProfile(name);
+
+            // Written back to the section that is there, with or without .exe
+            if (inProfile && !ini.hasProfile)
+            {
+                _snprintf(ini.profile, sizeof(ini.profile) - 1, "%s", name);
+                ini.hasProfile = true;
+            }
+            continue;
+        }
+
+        char *equals = strchr(line, '=');
+        if ((!inSection && !inProfile) || !equals || ini.count == SETTINGS_MAX_KEYS)
+            continue;
+
+        *equals = 0;
+        char *value = Trim(equals + 1);
+        size_t length = strlen(value);
+
+        // Quotes around a value are dropped, like GetPrivateProfileString does
+        if (length >= 2 && (value[0] == '"' || value[0] == '\'') && value[length - 1] == value[0])
+        {
+            value[length - 1] = 0;
+            value++;
+        }
+
+        ini.entries[ini.count].key = Trim(line);
+        ini.entries[ini.count].value = value;
+        ini.entries[ini.count].profile = inProfile;
+        ini.count++;
+    }
+}
+
+static const char *GetValue(LPCSTR key)
+{
+    // The first one wins when a key is there twice, the profile before [ddraw]
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (int i = 0; i < ini.count; i++)
+        {
+            if (ini.entries[i].profile == (pass == 0) && _strcmpi(ini.entries[i].key, key) == 0)
+                return ini.entries[i].value;
+        }
+    }
+
+    return NULL;
+}
+
+static void ReadLive(LiveSettings *settings)
+{
+    settings->targetFPS = GetInt("TargetFPS", 0, 0, 1000);
+    settings->drawFPS = GetInt("DrawFPS", DrawFPS, 0, 2);
+    settings->vsync = GetBool("VSync", false);
+    settings->gdiScaler = GetGdiScaler("GdiScaler", "stretchblt");
+    GetString("ShaderChain", "", settings->shaderChain, sizeof(settings->shaderChain));
+    settings->glFinish = GetBool("GlFinish", GlFinish);
+    settings->glFenceSync = GetBool("GlFenceSync", GlFenceSync);
+}
+
+static DWORD CompareLive(const LiveSettings *a, const LiveSettings *b)
+{
+    DWORD changed = 0;
+
+    if (a->targetFPS != b->targetFPS)
+        changed |= SETTINGS_TARGETFPS;
+    if (a->drawFPS != b->drawFPS)
+        changed |= SETTINGS_DRAWFPS;
+    if (a->vsync != b->vsync)
+        changed |= SETTINGS_VSYNC;
+    if (a->gdiScaler != b->gdiScaler)
+        changed |= SETTINGS_GDISCALER;
+    if (strcmp(a->shaderChain, b->shaderChain) != 0)
+        changed |= SETTINGS_SHADERCHAIN;
+    if (a->glFinish != b->glFinish)
+        changed |= SETTINGS_GLFINISH;
+    if (a->glFenceSync != b->glFenceSync)
+        changed |= SETTINGS_GLFENCESYNC;
+
+    return changed;
+}
+
+/* Only the changed ones, the renderer adjusts some of the globals after loading
+ * (TargetFPS 0 becomes the refresh rate, a failed GdiScaler falls back) */
+static void ApplyLive(const LiveSettings *settings, DWORD changed)
+{
+    if (changed & SETTINGS_TARGETFPS)
+        TargetFPS = (double)settings->targetFPS;
+    if (changed & SETTINGS_DRAWFPS)
+        DrawFPS = settings->drawFPS;
+    if (changed & SETTINGS_VSYNC)
+        SwapInterval = settings->vsync ? 1 : 0;
+    if (changed & SETTINGS_GDISCALER)
+        InterlockedExchange(&GdiScaler, settings->gdiScaler);
+    if (changed & SETTINGS_SHADERCHAIN)
+        memcpy(ShaderChain, settings->shaderChain, sizeof(ShaderChain));
+    if (changed & SETTINGS_GLFINISH)
+        GlFinish = settings->glFinish;
+    if (changed & SETTINGS_GLFENCESYNC)
+        GlFenceSync = settings->glFenceSync;
+}
+
+static BOOL GetWriteTime(FILETIME *written)
+{
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesEx(SettingsPath, GetFileExInfoStandard, &data))
+        return FALSE;
+
+    *written = data.ftLastWriteTime;
+    return TRUE;
+}
+
 void SettingsLoad()
 {
+    if (!ini.lockReady)
+    {
+        InitializeCriticalSection(&ini.lock);
+        ini.lockReady = true;
+    }
+
+    EnterCriticalSection(&ini.lock);
+
+    FindProfile();
+    SettingsParse();
+    GetWriteTime(&ini.written);
+
+    if (ini.hasProfile)
+        dprintf("Settings: using profile [%s]\n", ini.profile);
+
     MaintainAspectRatio = GetBool("MaintainAspectRatio", MaintainAspectRatio);
     Windowboxing = GetBool("Windowboxing", Windowboxing);
     StretchToFullscreen = GetBool("StretchToFullscreen", StretchToFullscreen);
-    StretchToWidth = GetInt("StretchToWidth", StretchToWidth);
-    StretchToHeight = GetInt("StretchToHeight", StretchToHeight);
-    DrawFPS = GetInt("DrawFPS", DrawFPS);
+    Borderless = GetBool("Borderless", Borderless);
+    StretchToWidth = GetInt("StretchToWidth", StretchToWidth, 0, 16384);
+    StretchToHeight = GetInt("StretchToHeight", StretchToHeight, 0, 16384);
     InterlockedExchange(&Renderer, GetRenderer("Renderer", "auto", &AutoRenderer));
 
     PrimarySurface2Tex = GetBool("PrimarySurface2Tex", PrimarySurface2Tex);
-    GlFinish = GetBool("GlFinish", GlFinish);
     ConvertOnGPU = GetBool("ConvertOnGPU", true);
 
-    TargetFPS = (double)GetInt("TargetFPS", 0);
+    ReadLive(&live);
+    ApplyLive(&live, SETTINGS_ALL);
     TargetFrameLen = 16;
 
-    if (GetBool("VSync", false))
-        SwapInterval = 1;
-    else
-        SwapInterval = 0;
-
     // Disabled since this doesn't work with the OpenGL texture tests
     //InterlockedExchange(&PrimarySurfacePBO, GetInt("PrimarySurfacePBO", PrimarySurfacePBO));
 
@@ -61,9 +320,8 @@ void SettingsLoad()
         break;
 
     case 1:
-        // If SingleProcAffinity was set to Yes
-        SetProcessAffinityMask(GetCurrentProcess(), 1);
-        ProcAffinity = SystemAffinity = 0;
+        // If SingleProcAffinity was set to Yes, the game keeps one processor and we get the other cores
+        Affinity_Plan();
         break;
 
     case 0:
@@ -73,18 +331,161 @@ void SettingsLoad()
         break;
     }
 
-    MonitorEdgeTimer = GetInt("MonitorEdgeTimer", MonitorEdgeTimer);
+    MonitorEdgeTimer = GetInt("MonitorEdgeTimer", MonitorEdgeTimer, 0, 60000);
+
+    GpuBlitCache = GetBool("GpuBlitCache", GpuBlitCache);
+
+    GdiScalerThreads = GetInt("GdiScalerThreads", GdiScalerThreads, -1, 7);
+    SurfacePoolSize = GetInt("SurfacePoolSize", SurfacePoolSize, 0, 4096);
+    AlignedPitch = GetBool("AlignedPitch", AlignedPitch);
+    GuardPages = GetBool("GuardPages", GuardPages);
+    GetString("FrameExport", "", FrameExport, sizeof(FrameExport));
+    FrameExportXrgb = GetBool("FrameExportXrgb", FrameExportXrgb);
+    GetString("Record", "", Record, sizeof(Record));
+    GetString("Screenshot", "screenshot", Screenshot, sizeof(Screenshot));
+    ScreenshotScaled = GetBool("ScreenshotScaled", ScreenshotScaled);
+    PoolThreads = GetInt("PoolThreads", PoolThreads, -1, 8);
 
-    GlFenceSync = GetBool("GlFenceSync", GlFenceSync);
+    // Processor mask, hex with 0x
+    char mask[16];
+    GetString("PoolAffinity", "0", mask, sizeof(mask));
+    PoolAffinity = strtoul(mask, NULL, 0);
+    PresentPipeline = GetBool("PresentPipeline", PresentPipeline);
 
     FixedOutput = GetFixedOutput("FixedOutput", "stretch");
+
+    LeaveCriticalSection(&ini.lock);
+}
+
+/* Render thread, once a frame. Re-reads ddraw.ini after it was saved and applies
+ * the live settings, returns which of them changed (SETTINGS_*). */
+DWORD SettingsReload()
+{
+    if (!ini.watch)
+    {
+        ini.watch = FindFirstChangeNotification(".", FALSE, FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME);
+        if (ini.watch == INVALID_HANDLE_VALUE)
+            dprintf("Settings: can't watch for ddraw.ini changes\n");
+    }
+
+    if (ini.watch == INVALID_HANDLE_VALUE || WaitForSingleObject(ini.watch, 0) != WAIT_OBJECT_0)
+        return 0;
+
+    FindNextChangeNotification(ini.watch);
+    EnterCriticalSection(&ini.lock);
+
+    // Other files in the directory change too
+    FILETIME written;
+    if (!GetWriteTime(&written) || CompareFileTime(&written, &ini.written) == 0)
+    {
+        LeaveCriticalSection(&ini.lock);
+        return 0;
+    }
+
+    ini.written = written;
+    SettingsParse();
+
+    LiveSettings settings;
+    ReadLive(&settings);
+
+    DWORD changed = CompareLive(&settings, &live);
+
+    // VSync overrides TargetFPS in the renderer, turning it off brings the configured one back
+    if (changed & SETTINGS_VSYNC)
+        changed |= SETTINGS_TARGETFPS;
+
+    live = settings;
+    ApplyLive(&live, changed);
+
+    LeaveCriticalSection(&ini.lock);
+
+    dprintf("Settings: ddraw.ini reloaded, changes %02X\n", (int)changed);
+    return changed;
+}
+
+/* Render thread teardown, the next render thread opens its own watch */
+void SettingsUnwatch()
+{
+    if (ini.watch && ini.watch != INVALID_HANDLE_VALUE)
+        FindCloseChangeNotification(ini.watch);
+
+    ini.watch = NULL;
+}
+
+/* Stores a value the game measured or changed in its profile, it is used from
+ * the next start on. Our own writes don't count as a reload. */
+void SettingsSave(LPCSTR key, LPCSTR value)
+{
+    if (!ini.lockReady || !ini.exeName[0])
+        return;
+
+    EnterCriticalSection(&ini.lock);
+
+    if (WritePrivateProfileString(ini.profile, key, value, SettingsPath))
+    {
+        dprintf("Settings: [%s] %s=%s\n", ini.profile, key, value);
+
+        SettingsParse();
+        GetWriteTime(&ini.written);
+        ReadLive(&live);
+    }
+
+    LeaveCriticalSection(&ini.lock);
+}
+
+void SettingsSaveInt(LPCSTR key, int value)
+{
+    char buf[16];
+    _snprintf(buf, sizeof(buf) - 1, "%d", value);
+    buf[sizeof(buf) - 1] = 0;
+
+    SettingsSave(key, buf);
+}
+
+static DWORD GetString(LPCSTR key, LPCSTR defaultValue, char *value, DWORD size)
+{
+    const char *found = GetValue(key);
+
+    if (size == 0)
+        return 0;
+
+    _snprintf(value, size - 1, "%s", found ? found : defaultValue);
+    value[size - 1] = 0;
+    return (DWORD)strlen(value);
+}
+
+static int GetInt(LPCSTR key, int defaultValue, int min, int max)
+{
+    const char *found = GetValue(key);
+    if (!found)
+        return defaultValue;
+
+    char *end;
+    long value = strtol(found, &end, 10);
+
+    if (end == found || value < min || value > max)
+    {
+        dprintf("Settings: %s=%s is not a number from %d to %d, using %d\n", key, found, min, max, defaultValue);
+        return defaultValue;
+    }
+
+    return (int)value;
 }
 
 static bool GetBool(LPCTSTR key, bool defaultValue)
 {
-    char value[8];
-    GetString(key, defaultValue ? "Yes" : "No", value, 8);
-    return (_strcmpi(value, "yes") == 0 || _strcmpi(value, "true") == 0 || _strcmpi(value, "1") == 0);
+    const char *value = GetValue(key);
+    if (!value)
+        return defaultValue;
+
+    if (_strcmpi(value, "yes") == 0 || _strcmpi(value, "true") == 0 || _strcmpi(value, "1") == 0)
+        return true;
+
+    if (_strcmpi(value, "no") == 0 || _strcmpi(value, "false") == 0 || _strcmpi(value, "0") == 0)
+        return false;
+
+    dprintf("Settings: %s=%s is not a boolean, using %s\n", key, value, defaultValue ? "yes" : "no");
+    return defaultValue;
 }
 
 LONG GetRenderer(LPCSTR key, char *defaultValue, bool *autoRenderer)
@@ -134,3 +535,23 @@ LONG GetFixedOutput(LPCSTR key, char *defaultValue)
     }
     return DMDFO_DEFAULT;
 }
+
+LONG GetGdiScaler(LPCSTR key, char *defaultValue)
+{
+    char value[256];
+    GetString(key, defaultValue, value, 256);
+
+    if (_strcmpi(value, "nearest") == 0)
+    {
+        return SCALER_NEAREST;
+    }
+    else if (_strcmpi(value, "integer") == 0)
+    {
+        return SCALER_INTEGER;
+    }
+    else if (_strcmpi(value, "bilinear") == 0)
+    {
+        return SCALER_BILINEAR;
+    }
+    return SCALER_STRETCHBLT;
+}
@@ -2,6 +2,20 @@
 #ifndef _SETTINGS_
 #define _SETTINGS_
 
+// Settings SettingsReload can change while the game runs
+#define SETTINGS_TARGETFPS 0x01
+#define SETTINGS_DRAWFPS 0x02
+#define SETTINGS_VSYNC 0x04
+#define SETTINGS_GDISCALER 0x08
+#define SETTINGS_SHADERCHAIN 0x10
+#define SETTINGS_GLFINISH 0x20
+#define SETTINGS_GLFENCESYNC 0x40
+#define SETTINGS_ALL 0x7F
+
 void SettingsLoad();
+DWORD SettingsReload();
+void SettingsUnwatch();
+void SettingsSave(LPCSTR key, LPCSTR value);
+void SettingsSaveInt(LPCSTR key, int value);
 
 #endif
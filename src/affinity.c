@@ -0,0 +1,348 @@
+#include <windows.h>
+#include <stdio.h>
+#include <tlhelp32.h>
+#include "main.h"
+#include "affinity.h"
+
+/* Thread placement for SingleProcAffinity. Engines that aren't thread safe need
+ * all of their threads on one logical processor, but our renderer and workers
+ * don't, so instead of pinning the whole process to CPU 1 the game gets one
+ * processor of one physical core and we take the other cores. The SMT sibling
+ * of the game's processor is left alone, sharing it would slow the game down
+ * as much as sharing the processor itself. */
+
+#define AFFINITY_MAX_CORES 32
+#define AFFINITY_MAX_THREADS 32
+
+#define RELATION_PROCESSOR_CORE 0
+#define LTP_PC_SMT 1
+
+/* SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX for RelationProcessorCore, older
+ * headers don't have it and the function is loaded at runtime anyway */
+typedef struct
+{
+    DWORD Relationship;
+    DWORD Size;
+    BYTE Flags;
+    BYTE EfficiencyClass;
+    BYTE Reserved[20];
+    WORD GroupCount;
+    struct
+    {
+        ULONG_PTR Mask;
+        WORD Group;
+        WORD Reserved[3];
+    } GroupMask[1];
+} CoreInfo;
+
+typedef BOOL (WINAPI *GetLogicalProcessorInformationEx_)(DWORD relationship, void *buffer, PDWORD length);
+
+/* ThreadQuerySetWin32StartAddress, where CreateThread was told to start */
+#define THREAD_QUERY_START_ADDRESS 9
+
+typedef LONG (WINAPI *NtQueryInformationThread_)(HANDLE thread, int infoClass, void *info, ULONG length, PULONG returned);
+
+typedef struct
+{
+    DWORD mask;
+    BYTE efficiency;
+    BOOL smt;
+} Core;
+
+static struct
+{
+    BOOL planned;
+    DWORD game;
+    DWORD render;
+    DWORD workers;
+
+    volatile LONG threads[AFFINITY_MAX_THREADS];
+
+    /* the game executable's image, new threads starting outside it aren't the game's */
+    DWORD_PTR imageStart;
+    DWORD_PTR imageEnd;
+    NtQueryInformationThread_ queryThread;
+} affinity;
+
+static int Affinity_Count(DWORD mask)
+{
+    int count = 0;
+    for (; mask; mask &= mask - 1)
+        count++;
+    return count;
+}
+
+static int Affinity_ReadCores(Core *cores, DWORD allowed)
+{
+    int count = 0;
+    GetLogicalProcessorInformationEx_ getInfo = (GetLogicalProcessorInformationEx_)
+        GetProcAddress(GetModuleHandle("kernel32.dll"), "GetLogicalProcessorInformationEx");
+
+    DWORD length = 0;
+    BYTE *buffer = NULL;
+
+    if (getInfo && !getInfo(RELATION_PROCESSOR_CORE, NULL, &length) && GetLastError() == ERROR_INSUFFICIENT_BUFFER)
+    {
+        buffer = malloc(length);
+        if (buffer && !getInfo(RELATION_PROCESSOR_CORE, buffer, &length))
+            length = 0;
+    }
+
+    for (DWORD offset = 0; buffer && offset < length && count < AFFINITY_MAX_CORES; )
+    {
+        CoreInfo *info = (CoreInfo *)(buffer + offset);
+        offset += info->Size;
+
+        // Only processor group 0 is visible to a 32-bit process
+        if (info->Relationship != RELATION_PROCESSOR_CORE || info->GroupMask[0].Group != 0)
+            continue;
+
+        DWORD mask = (DWORD)info->GroupMask[0].Mask & allowed;
+        if (!mask)
+            continue;
+
+        cores[count].mask = mask;
+        cores[count].efficiency = info->EfficiencyClass;
+        cores[count].smt = (info->Flags & LTP_PC_SMT) != 0;
+        count++;
+    }
+
+    free(buffer);
+
+    if (count > 0)
+        return count;
+
+    // Before Windows 7, every allowed processor counts as a core of its own
+    for (int i = 0; i < 32 && count < AFFINITY_MAX_CORES; i++)
+    {
+        if (allowed & (1u << i))
+        {
+            cores[count].mask = 1u << i;
+            cores[count].efficiency = 0;
+            cores[count].smt = FALSE;
+            count++;
+        }
+    }
+
+    return count;
+}
+
+/* Replaces the old SetProcessAffinityMask(process, 1), ProcAffinity becomes the
+ * game's processor and SystemAffinity everything our own threads may use */
+void Affinity_Plan()
+{
+    DWORD_PTR processMask = 0, systemMask = 0;
+    HANDLE proc = GetCurrentProcess();
+
+    if (!GetProcessAffinityMask(proc, &processMask, &systemMask) || !systemMask)
+        return;
+
+    Core cores[AFFINITY_MAX_CORES];
+    int count = Affinity_ReadCores(cores, (DWORD)systemMask);
+    if (count == 0)
+        return;
+
+    // On hybrid CPUs the game and the renderer want the fastest cores, ties keep the system order
+    BYTE best = 0;
+    for (int i = 0; i < count; i++)
+        best = cores[i].efficiency > best ? cores[i].efficiency : best;
+
+    int gameCore = -1, renderCore = -1;
+    for (int i = 0; i < count; i++)
+    {
+        if (cores[i].efficiency != best)
+            continue;
+
+        if (gameCore < 0)
+            gameCore = i;
+        else if (renderCore < 0)
+            renderCore = i;
+    }
+
+    for (int i = 0; renderCore < 0 && i < count; i++)
+    {
+        if (i != gameCore)
+            renderCore = i;
+    }
+
+    // Lowest processor of the core, like CPU 1 used to be
+    affinity.game = cores[gameCore].mask & (~cores[gameCore].mask + 1);
+    affinity.workers = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        if (i != gameCore && i != renderCore)
+            affinity.workers |= cores[i].mask;
+    }
+
+    if (renderCore >= 0)
+    {
+        affinity.render = cores[renderCore].mask;
+
+        if (!affinity.workers)
+            affinity.workers = affinity.render;
+    }
+    else
+    {
+        // A single core, the sibling is better than queueing behind the game
+        affinity.render = cores[gameCore].mask & ~affinity.game;
+        if (!affinity.render)
+            affinity.render = affinity.game;
+
+        affinity.workers = affinity.render;
+    }
+
+    DWORD all = affinity.game | affinity.render | affinity.workers;
+    if (!SetProcessAffinityMask(proc, all))
+    {
+        dprintf("Affinity: SetProcessAffinityMask(%08X) failed, using CPU 1 only\n", (int)all);
+        SetProcessAffinityMask(proc, affinity.game);
+        ProcAffinity = SystemAffinity = 0;
+        return;
+    }
+
+    HMODULE image = GetModuleHandle(NULL);
+    IMAGE_NT_HEADERS *headers = (IMAGE_NT_HEADERS *)((BYTE *)image + ((IMAGE_DOS_HEADER *)image)->e_lfanew);
+    affinity.imageStart = (DWORD_PTR)image;
+    affinity.imageEnd = affinity.imageStart + headers->OptionalHeader.SizeOfImage;
+    affinity.queryThread = (NtQueryInformationThread_)
+        GetProcAddress(GetModuleHandle("ntdll.dll"), "NtQueryInformationThread");
+
+    affinity.planned = TRUE;
+    ProcAffinity = affinity.game;
+    SystemAffinity = affinity.render | affinity.workers;
+
+    dprintf("Affinity: %d cores%s, game %08X, render %08X, workers %08X\n",
+        count, cores[gameCore].smt ? " with SMT" : "", (int)affinity.game, (int)affinity.render, (int)affinity.workers);
+}
+
+/* Called by each of our threads when it starts, they are skipped by Affinity_PinGameThreads */
+void Affinity_PlaceThread(int role)
+{
+    if (role != AFFINITY_GAME)
+    {
+        LONG id = (LONG)GetCurrentThreadId();
+        int slot = 0;
+
+        // Slots are given back in Affinity_ThreadDetached, render threads come and go with the primary
+        while (slot < AFFINITY_MAX_THREADS && InterlockedCompareExchange(&affinity.threads[slot], id, 0) != 0)
+            slot++;
+
+        if (slot == AFFINITY_MAX_THREADS)
+            dprintf("Affinity: more than %d threads of ours, %d isn't tracked\n", AFFINITY_MAX_THREADS, (int)id);
+    }
+
+    DWORD mask;
+    if (!affinity.planned)
+        mask = role == AFFINITY_GAME ? ProcAffinity : SystemAffinity;
+    else if (role == AFFINITY_GAME)
+        mask = affinity.game;
+    else if (role == AFFINITY_RENDER)
+        mask = affinity.render;
+    else
+        mask = affinity.workers;
+
+    if (mask)
+        SetThreadAffinityMask(GetCurrentThread(), mask);
+}
+
+/* Threads created after the plan, from DLL_THREAD_ATTACH. Only the ones that start
+ * in the game executable join the game's processor, the GL driver's workers that
+ * wglCreateContext and the first draws spawn from the render thread don't. */
+void Affinity_ThreadAttached()
+{
+    if (!affinity.planned)
+        return;
+
+    DWORD_PTR start = 0;
+    if (affinity.queryThread &&
+        affinity.queryThread(GetCurrentThread(), THREAD_QUERY_START_ADDRESS, &start, sizeof(start), NULL) == 0 &&
+        (start < affinity.imageStart || start >= affinity.imageEnd))
+    {
+        return;
+    }
+
+    SetThreadAffinityMask(GetCurrentThread(), affinity.game);
+}
+
+/* From DLL_THREAD_DETACH, so that a reused thread id isn't mistaken for one of ours */
+void Affinity_ThreadDetached()
+{
+    LONG id = (LONG)GetCurrentThreadId();
+
+    for (int i = 0; i < AFFINITY_MAX_THREADS; i++)
+    {
+        if (InterlockedCompareExchange(&affinity.threads[i], 0, id) == id)
+            break;
+    }
+}
+
+static BOOL Affinity_IsOurThread(DWORD id)
+{
+    for (int i = 0; i < AFFINITY_MAX_THREADS; i++)
+    {
+        if ((DWORD)InterlockedExchangeAdd(&affinity.threads[i], 0) == id)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+static int Affinity_OurThreads()
+{
+    int count = 0;
+
+    for (int i = 0; i < AFFINITY_MAX_THREADS; i++)
+    {
+        if (InterlockedExchangeAdd(&affinity.threads[i], 0) != 0)
+            count++;
+    }
+
+    return count;
+}
+
+/* Moves every thread of the process except ours to ProcAffinity */
+void Affinity_PinGameThreads()
+{
+    if (!ProcAffinity)
+        return;
+
+    DWORD pid = GetCurrentProcessId();
+    THREADENTRY32 te32;
+    te32.dwSize = sizeof(THREADENTRY32);
+
+    HANDLE snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
+    if (snapshot == INVALID_HANDLE_VALUE)
+        return;
+
+    int pinned = 0;
+
+    if (Thread32First(snapshot, &te32))
+    {
+        do
+        {
+            if (te32.th32OwnerProcessID != pid || Affinity_IsOurThread(te32.th32ThreadID))
+                continue;
+
+            HANDLE thread = OpenThread(THREAD_SET_INFORMATION | THREAD_QUERY_INFORMATION, FALSE, te32.th32ThreadID);
+            if (thread)
+            {
+                if (SetThreadAffinityMask(thread, ProcAffinity))
+                    pinned++;
+
+                CloseHandle(thread);
+            }
+        } while (Thread32Next(snapshot, &te32));
+    }
+
+    CloseHandle(snapshot);
+
+    dprintf("Affinity: %d game threads on %08X, %d of ours on %08X\n",
+        pinned, (int)ProcAffinity, Affinity_OurThreads(), (int)SystemAffinity);
+}
+
+/* Logical processors our render thread and workers can use together, 0 without a plan */
+int Affinity_RenderProcessors()
+{
+    return affinity.planned ? Affinity_Count(affinity.render | affinity.workers) : 0;
+}
@@ -0,0 +1,17 @@
+#ifndef _AFFINITY_
+#define _AFFINITY_
+
+#include <windows.h>
+
+#define AFFINITY_GAME 0
+#define AFFINITY_RENDER 1
+#define AFFINITY_WORKER 2
+
+void Affinity_Plan();
+void Affinity_PlaceThread(int role);
+void Affinity_ThreadAttached();
+void Affinity_ThreadDetached();
+void Affinity_PinGameThreads();
+int Affinity_RenderProcessors();
+
+#endif
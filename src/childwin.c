@@ -0,0 +1,247 @@
+#include <windows.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "main.h"
+#include "IDirectDrawSurface.h"
+#include "childwin.h"
+
+/* Child windows of the game window (movies, WOL dialogs) show the part of the
+ * primary that is under them. The list of children and their rectangles is
+ * cached and rebuilt only when the window procedure or the window hooks report
+ * a change, with a periodic rebuild in case something was missed. A child is
+ * redrawn when the surface rows under it differ from the copy taken the last
+ * time it was drawn, or when it painted itself: each child is subclassed so
+ * that its own WM_PAINT, which the game window never sees, marks it dirty.
+ * Only the render thread changes the list, under the lock that the subclass
+ * procedure on the UI thread takes to look a child up. */
+
+#define CHILD_WINDOWS_MAX 16
+#define CHILD_WINDOWS_REFRESH_FRAMES 60
+#define CHILD_WINDOWS_PROP "ts-ddraw.childproc"
+
+typedef struct
+{
+    HWND hWnd;
+    RECT client;
+    RECT pos;
+    RECT area;
+    uint8_t *rows;
+    int rowBytes;
+    volatile LONG dirty;
+} ChildWindow;
+
+static struct
+{
+    CRITICAL_SECTION lock;
+    BOOL lockReady;
+    LONG invalid;
+    LONG repaint;
+    int frames;
+    int count;
+    ChildWindow children[CHILD_WINDOWS_MAX];
+} tracker = { TRUE };
+
+void ChildWindows_Invalidate()
+{
+    InterlockedExchange(&tracker.invalid, TRUE);
+}
+
+/* The game window was painted over its children, they are drawn again but kept */
+void ChildWindows_Repaint()
+{
+    InterlockedExchange(&tracker.repaint, TRUE);
+}
+
+static LRESULT CALLBACK ChildWindows_WndProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
+{
+    WNDPROC wndProc = (WNDPROC)GetProp(hWnd, CHILD_WINDOWS_PROP);
+
+    switch (uMsg)
+    {
+    case WM_PAINT:
+        EnterCriticalSection(&tracker.lock);
+        for (int i = 0; i < tracker.count; i++)
+        {
+            if (tracker.children[i].hWnd == hWnd)
+                InterlockedExchange(&tracker.children[i].dirty, TRUE);
+        }
+        LeaveCriticalSection(&tracker.lock);
+        break;
+
+    case WM_WINDOWPOSCHANGED:
+        ChildWindows_Invalidate();
+        break;
+
+    case WM_NCDESTROY:
+        SetWindowLongPtr(hWnd, GWLP_WNDPROC, (LONG_PTR)wndProc);
+        RemoveProp(hWnd, CHILD_WINDOWS_PROP);
+        ChildWindows_Invalidate();
+        break;
+    }
+
+    return CallWindowProc(wndProc, hWnd, uMsg, wParam, lParam);
+}
+
+static void ChildWindows_Subclass(HWND hWnd)
+{
+    if (GetProp(hWnd, CHILD_WINDOWS_PROP))
+        return;
+
+    SetProp(hWnd, CHILD_WINDOWS_PROP, (HANDLE)GetWindowLongPtr(hWnd, GWLP_WNDPROC));
+    SetWindowLongPtr(hWnd, GWLP_WNDPROC, (LONG_PTR)ChildWindows_WndProc);
+}
+
+/* Only when nobody subclassed the child after us, otherwise the chain would break */
+static BOOL CALLBACK ChildWindows_UnsubclassProc(HWND hWnd, LPARAM lParam)
+{
+    WNDPROC wndProc = (WNDPROC)GetProp(hWnd, CHILD_WINDOWS_PROP);
+
+    if (wndProc && GetWindowLongPtr(hWnd, GWLP_WNDPROC) == (LONG_PTR)ChildWindows_WndProc)
+    {
+        SetWindowLongPtr(hWnd, GWLP_WNDPROC, (LONG_PTR)wndProc);
+        RemoveProp(hWnd, CHILD_WINDOWS_PROP);
+    }
+
+    return TRUE;
+}
+
+static BOOL CALLBACK ChildWindows_EnumProc(HWND hWnd, LPARAM lParam)
+{
+    IDirectDrawSurfaceImpl *this = (IDirectDrawSurfaceImpl *)lParam;
+
+    if (tracker.count >= CHILD_WINDOWS_MAX)
+        return FALSE;
+
+    if (!IsWindowVisible(hWnd))
+        return TRUE;
+
+    ChildWindow *child = &tracker.children[tracker.count];
+
+    child->hWnd = hWnd;
+    GetClientRect(hWnd, &child->client);
+    GetWindowRect(hWnd, &child->pos);
+
+    RECT surface = { 0, 0, this->width, this->height };
+    if (!IntersectRect(&child->area, &child->pos, &surface))
+        return TRUE;
+
+    child->rowBytes = (child->area.right - child->area.left) * this->lXPitch;
+    child->rows = calloc(child->area.bottom - child->area.top, child->rowBytes);
+    child->dirty = TRUE;
+
+    if (child->rows)
+    {
+        ChildWindows_Subclass(hWnd);
+        tracker.count++;
+    }
+
+    return TRUE;
+}
+
+/* Callers hold tracker.lock */
+static void ChildWindows_Clear()
+{
+    tracker.count = 0;
+
+    for (int i = 0; i < CHILD_WINDOWS_MAX; i++)
+        free(tracker.children[i].rows);
+
+    memset(tracker.children, 0, sizeof(tracker.children));
+}
+
+void ChildWindows_Free(IDirectDrawSurfaceImpl *this)
+{
+    if (this->dd->hWnd)
+        EnumChildWindows(this->dd->hWnd, ChildWindows_UnsubclassProc, 0);
+
+    if (tracker.lockReady)
+    {
+        EnterCriticalSection(&tracker.lock);
+        ChildWindows_Clear();
+        LeaveCriticalSection(&tracker.lock);
+    }
+
+    InterlockedExchange(&tracker.invalid, TRUE);
+}
+
+static void ChildWindows_Rebuild(IDirectDrawSurfaceImpl *this)
+{
+    // Nothing is subclassed before the first rebuild, the lock is never used before this
+    if (!tracker.lockReady)
+    {
+        InitializeCriticalSection(&tracker.lock);
+        tracker.lockReady = TRUE;
+    }
+
+    EnterCriticalSection(&tracker.lock);
+    ChildWindows_Clear();
+    InterlockedExchange(&tracker.invalid, FALSE);
+    InterlockedExchange(&tracker.repaint, FALSE);
+
+    EnumChildWindows(this->dd->hWnd, ChildWindows_EnumProc, (LPARAM)this);
+    tracker.frames = 0;
+    LeaveCriticalSection(&tracker.lock);
+}
+
+static BOOL ChildWindows_RowsChanged(IDirectDrawSurfaceImpl *this, ChildWindow *child)
+{
+    BOOL changed = FALSE;
+    uint8_t *copy = child->rows;
+
+    for (int y = child->area.top; y < child->area.bottom; y++, copy += child->rowBytes)
+    {
+        uint8_t *row = (uint8_t *)this->surface + y * this->lPitch + child->area.left * this->lXPitch;
+
+        if (memcmp(row, copy, child->rowBytes) != 0)
+        {
+            memcpy(copy, row, child->rowBytes);
+            changed = TRUE;
+        }
+    }
+
+    return changed;
+}
+
+void ChildWindows_Present(IDirectDrawSurfaceImpl *this)
+{
+    if (InterlockedExchangeAdd(&tracker.invalid, 0) || ++tracker.frames >= CHILD_WINDOWS_REFRESH_FRAMES)
+        ChildWindows_Rebuild(this);
+
+    if (tracker.count == 0)
+        return;
+
+    // The children show primary memory, blits left to the GPU have to be in it first
+    if (this->gpuBlitCount > 0)
+        IDirectDrawSurfaceImpl_FlushGpuBlits(this);
+
+    BOOL repaint = InterlockedExchange(&tracker.repaint, FALSE);
+    BOOL fromPBO = this->usingPBO && InterlockedExchangeAdd(&Renderer, 0) == RENDERER_OPENGL;
+
+    for (int i = 0; i < tracker.count; i++)
+    {
+        ChildWindow *child = &tracker.children[i];
+
+        BOOL changed = ChildWindows_RowsChanged(this, child);
+
+        if (!InterlockedExchange(&child->dirty, FALSE) && !changed && !repaint)
+            continue;
+
+        if (fromPBO)
+        {
+            // GDI only sees the system surface, copy the span under the child from the PBO
+            uint8_t *copy = child->rows;
+            for (int y = child->area.top; y < child->area.bottom; y++, copy += child->rowBytes)
+                memcpy((uint8_t *)this->systemSurface + y * this->lPitch + child->area.left * this->lXPitch, copy, child->rowBytes);
+
+            SelectObject(this->hDC, this->bitmap);
+        }
+
+        HDC hDC = GetDC(child->hWnd);
+        BitBlt(hDC, 0, 0, child->client.right, child->client.bottom, this->hDC, child->pos.left, child->pos.top, SRCCOPY);
+        ReleaseDC(child->hWnd, hDC);
+
+        if (fromPBO)
+            SelectObject(this->hDC, this->defaultBM);
+    }
+}
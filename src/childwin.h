@@ -0,0 +1,12 @@
+#ifndef _CHILDWIN_
+#define _CHILDWIN_
+
+#include <windows.h>
+#include "IDirectDrawSurface.h"
+
+void ChildWindows_Invalidate();
+void ChildWindows_Repaint();
+void ChildWindows_Present(IDirectDrawSurfaceImpl *this);
+void ChildWindows_Free(IDirectDrawSurfaceImpl *this);
+
+#endif
@@ -0,0 +1,190 @@
+#include <windows.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "main.h"
+#include "convert.h"
+#include "pool.h"
+
+/* RGB565 to XRGB8888 conversion and the overlay OR merge, with SSE2 and AVX2
+ * versions picked at runtime. Those live in convert_sse2.c and convert_avx2.c,
+ * which are built with -msse2 and -mavx2, older GCCs only declare the
+ * intrinsics when the whole file is compiled for the instruction set.
+ * The 5 and 6 bit channels are widened by replicating their top bits so white
+ * stays 0xFFFFFF, the same result as GDI gives. */
+
+#ifndef PF_XMMI64_INSTRUCTIONS_AVAILABLE
+#define PF_XMMI64_INSTRUCTIONS_AVAILABLE 10
+#endif
+
+#ifndef PF_AVX2_INSTRUCTIONS_AVAILABLE
+#define PF_AVX2_INSTRUCTIONS_AVAILABLE 40
+#endif
+
+static void (*ConvertRow)(uint32_t *dst, const uint16_t *src, int count);
+static void (*OrRow)(uint8_t *dst, const uint8_t *src, int bytes);
+
+void Convert_Generic(uint32_t *dst, const uint16_t *src, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        uint32_t p = src[i];
+        uint32_t r = (p >> 11) & 0x1F;
+        uint32_t g = (p >> 5) & 0x3F;
+        uint32_t b = p & 0x1F;
+
+        dst[i] = ((r << 3) | (r >> 2)) << 16 | ((g << 2) | (g >> 4)) << 8 | ((b << 3) | (b >> 2));
+    }
+}
+
+void Or_Generic(uint8_t *dst, const uint8_t *src, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+        dst[i] |= src[i];
+}
+
+void Convert_Init()
+{
+    if (ConvertRow)
+        return;
+
+    if (IsProcessorFeaturePresent(PF_AVX2_INSTRUCTIONS_AVAILABLE))
+    {
+        ConvertRow = Convert_AVX2;
+        OrRow = Or_AVX2;
+        dprintf("Convert_Init: AVX2\n");
+    }
+    else if (IsProcessorFeaturePresent(PF_XMMI64_INSTRUCTIONS_AVAILABLE))
+    {
+        ConvertRow = Convert_SSE2;
+        OrRow = Or_SSE2;
+        dprintf("Convert_Init: SSE2\n");
+    }
+    else
+    {
+        ConvertRow = Convert_Generic;
+        OrRow = Or_Generic;
+        dprintf("Convert_Init: generic\n");
+    }
+}
+
+void Convert_Rgb565ToXrgb8888(uint32_t *dst, const uint16_t *src, int count)
+{
+    if (!ConvertRow)
+        Convert_Init();
+
+    ConvertRow(dst, src, count);
+}
+
+/* Same result as a SRCPAINT raster op, works for any pixel format */
+void Convert_OrBytes(uint8_t *dst, const uint8_t *src, int bytes)
+{
+    if (!OrRow)
+        Convert_Init();
+
+    OrRow(dst, src, bytes);
+}
+
+static BOOL ConvertTarget_Resize(ConvertTarget *target, int width, int height)
+{
+    ConvertTarget_Free(target);
+
+    target->hDC = CreateCompatibleDC(NULL);
+    target->shadow = calloc(width * height, sizeof(uint16_t));
+
+    BITMAPINFO bmi;
+    memset(&bmi, 0, sizeof(bmi));
+    bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+    bmi.bmiHeader.biWidth = width;
+    bmi.bmiHeader.biHeight = -height;
+    bmi.bmiHeader.biPlanes = 1;
+    bmi.bmiHeader.biBitCount = 32;
+    bmi.bmiHeader.biCompression = BI_RGB;
+
+    if (target->hDC)
+        target->bitmap = CreateDIBSection(target->hDC, &bmi, DIB_RGB_COLORS, (void **)&target->bits, NULL, 0);
+
+    if (!target->hDC || !target->shadow || !target->bitmap)
+    {
+        ConvertTarget_Free(target);
+        return FALSE;
+    }
+
+    // A zeroed shadow matches the zeroed (black) DIB
+    target->defaultBM = SelectObject(target->hDC, target->bitmap);
+    target->width = width;
+    target->height = height;
+    return TRUE;
+}
+
+typedef struct
+{
+    ConvertTarget *target;
+    const uint8_t *src;
+    int srcPitch;
+    volatile LONG firstRow;
+    volatile LONG lastRow;
+} ConvertJob;
+
+static void ConvertRows(void *ctx, int y0, int y1)
+{
+    ConvertJob *job = ctx;
+    int width = job->target->width;
+    LONG first = y1, last = -1;
+
+    for (int y = y0; y < y1; y++)
+    {
+        const uint16_t *row = (const uint16_t *)(job->src + y * job->srcPitch);
+        uint16_t *shadow = job->target->shadow + y * width;
+
+        if (memcmp(row, shadow, width * sizeof(uint16_t)) == 0)
+            continue;
+
+        memcpy(shadow, row, width * sizeof(uint16_t));
+        Convert_Rgb565ToXrgb8888(job->target->bits + y * width, row, width);
+
+        if (y < first)
+            first = y;
+
+        last = y;
+    }
+
+    // Bands finish in any order
+    LONG seen;
+    while (first < (seen = job->firstRow) && InterlockedCompareExchange(&job->firstRow, first, seen) != seen);
+    while (last > (seen = job->lastRow) && InterlockedCompareExchange(&job->lastRow, last, seen) != seen);
+}
+
+/* Converts the rows of src that differ from the last update. firstRow and lastRow
+ * get the range that changed, firstRow > lastRow when nothing did. */
+BOOL ConvertTarget_Update(ConvertTarget *target, const void *src, int srcPitch, int width, int height, int *firstRow, int *lastRow)
+{
+    if (target->width != width || target->height != height)
+    {
+        if (!ConvertTarget_Resize(target, width, height))
+            return FALSE;
+    }
+
+    ConvertJob job = { target, src, srcPitch, height, -1 };
+    Pool_ParallelRows(height, width * 6, ConvertRows, &job);
+
+    *firstRow = job.firstRow;
+    *lastRow = job.lastRow;
+    return TRUE;
+}
+
+void ConvertTarget_Free(ConvertTarget *target)
+{
+    if (target->bitmap)
+    {
+        SelectObject(target->hDC, target->defaultBM);
+        DeleteObject(target->bitmap);
+    }
+
+    if (target->hDC)
+        DeleteDC(target->hDC);
+
+    free(target->shadow);
+
+    memset(target, 0, sizeof(ConvertTarget));
+}
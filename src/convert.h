@@ -0,0 +1,34 @@
+#ifndef _CONVERT_
+#define _CONVERT_
+
+#include <windows.h>
+#include <stdint.h>
+
+/* A persistent 32 bpp DIB section holding an XRGB8888 copy of a 16 bpp surface */
+typedef struct
+{
+    HDC hDC;
+    HBITMAP bitmap;
+    HGDIOBJ defaultBM;
+    uint32_t *bits;
+    uint16_t *shadow;
+    int width;
+    int height;
+} ConvertTarget;
+
+void Convert_Init();
+void Convert_Rgb565ToXrgb8888(uint32_t *dst, const uint16_t *src, int count);
+void Convert_OrBytes(uint8_t *dst, const uint8_t *src, int bytes);
+
+/* Row kernels, Convert_Init picks one of them */
+void Convert_Generic(uint32_t *dst, const uint16_t *src, int count);
+void Convert_SSE2(uint32_t *dst, const uint16_t *src, int count);
+void Convert_AVX2(uint32_t *dst, const uint16_t *src, int count);
+void Or_Generic(uint8_t *dst, const uint8_t *src, int bytes);
+void Or_SSE2(uint8_t *dst, const uint8_t *src, int bytes);
+void Or_AVX2(uint8_t *dst, const uint8_t *src, int bytes);
+
+BOOL ConvertTarget_Update(ConvertTarget *target, const void *src, int srcPitch, int width, int height, int *firstRow, int *lastRow);
+void ConvertTarget_Free(ConvertTarget *target);
+
+#endif
@@ -0,0 +1,50 @@
+#include <stdint.h>
+#include <immintrin.h>
+#include "convert.h"
+
+/* AVX2 kernels for convert.c, this file is built with -mavx2 */
+
+void Convert_AVX2(uint32_t *dst, const uint16_t *src, int count)
+{
+    const __m256i mask5 = _mm256_set1_epi16(0x1F);
+    const __m256i mask6 = _mm256_set1_epi16(0x3F);
+    int i = 0;
+
+    for (; i + 16 <= count; i += 16)
+    {
+        __m256i p = _mm256_loadu_si256((const __m256i *)(src + i));
+
+        __m256i r = _mm256_srli_epi16(p, 11);
+        __m256i g = _mm256_and_si256(_mm256_srli_epi16(p, 5), mask6);
+        __m256i b = _mm256_and_si256(p, mask5);
+
+        r = _mm256_or_si256(_mm256_slli_epi16(r, 3), _mm256_srli_epi16(r, 2));
+        g = _mm256_or_si256(_mm256_slli_epi16(g, 2), _mm256_srli_epi16(g, 4));
+        b = _mm256_or_si256(_mm256_slli_epi16(b, 3), _mm256_srli_epi16(b, 2));
+
+        __m256i gb = _mm256_or_si256(_mm256_slli_epi16(g, 8), b);
+
+        // The unpacks work per 128 bit lane, put pixels 0-7 and 8-15 back in order
+        __m256i lo = _mm256_unpacklo_epi16(gb, r);
+        __m256i hi = _mm256_unpackhi_epi16(gb, r);
+
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i *)(dst + i + 8), _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+
+    Convert_SSE2(dst + i, src + i, count - i);
+}
+
+void Or_AVX2(uint8_t *dst, const uint8_t *src, int bytes)
+{
+    int i = 0;
+
+    for (; i + 32 <= bytes; i += 32)
+    {
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_or_si256(d, v));
+    }
+
+    Or_SSE2(dst + i, src + i, bytes - i);
+}
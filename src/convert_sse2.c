@@ -0,0 +1,47 @@
+#include <stdint.h>
+#include <emmintrin.h>
+#include "convert.h"
+
+/* SSE2 kernels for convert.c, this file is built with -msse2 */
+
+void Convert_SSE2(uint32_t *dst, const uint16_t *src, int count)
+{
+    const __m128i mask5 = _mm_set1_epi16(0x1F);
+    const __m128i mask6 = _mm_set1_epi16(0x3F);
+    int i = 0;
+
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128i p = _mm_loadu_si128((const __m128i *)(src + i));
+
+        __m128i r = _mm_srli_epi16(p, 11);
+        __m128i g = _mm_and_si128(_mm_srli_epi16(p, 5), mask6);
+        __m128i b = _mm_and_si128(p, mask5);
+
+        r = _mm_or_si128(_mm_slli_epi16(r, 3), _mm_srli_epi16(r, 2));
+        g = _mm_or_si128(_mm_slli_epi16(g, 2), _mm_srli_epi16(g, 4));
+        b = _mm_or_si128(_mm_slli_epi16(b, 3), _mm_srli_epi16(b, 2));
+
+        // Low word of each pixel is green and blue, high word is red
+        __m128i gb = _mm_or_si128(_mm_slli_epi16(g, 8), b);
+
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_unpacklo_epi16(gb, r));
+        _mm_storeu_si128((__m128i *)(dst + i + 4), _mm_unpackhi_epi16(gb, r));
+    }
+
+    Convert_Generic(dst + i, src + i, count - i);
+}
+
+void Or_SSE2(uint8_t *dst, const uint8_t *src, int bytes)
+{
+    int i = 0;
+
+    for (; i + 16 <= bytes; i += 16)
+    {
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_or_si128(d, v));
+    }
+
+    Or_Generic(dst + i, src + i, bytes - i);
+}
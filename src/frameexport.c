@@ -0,0 +1,206 @@
+#include <windows.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "main.h"
+#include "convert.h"
+#include "frameexport.h"
+
+/* Publishes every presented frame to a named shared memory ring so capture and
+ * streaming tools can read it without grabbing the window. The render thread is
+ * the only writer. Slots are protected by a sequence count, a reader that raced
+ * the writer sees the count change and retries with the next frame.
+ * The slots fit XRGB8888 frames of the game's resolution, the pagefile backed
+ * mapping is charged in full. A larger frame after SetDisplayMode recreates the
+ * mapping, the old one loses its magic so that readers open the new one. */
+
+#define FRAME_EXPORT_RETRY_FRAMES 60
+
+static struct
+{
+    HANDLE mapping;
+    HANDLE event;
+    FrameExportHeader *header;
+    uint8_t *data;
+    DWORD frame;
+    char name[MAX_PATH];
+    int retry;
+} fe;
+
+static void FrameExport_Close()
+{
+    if (fe.header)
+    {
+        InterlockedExchange((LONG *)&fe.header->magic, 0);
+        UnmapViewOfFile(fe.header);
+    }
+    if (fe.mapping)
+        CloseHandle(fe.mapping);
+
+    fe.header = NULL;
+    fe.mapping = NULL;
+    fe.data = NULL;
+}
+
+static BOOL FrameExport_Create(int width, int height)
+{
+    DWORD slotBytes = (DWORD)width * height * 4;
+    DWORD dataOffset = (sizeof(FrameExportHeader) + 63) & ~63;
+    DWORD bytes = dataOffset + slotBytes * FRAME_EXPORT_SLOTS;
+
+    char objectName[MAX_PATH];
+    _snprintf(objectName, sizeof(objectName), "Local\\%s-frames", fe.name);
+
+    // A reader that still holds the previous mapping keeps the name alive, Publish tries again later
+    fe.mapping = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, bytes, objectName);
+    if (!fe.mapping || GetLastError() == ERROR_ALREADY_EXISTS)
+    {
+        dprintf("FrameExport: %s is not available, %lu\n", objectName, GetLastError());
+        FrameExport_Close();
+        return FALSE;
+    }
+
+    fe.header = MapViewOfFile(fe.mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+    if (!fe.header)
+    {
+        FrameExport_Close();
+        return FALSE;
+    }
+
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+
+    fe.data = (uint8_t *)fe.header + dataOffset;
+    fe.header->version = FRAME_EXPORT_VERSION;
+    fe.header->slotCount = FRAME_EXPORT_SLOTS;
+    fe.header->slotBytes = slotBytes;
+    fe.header->dataOffset = dataOffset;
+    fe.header->frequency = frequency.QuadPart;
+    fe.header->latest = -1;
+
+    // Readers check the magic last
+    InterlockedExchange((LONG *)&fe.header->magic, FRAME_EXPORT_MAGIC);
+
+    dprintf("FrameExport: publishing to %s, %d KB per slot\n", fe.name, (int)(slotBytes / 1024));
+    return TRUE;
+}
+
+BOOL FrameExport_Init(const char *name, int width, int height)
+{
+    if (fe.event)
+        return TRUE;
+
+    _snprintf(fe.name, sizeof(fe.name) - 1, "%s", name);
+
+    char objectName[MAX_PATH];
+    _snprintf(objectName, sizeof(objectName), "Local\\%s-frame", name);
+    fe.event = CreateEvent(NULL, FALSE, FALSE, objectName);
+
+    if (!fe.event || !FrameExport_Create(width, height))
+    {
+        FrameExport_Free();
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+void FrameExport_Free()
+{
+    FrameExport_Close();
+
+    if (fe.event)
+        CloseHandle(fe.event);
+
+    memset(&fe, 0, sizeof(fe));
+}
+
+void FrameExport_Publish(const void *src, int pitch, int width, int height, int bpp, const RGBQUAD *palette)
+{
+    if (!fe.event || !src || (bpp != 8 && bpp != 16 && bpp != 32))
+        return;
+
+    // Palettized frames are always converted, readers don't get the palette
+    LONG format = (bpp == 16 && !FrameExportXrgb) ? FRAME_EXPORT_RGB565 : FRAME_EXPORT_XRGB8888;
+    int rowBytes = width * (format == FRAME_EXPORT_RGB565 ? 2 : 4);
+    int outPitch = (rowBytes + 3) & ~3;
+
+    // The game switched to a larger mode, or the last attempt to recreate the mapping failed
+    if (!fe.header || (size_t)outPitch * height > fe.header->slotBytes)
+    {
+        if (fe.retry > 0)
+        {
+            fe.retry--;
+            return;
+        }
+
+        FrameExport_Close();
+        if (!FrameExport_Create(width, height))
+        {
+            fe.retry = FRAME_EXPORT_RETRY_FRAMES;
+            return;
+        }
+    }
+
+    LONG latest = fe.header->latest;
+    LONG index = (latest + 1) % FRAME_EXPORT_SLOTS;
+
+    FrameExportSlot *slot = &fe.header->slots[index];
+    FrameExportSlot *prev = latest >= 0 ? &fe.header->slots[latest] : NULL;
+
+    uint8_t *out = fe.data + (size_t)index * fe.header->slotBytes;
+    uint8_t *prevOut = NULL;
+
+    if (prev && prev->width == width && prev->height == height && prev->format == format)
+        prevOut = fe.data + (size_t)latest * fe.header->slotBytes;
+
+    // Odd while the slot is written
+    InterlockedIncrement(&slot->sequence);
+
+    int firstRow = prevOut ? height : 0;
+    int lastRow = prevOut ? -1 : height - 1;
+
+    for (int y = 0; y < height; y++)
+    {
+        const uint8_t *row = (const uint8_t *)src + (size_t)y * pitch;
+        uint8_t *outRow = out + (size_t)y * outPitch;
+
+        if (bpp == 8)
+        {
+            // The DIB color table is XRGB already
+            for (int x = 0; x < width; x++)
+                ((uint32_t *)outRow)[x] = ((const uint32_t *)palette)[row[x]];
+        }
+        else if (format == FRAME_EXPORT_XRGB8888 && bpp == 16)
+        {
+            Convert_Rgb565ToXrgb8888((uint32_t *)outRow, (const uint16_t *)row, width);
+        }
+        else
+        {
+            memcpy(outRow, row, rowBytes);
+        }
+
+        if (prevOut && memcmp(outRow, prevOut + (size_t)y * outPitch, rowBytes) != 0)
+        {
+            if (y < firstRow)
+                firstRow = y;
+            lastRow = y;
+        }
+    }
+
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+
+    slot->frame = ++fe.frame;
+    slot->timestamp = now.QuadPart;
+    slot->width = width;
+    slot->height = height;
+    slot->pitch = outPitch;
+    slot->format = format;
+    slot->firstRow = firstRow;
+    slot->lastRow = lastRow;
+
+    InterlockedIncrement(&slot->sequence);
+    InterlockedExchange(&fe.header->latest, index);
+    SetEvent(fe.event);
+}
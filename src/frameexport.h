@@ -0,0 +1,53 @@
+#ifndef _FRAMEEXPORT_
+#define _FRAMEEXPORT_
+
+#include <windows.h>
+
+/* Layout of the shared memory frame ring, also used by tools/framereader.c.
+ *
+ * The mapping is named "Local\<FrameExport>-frames" and starts with a
+ * FrameExportHeader, "Local\<FrameExport>-frame" is an auto reset event that is
+ * signaled after every published frame. Frame data of slot i starts at
+ * dataOffset + i * slotBytes. A slot is consistent when its sequence was even
+ * and didn't change while it was read. The slots fit the game's resolution, when
+ * it grows the mapping is recreated and the magic of the old one is cleared,
+ * readers have to close it and open the name again. */
+
+#define FRAME_EXPORT_MAGIC 0x45465354 /* "TSFE" */
+#define FRAME_EXPORT_VERSION 1
+#define FRAME_EXPORT_SLOTS 3
+
+#define FRAME_EXPORT_RGB565 0
+#define FRAME_EXPORT_XRGB8888 1
+
+typedef struct
+{
+    volatile LONG sequence;
+    DWORD frame;
+    LONGLONG timestamp;
+    LONG width;
+    LONG height;
+    LONG pitch;
+    LONG format;
+    /* rows that differ from the previous frame (frame - 1), firstRow > lastRow if none */
+    LONG firstRow;
+    LONG lastRow;
+} FrameExportSlot;
+
+typedef struct
+{
+    DWORD magic;
+    DWORD version;
+    DWORD slotCount;
+    DWORD slotBytes;
+    DWORD dataOffset;
+    LONGLONG frequency;
+    volatile LONG latest;
+    FrameExportSlot slots[FRAME_EXPORT_SLOTS];
+} FrameExportHeader;
+
+BOOL FrameExport_Init(const char *name, int width, int height);
+void FrameExport_Free();
+void FrameExport_Publish(const void *src, int pitch, int width, int height, int bpp, const RGBQUAD *palette);
+
+#endif
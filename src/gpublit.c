@@ -0,0 +1,257 @@
+#include <windows.h>
+#include <stdio.h>
+#include <stdint.h>
+#include "opengl.h"
+#include "main.h"
+#include "gpublit.h"
+
+/* Textures for offscreen surfaces that the game keeps blitting to the primary
+ * unchanged (GpuBlitCache). The surface is uploaded again only when its write
+ * generation changes, the blits themselves are drawn as quads over the primary
+ * with the same program and texture format as the primary itself. */
+
+#define GPU_BLIT_CACHE_SIZE GPU_BLIT_MAX
+
+typedef struct
+{
+    GLfloat x, y;
+    GLfloat u, v;
+} GpuBlitVertex;
+
+static struct
+{
+    BOOL initialized;
+    GLuint program;
+    GLuint vao;
+    GLuint vbo;
+    GLint texInternal;
+    GLenum texFormat;
+    GLenum texType;
+    int frame;
+    int uploads;
+    struct
+    {
+        LONG id;
+        LONG generation;
+        GLuint texture;
+        int width;
+        int height;
+        int textureWidth;
+        int textureHeight;
+        int lastUsed;
+    } cache[GPU_BLIT_CACHE_SIZE];
+    int quadCount;
+    GLuint quadTextures[GPU_BLIT_MAX];
+    GpuBlitVertex vertices[GPU_BLIT_MAX * 6];
+} gb;
+
+static int NextPow2(int v)
+{
+    v--; v |= v >> 1; v |= v >> 2; v |= v >> 4; v |= v >> 8; v |= v >> 16; v++;
+    return v;
+}
+
+BOOL GpuBlit_Init(GLuint program, GLint texInternal, GLenum texFormat, GLenum texType)
+{
+    memset(&gb, 0, sizeof(gb));
+
+    gb.texInternal = texInternal;
+    gb.texFormat = texFormat;
+    gb.texType = texType;
+
+    if (program)
+    {
+        gb.program = program;
+
+        GLint vertexCoordAttrLoc = glGetAttribLocation(program, "VertexCoord");
+        GLint texCoordAttrLoc = glGetAttribLocation(program, "TexCoord");
+
+        glGenVertexArrays(1, &gb.vao);
+        glBindVertexArray(gb.vao);
+
+        glGenBuffers(1, &gb.vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, gb.vbo);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(gb.vertices), NULL, GL_STREAM_DRAW);
+
+        glVertexAttribPointer(vertexCoordAttrLoc, 2, GL_FLOAT, GL_FALSE, sizeof(GpuBlitVertex), (void *)0);
+        glEnableVertexAttribArray(vertexCoordAttrLoc);
+        glVertexAttribPointer(texCoordAttrLoc, 2, GL_FLOAT, GL_FALSE, sizeof(GpuBlitVertex), (void *)(2 * sizeof(GLfloat)));
+        glEnableVertexAttribArray(texCoordAttrLoc);
+
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glBindVertexArray(0);
+
+        GLenum gle = glGetError();
+        if (gle != GL_NO_ERROR)
+        {
+            dprintf("GpuBlit_Init vertex setup failed, %x\n", gle);
+            GpuBlit_Free();
+            return FALSE;
+        }
+    }
+
+    gb.initialized = TRUE;
+    dprintf("GpuBlit_Init: %d cache slots\n", GPU_BLIT_CACHE_SIZE);
+    return TRUE;
+}
+
+void GpuBlit_Free()
+{
+    for (int i = 0; i < GPU_BLIT_CACHE_SIZE; i++)
+    {
+        if (gb.cache[i].texture)
+            glDeleteTextures(1, &gb.cache[i].texture);
+    }
+
+    if (gb.vbo)
+        glDeleteBuffers(1, &gb.vbo);
+
+    if (gb.vao)
+        glDeleteVertexArrays(1, &gb.vao);
+
+    memset(&gb, 0, sizeof(gb));
+}
+
+static int GpuBlit_Lookup(IDirectDrawSurfaceImpl *src, LONG id, LONG generation)
+{
+    int slot = -1;
+
+    for (int i = 0; i < GPU_BLIT_CACHE_SIZE; i++)
+    {
+        if (gb.cache[i].id == id)
+        {
+            slot = i;
+            break;
+        }
+
+        if (slot < 0 || gb.cache[i].lastUsed < gb.cache[slot].lastUsed)
+            slot = i;
+    }
+
+    // There are as many slots as queued blits, a slot used this frame is never evicted
+    if (gb.cache[slot].id != id)
+    {
+        gb.cache[slot].id = id;
+        gb.cache[slot].generation = generation - 1;
+    }
+
+    if (gb.cache[slot].width != src->width || gb.cache[slot].height != src->height)
+    {
+        gb.cache[slot].width = src->width;
+        gb.cache[slot].height = src->height;
+        gb.cache[slot].textureWidth = NextPow2(src->width);
+        gb.cache[slot].textureHeight = NextPow2(src->height);
+
+        if (!gb.cache[slot].texture)
+            glGenTextures(1, &gb.cache[slot].texture);
+
+        glBindTexture(GL_TEXTURE_2D, gb.cache[slot].texture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+        glTexImage2D(GL_TEXTURE_2D, 0, gb.texInternal, gb.cache[slot].textureWidth, gb.cache[slot].textureHeight, 0,
+            gb.texFormat, gb.texType, NULL);
+
+        gb.cache[slot].generation = generation - 1;
+    }
+
+    if (gb.cache[slot].generation != generation)
+    {
+        glBindTexture(GL_TEXTURE_2D, gb.cache[slot].texture);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, src->lPitch / src->lXPitch);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, src->width, src->height, gb.texFormat, gb.texType, src->surface);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+
+        gb.cache[slot].generation = generation;
+        gb.uploads++;
+    }
+
+    gb.cache[slot].lastUsed = gb.frame;
+    return slot;
+}
+
+/* Called with the primary locked and no pixel unpack buffer bound, uploads the
+ * sources that changed and builds the quads. Returns the number of quads. */
+int GpuBlit_Prepare(IDirectDrawSurfaceImpl *primary)
+{
+    gb.quadCount = 0;
+
+    if (!gb.initialized)
+        return 0;
+
+    gb.frame++;
+
+    for (int i = 0; i < primary->gpuBlitCount; i++)
+    {
+        GpuBlitEntry *e = &primary->gpuBlits[i];
+        int slot = GpuBlit_Lookup(e->src, e->srcId, e->srcGeneration);
+
+        float x0 = (float)e->dstRect.left / primary->width * 2.0f - 1.0f;
+        float y0 = 1.0f - (float)e->dstRect.top / primary->height * 2.0f;
+        float x1 = (float)e->dstRect.right / primary->width * 2.0f - 1.0f;
+        float y1 = 1.0f - (float)e->dstRect.bottom / primary->height * 2.0f;
+
+        float u0 = (float)e->srcRect.left / gb.cache[slot].textureWidth;
+        float v0 = (float)e->srcRect.top / gb.cache[slot].textureHeight;
+        float u1 = (float)e->srcRect.right / gb.cache[slot].textureWidth;
+        float v1 = (float)e->srcRect.bottom / gb.cache[slot].textureHeight;
+
+        GpuBlitVertex quad[6] = {
+            { x0, y0, u0, v0 },
+            { x1, y0, u1, v0 },
+            { x1, y1, u1, v1 },
+            { x0, y0, u0, v0 },
+            { x1, y1, u1, v1 },
+            { x0, y1, u0, v1 },
+        };
+
+        memcpy(&gb.vertices[gb.quadCount * 6], quad, sizeof(quad));
+        gb.quadTextures[gb.quadCount] = gb.cache[slot].texture;
+        gb.quadCount++;
+    }
+
+    if (gb.frame % 1000 == 0)
+    {
+        dprintf("GpuBlit: %d quads, %d source uploads, %d blits copied by the CPU after all in the last 1000 frames\n",
+            gb.quadCount, gb.uploads, (int)InterlockedExchange(&primary->gpuBlitFlushed, 0));
+        gb.uploads = 0;
+    }
+
+    return gb.quadCount;
+}
+
+/* Draws the quads from the last GpuBlit_Prepare with the viewport of the primary */
+void GpuBlit_Draw()
+{
+    if (!gb.initialized || gb.quadCount == 0)
+        return;
+
+    if (gb.program)
+    {
+        glBindVertexArray(gb.vao);
+        glBindBuffer(GL_ARRAY_BUFFER, gb.vbo);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, gb.quadCount * 6 * sizeof(GpuBlitVertex), gb.vertices);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+        for (int i = 0; i < gb.quadCount; i++)
+        {
+            glBindTexture(GL_TEXTURE_2D, gb.quadTextures[i]);
+            glDrawArrays(GL_TRIANGLES, i * 6, 6);
+        }
+    }
+    else
+    {
+        for (int i = 0; i < gb.quadCount; i++)
+        {
+            glBindTexture(GL_TEXTURE_2D, gb.quadTextures[i]);
+
+            glBegin(GL_TRIANGLES);
+            for (int j = i * 6; j < i * 6 + 6; j++)
+            {
+                glTexCoord2f(gb.vertices[j].u, gb.vertices[j].v);
+                glVertex2f(gb.vertices[j].x, gb.vertices[j].y);
+            }
+            glEnd();
+        }
+    }
+}
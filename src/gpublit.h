@@ -0,0 +1,13 @@
+#ifndef _GPUBLIT_
+#define _GPUBLIT_
+
+#include <windows.h>
+#include "opengl.h"
+#include "IDirectDrawSurface.h"
+
+BOOL GpuBlit_Init(GLuint program, GLint texInternal, GLenum texFormat, GLenum texType);
+void GpuBlit_Free();
+int GpuBlit_Prepare(IDirectDrawSurfaceImpl *primary);
+void GpuBlit_Draw();
+
+#endif
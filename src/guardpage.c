@@ -0,0 +1,201 @@
+#include <windows.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "main.h"
+#include "guardpage.h"
+
+/* Tiberian Sun reads past the bottom of its surfaces, so every DIB has guard
+ * lines below the visible rows. Instead of committing them up front the DIB is
+ * created on a SEC_RESERVE file mapping: only the visible rows are committed and
+ * the slack is committed by a vectored exception handler the first time it is
+ * touched. Surfaces that never overrun cost no more than their visible rows. */
+
+typedef struct GuardRegion
+{
+    struct GuardRegion *next;
+    HANDLE section;
+    uint8_t *base;
+    uint8_t *slack;
+    uint8_t *committed;
+    uint8_t *end;
+    int touches;
+} GuardRegion;
+
+static struct
+{
+    CRITICAL_SECTION lock;
+    PVOID handler;
+    size_t pageSize;
+    GuardRegion *regions;
+    LONG touches;
+    LONG regionCount;
+} guard;
+
+static LONG CALLBACK GuardPages_Handler(PEXCEPTION_POINTERS info)
+{
+    PEXCEPTION_RECORD record = info->ExceptionRecord;
+
+    if (record->ExceptionCode != EXCEPTION_ACCESS_VIOLATION || record->NumberParameters < 2)
+        return EXCEPTION_CONTINUE_SEARCH;
+
+    uint8_t *address = (uint8_t *)record->ExceptionInformation[1];
+    LONG result = EXCEPTION_CONTINUE_SEARCH;
+
+    EnterCriticalSection(&guard.lock);
+
+    for (GuardRegion *region = guard.regions; region; region = region->next)
+    {
+        if (address < region->committed || address >= region->end)
+            continue;
+
+        // Overruns walk down the rows, commit everything up to the touched page
+        uint8_t *to = region->base + ((address - region->base) / guard.pageSize + 1) * guard.pageSize;
+        if (to > region->end)
+            to = region->end;
+
+        if (VirtualAlloc(region->committed, to - region->committed, MEM_COMMIT, PAGE_READWRITE))
+        {
+            region->committed = to;
+            region->touches++;
+            guard.touches++;
+            result = EXCEPTION_CONTINUE_EXECUTION;
+        }
+        break;
+    }
+
+    LeaveCriticalSection(&guard.lock);
+    return result;
+}
+
+void GuardPages_Init()
+{
+    if (guard.handler || !GuardPages)
+        return;
+
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    guard.pageSize = si.dwPageSize;
+
+    InitializeCriticalSection(&guard.lock);
+    guard.handler = AddVectoredExceptionHandler(1, GuardPages_Handler);
+
+    if (!guard.handler)
+    {
+        dprintf("GuardPages: AddVectoredExceptionHandler failed, guard lines are committed\n");
+        DeleteCriticalSection(&guard.lock);
+    }
+}
+
+/* Creates a DIB section whose rows past visibleBytes are only reserved. Falls back
+ * to a plain DIB section (section is NULL) if that isn't possible. */
+HBITMAP GuardPages_CreateDIBSection(HDC hDC, const BITMAPINFO *bmi, size_t visibleBytes, void **bits, HANDLE *section)
+{
+    *section = NULL;
+
+    if (guard.handler)
+    {
+        size_t stride = ((bmi->bmiHeader.biWidth * bmi->bmiHeader.biBitCount + 31) / 32) * 4;
+        size_t bytes = stride * abs(bmi->bmiHeader.biHeight);
+
+        HANDLE hSection = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE | SEC_RESERVE, 0, (DWORD)bytes, NULL);
+        HBITMAP bitmap = hSection ? CreateDIBSection(hDC, bmi, DIB_RGB_COLORS, bits, hSection, 0) : NULL;
+        GuardRegion *region = bitmap ? calloc(1, sizeof(GuardRegion)) : NULL;
+
+        if (region)
+        {
+            size_t committed = (visibleBytes + guard.pageSize - 1) / guard.pageSize * guard.pageSize;
+            if (committed > bytes)
+                committed = bytes;
+
+            region->section = hSection;
+            region->base = *bits;
+            region->slack = region->base + committed;
+            region->committed = region->slack;
+            region->end = region->base + bytes;
+
+            if (VirtualAlloc(region->base, committed, MEM_COMMIT, PAGE_READWRITE))
+            {
+                EnterCriticalSection(&guard.lock);
+                region->next = guard.regions;
+                guard.regions = region;
+                guard.regionCount++;
+                LeaveCriticalSection(&guard.lock);
+
+                *section = hSection;
+                return bitmap;
+            }
+
+            free(region);
+        }
+
+        dprintf("GuardPages: reserved DIB section failed, %lu\n", GetLastError());
+
+        if (bitmap)
+            DeleteObject(bitmap);
+        if (hSection)
+            CloseHandle(hSection);
+    }
+
+    return CreateDIBSection(hDC, bmi, DIB_RGB_COLORS, bits, NULL, 0);
+}
+
+/* The bitmap must not be selected into a DC anymore */
+void GuardPages_DeleteDIBSection(HBITMAP bitmap, HANDLE section)
+{
+    if (section)
+    {
+        EnterCriticalSection(&guard.lock);
+
+        for (GuardRegion **link = &guard.regions; *link; link = &(*link)->next)
+        {
+            GuardRegion *region = *link;
+
+            if (region->section == section)
+            {
+                if (region->touches)
+                {
+                    dprintf("GuardPages: region %p touched %d times, %d of %d KB slack committed (%d touches in %d regions total)\n",
+                        region->base, region->touches,
+                        (int)((region->committed - region->slack) / 1024), (int)((region->end - region->slack) / 1024),
+                        (int)guard.touches, (int)guard.regionCount);
+                }
+
+                *link = region->next;
+                guard.regionCount--;
+                free(region);
+                break;
+            }
+        }
+
+        LeaveCriticalSection(&guard.lock);
+    }
+
+    DeleteObject(bitmap);
+
+    if (section)
+        CloseHandle(section);
+}
+
+/* Zeroes a backing store without committing slack that was never touched */
+void GuardPages_Clear(void *bits, size_t bytes)
+{
+    if (guard.handler)
+    {
+        EnterCriticalSection(&guard.lock);
+
+        for (GuardRegion *region = guard.regions; region; region = region->next)
+        {
+            if (region->base == bits)
+            {
+                if (bytes > (size_t)(region->committed - region->base))
+                    bytes = region->committed - region->base;
+                break;
+            }
+        }
+
+        LeaveCriticalSection(&guard.lock);
+    }
+
+    memset(bits, 0, bytes);
+}
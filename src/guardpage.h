@@ -0,0 +1,11 @@
+#ifndef _GUARDPAGE_
+#define _GUARDPAGE_
+
+#include <windows.h>
+
+void GuardPages_Init();
+HBITMAP GuardPages_CreateDIBSection(HDC hDC, const BITMAPINFO *bmi, size_t visibleBytes, void **bits, HANDLE *section);
+void GuardPages_DeleteDIBSection(HBITMAP bitmap, HANDLE section);
+void GuardPages_Clear(void *bits, size_t bytes);
+
+#endif
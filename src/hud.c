@@ -0,0 +1,382 @@
+#include <windows.h>
+#include <stdio.h>
+#include <stdint.h>
+#include "opengl.h"
+#include "main.h"
+#include "hud.h"
+
+/* Glyph atlas based overlay drawn on top of the surface quad. The atlas is
+ * baked once with GDI from the system font so the text looks the same as the
+ * old DrawText overlay, but the game surface is never touched. */
+
+#define HUD_FIRST_CHAR 32
+#define HUD_LAST_CHAR 127
+#define HUD_SOLID_CHAR HUD_LAST_CHAR
+#define HUD_CHAR_COUNT (HUD_LAST_CHAR - HUD_FIRST_CHAR + 1)
+#define HUD_ATLAS_COLUMNS 16
+#define HUD_MAX_QUADS 1024
+
+static const GLchar *HudVertShaderSrc =
+    "#version 130\n"
+    "in vec2 VertexCoord;\n"
+    "in vec2 TexCoord;\n"
+    "in vec4 COLOR;\n"
+    "out vec2 TEX0;\n"
+    "out vec4 COL0;\n"
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    gl_Position = vec4(VertexCoord, 0.0, 1.0);\n"
+    "    TEX0 = TexCoord;\n"
+    "    COL0 = COLOR;\n"
+    "}\n";
+
+static const GLchar *HudFragShaderSrc =
+    "#version 130\n"
+    "out vec4 FragColor;\n"
+    "uniform sampler2D AtlasTex;\n"
+    "in vec2 TEX0;\n"
+    "in vec4 COL0;\n"
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    FragColor = COL0 * texture(AtlasTex, TEX0);\n"
+    "}\n";
+
+typedef struct
+{
+    GLfloat x, y;
+    GLfloat u, v;
+    GLfloat r, g, b, a;
+} HudVertex;
+
+static struct
+{
+    BOOL initialized;
+    GLuint texture;
+    GLuint program;
+    GLuint vao;
+    GLuint vbo;
+    int cellWidth;
+    int cellHeight;
+    int atlasWidth;
+    int atlasHeight;
+    int advance[HUD_CHAR_COUNT];
+    int viewWidth;
+    int viewHeight;
+    int vertexCount;
+    HudVertex vertices[HUD_MAX_QUADS * 6];
+} hud;
+
+static int NextPow2(int v)
+{
+    v--; v |= v >> 1; v |= v >> 2; v |= v >> 4; v |= v >> 8; v |= v >> 16; v++;
+    return v;
+}
+
+static BOOL Hud_BakeAtlas()
+{
+    BOOL result = FALSE;
+    HDC hDC = CreateCompatibleDC(NULL);
+    if (!hDC)
+        return FALSE;
+
+    HGDIOBJ oldFont = SelectObject(hDC, GetStockObject(SYSTEM_FONT));
+
+    TEXTMETRIC tm;
+    GetTextMetrics(hDC, &tm);
+
+    hud.cellWidth = tm.tmMaxCharWidth + 1;
+    hud.cellHeight = tm.tmHeight;
+
+    int rows = (HUD_CHAR_COUNT + HUD_ATLAS_COLUMNS - 1) / HUD_ATLAS_COLUMNS;
+    hud.atlasWidth = NextPow2(hud.cellWidth * HUD_ATLAS_COLUMNS);
+    hud.atlasHeight = NextPow2(hud.cellHeight * rows);
+
+    BITMAPINFO bmi;
+    memset(&bmi, 0, sizeof(bmi));
+    bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+    bmi.bmiHeader.biWidth = hud.atlasWidth;
+    bmi.bmiHeader.biHeight = -hud.atlasHeight;
+    bmi.bmiHeader.biPlanes = 1;
+    bmi.bmiHeader.biBitCount = 32;
+    bmi.bmiHeader.biCompression = BI_RGB;
+
+    uint32_t *pixels = NULL;
+    HBITMAP bitmap = CreateDIBSection(hDC, &bmi, DIB_RGB_COLORS, (void **)&pixels, NULL, 0);
+    if (!bitmap || !pixels)
+        goto finish;
+
+    HGDIOBJ oldBM = SelectObject(hDC, bitmap);
+    memset(pixels, 0, hud.atlasWidth * hud.atlasHeight * 4);
+
+    SetBkMode(hDC, TRANSPARENT);
+    SetTextColor(hDC, RGB(255, 255, 255));
+
+    for (int i = 0; i < HUD_CHAR_COUNT; i++)
+    {
+        char ch = (char)(HUD_FIRST_CHAR + i);
+        int x = (i % HUD_ATLAS_COLUMNS) * hud.cellWidth;
+        int y = (i / HUD_ATLAS_COLUMNS) * hud.cellHeight;
+
+        if (ch == HUD_SOLID_CHAR)
+        {
+            hud.advance[i] = hud.cellWidth;
+            continue;
+        }
+
+        SIZE size;
+        GetTextExtentPoint32(hDC, &ch, 1, &size);
+        hud.advance[i] = size.cx < hud.cellWidth ? size.cx : hud.cellWidth;
+        TextOut(hDC, x, y, &ch, 1);
+    }
+    GdiFlush();
+
+    // The solid cell is used for backgrounds and the frame time graph
+    {
+        int i = HUD_SOLID_CHAR - HUD_FIRST_CHAR;
+        int x = (i % HUD_ATLAS_COLUMNS) * hud.cellWidth;
+        int y = (i / HUD_ATLAS_COLUMNS) * hud.cellHeight;
+
+        for (int row = y; row < y + hud.cellHeight; row++)
+            for (int col = x; col < x + hud.cellWidth; col++)
+                pixels[row * hud.atlasWidth + col] = 0x00FFFFFF;
+    }
+
+    // Coverage goes to alpha, color is always white and tinted per vertex
+    for (int i = 0; i < hud.atlasWidth * hud.atlasHeight; i++)
+        pixels[i] = ((pixels[i] >> 16) & 0xFF) << 24 | 0x00FFFFFF;
+
+    glGenTextures(1, &hud.texture);
+    glBindTexture(GL_TEXTURE_2D, hud.texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, hud.atlasWidth, hud.atlasHeight, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    GLenum gle = glGetError();
+    if (gle != GL_NO_ERROR)
+        dprintf("Hud_BakeAtlas glTexImage2D, %x\n", gle);
+    else
+        result = TRUE;
+
+    SelectObject(hDC, oldBM);
+
+finish:
+    if (bitmap)
+        DeleteObject(bitmap);
+
+    SelectObject(hDC, oldFont);
+    DeleteDC(hDC);
+    return result;
+}
+
+BOOL Hud_Init(BOOL useShaders)
+{
+    memset(&hud, 0, sizeof(hud));
+
+    if (!Hud_BakeAtlas())
+    {
+        Hud_Free();
+        return FALSE;
+    }
+
+    if (useShaders)
+    {
+        hud.program = OpenGL_BuildProgram(HudVertShaderSrc, HudFragShaderSrc);
+
+        if (hud.program)
+        {
+            glUseProgram(hud.program);
+            glUniform1i(glGetUniformLocation(hud.program, "AtlasTex"), 0);
+
+            GLint vertexCoordAttrLoc = glGetAttribLocation(hud.program, "VertexCoord");
+            GLint texCoordAttrLoc = glGetAttribLocation(hud.program, "TexCoord");
+            GLint colorAttrLoc = glGetAttribLocation(hud.program, "COLOR");
+
+            glGenVertexArrays(1, &hud.vao);
+            glBindVertexArray(hud.vao);
+
+            glGenBuffers(1, &hud.vbo);
+            glBindBuffer(GL_ARRAY_BUFFER, hud.vbo);
+            glBufferData(GL_ARRAY_BUFFER, sizeof(hud.vertices), NULL, GL_STREAM_DRAW);
+
+            glVertexAttribPointer(vertexCoordAttrLoc, 2, GL_FLOAT, GL_FALSE, sizeof(HudVertex), (void *)0);
+            glEnableVertexAttribArray(vertexCoordAttrLoc);
+            glVertexAttribPointer(texCoordAttrLoc, 2, GL_FLOAT, GL_FALSE, sizeof(HudVertex), (void *)(2 * sizeof(GLfloat)));
+            glEnableVertexAttribArray(texCoordAttrLoc);
+            glVertexAttribPointer(colorAttrLoc, 4, GL_FLOAT, GL_FALSE, sizeof(HudVertex), (void *)(4 * sizeof(GLfloat)));
+            glEnableVertexAttribArray(colorAttrLoc);
+
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+            glBindVertexArray(0);
+            glUseProgram(0);
+        }
+
+        GLenum gle = glGetError();
+        if (!hud.program || gle != GL_NO_ERROR)
+        {
+            dprintf("Hud_Init shader setup failed, %x\n", gle);
+            Hud_Free();
+            return FALSE;
+        }
+    }
+
+    hud.initialized = TRUE;
+    dprintf("Hud_Init: atlas %dx%d, cell %dx%d\n", hud.atlasWidth, hud.atlasHeight, hud.cellWidth, hud.cellHeight);
+    return TRUE;
+}
+
+void Hud_Free()
+{
+    if (hud.vbo)
+        glDeleteBuffers(1, &hud.vbo);
+
+    if (hud.vao)
+        glDeleteVertexArrays(1, &hud.vao);
+
+    if (hud.program)
+        glDeleteProgram(hud.program);
+
+    if (hud.texture)
+        glDeleteTextures(1, &hud.texture);
+
+    memset(&hud, 0, sizeof(hud));
+}
+
+void Hud_MeasureText(const char *text, int *width, int *height)
+{
+    int x = 0, maxX = 0, lines = 1;
+
+    for (; *text; text++)
+    {
+        unsigned char ch = (unsigned char)*text;
+
+        if (ch == '\n')
+        {
+            x = 0;
+            lines++;
+            continue;
+        }
+
+        if (ch >= HUD_FIRST_CHAR && ch < HUD_SOLID_CHAR)
+            x += hud.advance[ch - HUD_FIRST_CHAR];
+
+        if (x > maxX)
+            maxX = x;
+    }
+
+    *width = maxX;
+    *height = lines * hud.cellHeight;
+}
+
+void Hud_Begin(int viewWidth, int viewHeight)
+{
+    hud.viewWidth = viewWidth > 0 ? viewWidth : 1;
+    hud.viewHeight = viewHeight > 0 ? viewHeight : 1;
+    hud.vertexCount = 0;
+}
+
+static void Hud_Quad(float x, float y, float w, float h, float u0, float v0, float u1, float v1, DWORD color)
+{
+    if (hud.vertexCount + 6 > HUD_MAX_QUADS * 6)
+        return;
+
+    float x0 = x / hud.viewWidth * 2.0f - 1.0f;
+    float y0 = 1.0f - y / hud.viewHeight * 2.0f;
+    float x1 = (x + w) / hud.viewWidth * 2.0f - 1.0f;
+    float y1 = 1.0f - (y + h) / hud.viewHeight * 2.0f;
+
+    float r = (color & 0xFF) / 255.0f;
+    float g = ((color >> 8) & 0xFF) / 255.0f;
+    float b = ((color >> 16) & 0xFF) / 255.0f;
+    float a = ((color >> 24) & 0xFF) / 255.0f;
+
+    HudVertex quad[6] = {
+        { x0, y0, u0, v0, r, g, b, a },
+        { x1, y0, u1, v0, r, g, b, a },
+        { x1, y1, u1, v1, r, g, b, a },
+        { x0, y0, u0, v0, r, g, b, a },
+        { x1, y1, u1, v1, r, g, b, a },
+        { x0, y1, u0, v1, r, g, b, a },
+    };
+
+    memcpy(&hud.vertices[hud.vertexCount], quad, sizeof(quad));
+    hud.vertexCount += 6;
+}
+
+void Hud_Text(int x, int y, const char *text, DWORD color)
+{
+    int penX = x;
+
+    for (; *text; text++)
+    {
+        unsigned char ch = (unsigned char)*text;
+
+        if (ch == '\n')
+        {
+            penX = x;
+            y += hud.cellHeight;
+            continue;
+        }
+
+        if (ch < HUD_FIRST_CHAR || ch >= HUD_SOLID_CHAR)
+            continue;
+
+        int i = ch - HUD_FIRST_CHAR;
+        float u0 = (float)((i % HUD_ATLAS_COLUMNS) * hud.cellWidth) / hud.atlasWidth;
+        float v0 = (float)((i / HUD_ATLAS_COLUMNS) * hud.cellHeight) / hud.atlasHeight;
+        float u1 = u0 + (float)hud.advance[i] / hud.atlasWidth;
+        float v1 = v0 + (float)hud.cellHeight / hud.atlasHeight;
+
+        Hud_Quad(penX, y, hud.advance[i], hud.cellHeight, u0, v0, u1, v1, color);
+        penX += hud.advance[i];
+    }
+}
+
+void Hud_Rect(int x, int y, int width, int height, DWORD color)
+{
+    int i = HUD_SOLID_CHAR - HUD_FIRST_CHAR;
+    float u = ((i % HUD_ATLAS_COLUMNS) * hud.cellWidth + hud.cellWidth / 2.0f) / hud.atlasWidth;
+    float v = ((i / HUD_ATLAS_COLUMNS) * hud.cellHeight + hud.cellHeight / 2.0f) / hud.atlasHeight;
+
+    Hud_Quad(x, y, width, height, u, v, u, v, color);
+}
+
+void Hud_End()
+{
+    if (!hud.initialized || hud.vertexCount == 0)
+        return;
+
+    glViewport(0, 0, hud.viewWidth, hud.viewHeight);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glBindTexture(GL_TEXTURE_2D, hud.texture);
+
+    if (hud.program)
+    {
+        glUseProgram(hud.program);
+        glBindVertexArray(hud.vao);
+        glBindBuffer(GL_ARRAY_BUFFER, hud.vbo);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, hud.vertexCount * sizeof(HudVertex), hud.vertices);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glDrawArrays(GL_TRIANGLES, 0, hud.vertexCount);
+    }
+    else
+    {
+        glBegin(GL_TRIANGLES);
+        for (int i = 0; i < hud.vertexCount; i++)
+        {
+            HudVertex *vx = &hud.vertices[i];
+            glColor4f(vx->r, vx->g, vx->b, vx->a);
+            glTexCoord2f(vx->u, vx->v);
+            glVertex2f(vx->x, vx->y);
+        }
+        glEnd();
+        glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
+    }
+
+    glDisable(GL_BLEND);
+    hud.vertexCount = 0;
+}
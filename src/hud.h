@@ -0,0 +1,16 @@
+#ifndef _HUD_
+#define _HUD_
+
+#include <windows.h>
+
+#define HUD_RGBA(r,g,b,a) ((DWORD)(((BYTE)(r)) | ((BYTE)(g) << 8) | ((BYTE)(b) << 16) | ((BYTE)(a) << 24)))
+
+BOOL Hud_Init(BOOL useShaders);
+void Hud_Free();
+void Hud_MeasureText(const char *text, int *width, int *height);
+void Hud_Begin(int viewWidth, int viewHeight);
+void Hud_Text(int x, int y, const char *text, DWORD color);
+void Hud_Rect(int x, int y, int width, int height, DWORD color);
+void Hud_End();
+
+#endif
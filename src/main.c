@@ -18,6 +18,12 @@
 #include "main.h"
 #include "IDirectDraw.h"
 #include "Settings.h"
+#include "surfacepool.h"
+#include "guardpage.h"
+#include "screenshot.h"
+#include "affinity.h"
+#include "pool.h"
+#include "modes.h"
 
 void hook_init();
 
@@ -65,6 +71,12 @@ BOOL WINAPI DllMainCRTStartup(HINSTANCE hinstDLL, DWORD fdwReason, LPVOID lpvRes
         }
         break;
     }
+    case DLL_THREAD_ATTACH:
+        Affinity_ThreadAttached();
+        break;
+    case DLL_THREAD_DETACH:
+        Affinity_ThreadDetached();
+        break;
     case DLL_PROCESS_DETACH:
         break;
     }
@@ -100,6 +112,21 @@ DWORD SystemAffinity = 0;
 DWORD ProcAffinity = 0;
 bool GlFenceSync = false;
 DWORD FixedOutput = DMDFO_STRETCH;
+bool GpuBlitCache = false;
+char ShaderChain[1024] = "";
+LONG GdiScaler = SCALER_STRETCHBLT;
+int GdiScalerThreads = -1;
+int SurfacePoolSize = 32;
+bool AlignedPitch = false;
+bool GuardPages = true;
+char FrameExport[64] = "";
+bool FrameExportXrgb = false;
+char Record[MAX_PATH] = "";
+char Screenshot[MAX_PATH] = "screenshot";
+bool ScreenshotScaled = false;
+int PoolThreads = -1;
+DWORD PoolAffinity = 0;
+bool PresentPipeline = false;
 
 HRESULT WINAPI DirectDrawCreate(GUID FAR* lpGUID, LPDIRECTDRAW FAR* lplpDD, IUnknown FAR* pUnkOuter)
 {
@@ -141,7 +168,12 @@ HRESULT WINAPI DirectDrawCreate(GUID FAR* lpGUID, LPDIRECTDRAW FAR* lplpDD, IUnk
     }
 
     SettingsLoad();
+    Modes_Init();
     hook_init();
+    GuardPages_Init();
+    SurfacePool_Init();
+    Pool_Init(PoolThreads);
+    Screenshot_Init();
 
     IDirectDrawImpl *ddraw = IDirectDrawImpl_construct();
 
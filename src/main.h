@@ -77,6 +77,31 @@ DWORD SystemAffinity;
 DWORD ProcAffinity;
 bool GlFenceSync;
 DWORD FixedOutput;
+bool GpuBlitCache;
+char ShaderChain[1024];
+
+// GdiScaler modes
+#define SCALER_STRETCHBLT 0
+#define SCALER_NEAREST 1
+#define SCALER_INTEGER 2
+#define SCALER_BILINEAR 3
+
+LONG GdiScaler;
+int GdiScalerThreads;
+int SurfacePoolSize;
+
+/* rows start on a cache line, lPitch is padded to match */
+#define SURFACE_ROW_ALIGN 64
+bool AlignedPitch;
+bool GuardPages;
+char FrameExport[64];
+bool FrameExportXrgb;
+char Record[MAX_PATH];
+char Screenshot[MAX_PATH];
+bool ScreenshotScaled;
+int PoolThreads;
+DWORD PoolAffinity;
+bool PresentPipeline;
 
 #define debug_(format, ...) DebugPrint("xDBG " format "\n", ##__VA_ARGS__)
 
@@ -0,0 +1,245 @@
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "main.h"
+#include "modes.h"
+
+/* The display modes are enumerated once into a table sorted by width, height,
+ * bpp and refresh rate, instead of walking EnumDisplaySettings in every
+ * EnumDisplayModes and SetDisplayMode call (which runs again on every alt-tab
+ * and takes tens of milliseconds on some drivers). WM_DISPLAYCHANGE throws the
+ * table away unless it was caused by one of our own mode changes. */
+
+#define MODE_FIELDS (DM_PELSWIDTH | DM_PELSHEIGHT | DM_DISPLAYFREQUENCY | DM_BITSPERPEL)
+
+typedef struct
+{
+    DEVMODE dm;
+    DWORD index;
+} DisplayMode;
+
+static struct
+{
+    CRITICAL_SECTION lock;
+    BOOL lockReady;
+    volatile LONG valid;
+    volatile LONG changing;
+
+    DisplayMode *modes;
+    int count;
+
+    // What EnumDisplayModes lists, picked from the enumeration order like before
+    DWORD refreshRate;
+    DWORD bpp;
+    DWORD flags;
+    DWORD fixedOutput;
+} modes;
+
+static int Modes_Compare(const void *a, const void *b)
+{
+    const DisplayMode *x = a, *y = b;
+
+    if (x->dm.dmPelsWidth != y->dm.dmPelsWidth)
+        return x->dm.dmPelsWidth < y->dm.dmPelsWidth ? -1 : 1;
+    if (x->dm.dmPelsHeight != y->dm.dmPelsHeight)
+        return x->dm.dmPelsHeight < y->dm.dmPelsHeight ? -1 : 1;
+    if (x->dm.dmBitsPerPel != y->dm.dmBitsPerPel)
+        return x->dm.dmBitsPerPel < y->dm.dmBitsPerPel ? -1 : 1;
+    if (x->dm.dmDisplayFrequency != y->dm.dmDisplayFrequency)
+        return x->dm.dmDisplayFrequency < y->dm.dmDisplayFrequency ? -1 : 1;
+
+    return x->index < y->index ? -1 : 1;
+}
+
+static void Modes_Build()
+{
+    int capacity = 0;
+    DEVMODE dm;
+
+    modes.count = 0;
+    modes.refreshRate = 0;
+    modes.bpp = 0;
+    modes.flags = 99998;
+    modes.fixedOutput = 99998;
+
+    memset(&dm, 0, sizeof(dm));
+    dm.dmSize = sizeof(dm);
+
+    for (DWORD i = 0; EnumDisplaySettings(NULL, i, &dm); i++)
+    {
+        if (modes.refreshRate != 60 && dm.dmDisplayFrequency >= 50)
+            modes.refreshRate = dm.dmDisplayFrequency;
+
+        if (modes.bpp != 32 && dm.dmBitsPerPel >= 16)
+            modes.bpp = dm.dmBitsPerPel;
+
+        if (modes.flags != 0)
+            modes.flags = dm.dmDisplayFlags;
+
+        if (modes.fixedOutput != DMDFO_DEFAULT)
+            modes.fixedOutput = dm.dmDisplayFixedOutput;
+
+        if (modes.count == capacity)
+        {
+            int grown = capacity ? capacity * 2 : 128;
+            DisplayMode *table = realloc(modes.modes, grown * sizeof(DisplayMode));
+            if (!table)
+                break;
+
+            modes.modes = table;
+            capacity = grown;
+        }
+
+        modes.modes[modes.count].dm = dm;
+        modes.modes[modes.count].index = i;
+        modes.count++;
+
+        memset(&dm, 0, sizeof(dm));
+        dm.dmSize = sizeof(dm);
+    }
+
+    qsort(modes.modes, modes.count, sizeof(DisplayMode), Modes_Compare);
+
+    dprintf("Modes: %d display modes\n", modes.count);
+
+#ifdef _DEBUG
+    for (int i = 0; i < modes.count; i++)
+    {
+        DEVMODE *m = &modes.modes[i].dm;
+        const char *fixed = "";
+
+        if (m->dmFields & DM_DISPLAYFIXEDOUTPUT)
+        {
+            switch (m->dmDisplayFixedOutput)
+            {
+            case DMDFO_DEFAULT: fixed = " DMDFO_DEFAULT"; break;
+            case DMDFO_CENTER: fixed = " DMDFO_CENTER"; break;
+            case DMDFO_STRETCH: fixed = " DMDFO_STRETCH"; break;
+            default: break;
+            }
+        }
+
+        dprintf("        %dx%d-%d %dhz%s\n", (int)m->dmPelsWidth, (int)m->dmPelsHeight, (int)m->dmBitsPerPel, (int)m->dmDisplayFrequency, fixed);
+    }
+#endif
+}
+
+/* Enters the lock with a current table */
+static void Modes_Lock()
+{
+    EnterCriticalSection(&modes.lock);
+
+    if (!InterlockedExchange(&modes.valid, TRUE))
+        Modes_Build();
+}
+
+void Modes_Init()
+{
+    if (modes.lockReady)
+        return;
+
+    InitializeCriticalSection(&modes.lock);
+    modes.lockReady = TRUE;
+
+    Modes_Lock();
+    LeaveCriticalSection(&modes.lock);
+}
+
+/* First mode of width x height, binary search on the sorted table */
+static int Modes_LowerBound(DWORD width, DWORD height)
+{
+    int lo = 0, hi = modes.count;
+
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        DEVMODE *m = &modes.modes[mid].dm;
+
+        if (m->dmPelsWidth < width || (m->dmPelsWidth == width && m->dmPelsHeight < height))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/* Resolutions for EnumDisplayModes, ascending */
+int Modes_EnumSizes(ModeSize *sizes, int max)
+{
+    int count = 0;
+
+    Modes_Lock();
+
+    for (int i = 0; i < modes.count && count < max; i++)
+    {
+        DEVMODE *m = &modes.modes[i].dm;
+
+        if (m->dmDisplayFrequency != modes.refreshRate || m->dmBitsPerPel != modes.bpp ||
+            m->dmDisplayFlags != modes.flags || m->dmDisplayFixedOutput != modes.fixedOutput)
+            continue;
+
+        if (count > 0 && sizes[count - 1].width == m->dmPelsWidth && sizes[count - 1].height == m->dmPelsHeight)
+            continue;
+
+        sizes[count].width = m->dmPelsWidth;
+        sizes[count].height = m->dmPelsHeight;
+        count++;
+    }
+
+    LeaveCriticalSection(&modes.lock);
+    return count;
+}
+
+/* The 32 bpp mode of width x height with the highest refresh rate, with the
+ * wanted fixed output if there is one */
+BOOL Modes_Find(DWORD width, DWORD height, DWORD fixedOutput, DEVMODE *mode)
+{
+    const DisplayMode *best = NULL, *any = NULL;
+
+    Modes_Lock();
+
+    for (int i = Modes_LowerBound(width, height); i < modes.count; i++)
+    {
+        const DisplayMode *m = &modes.modes[i];
+
+        if (m->dm.dmPelsWidth != width || m->dm.dmPelsHeight != height)
+            break;
+
+        if ((m->dm.dmFields & MODE_FIELDS) != MODE_FIELDS || m->dm.dmBitsPerPel != 32)
+            continue;
+
+        // Sorted by refresh rate, the last match is the fastest
+        any = m;
+
+        if (fixedOutput == DMDFO_DEFAULT || ((m->dm.dmFields & DM_DISPLAYFIXEDOUTPUT) && m->dm.dmDisplayFixedOutput == fixedOutput))
+            best = m;
+    }
+
+    if (!best)
+        best = any;
+
+    if (best)
+        memcpy(mode, &best->dm, sizeof(*mode));
+
+    LeaveCriticalSection(&modes.lock);
+    return best != NULL;
+}
+
+/* ChangeDisplaySettings, the WM_DISPLAYCHANGE it sends keeps the table */
+LONG Modes_Change(DEVMODE *mode, DWORD flags)
+{
+    InterlockedIncrement(&modes.changing);
+    LONG result = ChangeDisplaySettings(mode, flags);
+    InterlockedDecrement(&modes.changing);
+
+    return result;
+}
+
+/* WM_DISPLAYCHANGE, a monitor or driver change can bring other modes */
+void Modes_DisplayChanged()
+{
+    if (InterlockedExchangeAdd(&modes.changing, 0) == 0)
+        InterlockedExchange(&modes.valid, FALSE);
+}
@@ -0,0 +1,20 @@
+#ifndef _MODES_
+#define _MODES_
+
+#include <windows.h>
+
+#define MODES_MAX_SIZES 256
+
+typedef struct
+{
+    DWORD width;
+    DWORD height;
+} ModeSize;
+
+void Modes_Init();
+int Modes_EnumSizes(ModeSize *sizes, int max);
+BOOL Modes_Find(DWORD width, DWORD height, DWORD fixedOutput, DEVMODE *mode);
+LONG Modes_Change(DEVMODE *mode, DWORD flags);
+void Modes_DisplayChanged();
+
+#endif
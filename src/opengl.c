@@ -306,7 +306,7 @@ BOOL TextureUploadTest(int width, int height, GLint internalFormat, GLenum forma
     GLenum gle = GL_NO_ERROR;
 
     char testData[] = { 0,1,2,0,0,2,3,0,0,4,5,0,0,6,7,0,0,8,9,0 };
-    void *textureBuffer = calloc(1, 2 * width * height);
+    void *textureBuffer = calloc(1, 4 * width * height);
 
     GLuint texID;
 
@@ -0,0 +1,242 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "png.h"
+
+/* Minimal PNG writer for screenshots and tools/recdecode.c. Rows use the Sub
+ * filter and are compressed as a single fixed Huffman deflate block with a
+ * greedy LZ77 matcher, which is good enough for game graphics without zlib. */
+
+#define DEFLATE_WINDOW 32768
+#define DEFLATE_HASH_BITS 15
+#define DEFLATE_MIN_MATCH 3
+#define DEFLATE_MAX_MATCH 258
+
+static const unsigned short lengthBase[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const unsigned char lengthExtra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const unsigned short distanceBase[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const unsigned char distanceExtra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+typedef struct
+{
+    uint8_t *out;
+    size_t pos;
+    uint32_t bits;
+    int count;
+} BitWriter;
+
+static void PutBits(BitWriter *w, uint32_t value, int count)
+{
+    w->bits |= value << w->count;
+    w->count += count;
+
+    while (w->count >= 8)
+    {
+        w->out[w->pos++] = (uint8_t)w->bits;
+        w->bits >>= 8;
+        w->count -= 8;
+    }
+}
+
+/* Huffman codes are stored starting with their most significant bit */
+static void PutCode(BitWriter *w, uint32_t code, int count)
+{
+    uint32_t reversed = 0;
+    for (int i = 0; i < count; i++)
+        reversed |= ((code >> i) & 1) << (count - 1 - i);
+
+    PutBits(w, reversed, count);
+}
+
+static void PutSymbol(BitWriter *w, int symbol)
+{
+    if (symbol < 144)
+        PutCode(w, 0x30 + symbol, 8);
+    else if (symbol < 256)
+        PutCode(w, 0x190 + symbol - 144, 9);
+    else if (symbol < 280)
+        PutCode(w, symbol - 256, 7);
+    else
+        PutCode(w, 0xC0 + symbol - 280, 8);
+}
+
+static void PutMatch(BitWriter *w, int length, int distance)
+{
+    int i = 28;
+    while (lengthBase[i] > length)
+        i--;
+
+    PutSymbol(w, 257 + i);
+    PutBits(w, length - lengthBase[i], lengthExtra[i]);
+
+    int d = 29;
+    while (distanceBase[d] > distance)
+        d--;
+
+    PutCode(w, d, 5);
+    PutBits(w, distance - distanceBase[d], distanceExtra[d]);
+}
+
+/* zlib stream of src, out must hold size + size / 8 + 64 bytes */
+static size_t Deflate(const uint8_t *src, size_t size, uint8_t *out)
+{
+    int32_t *head = malloc(sizeof(int32_t) << DEFLATE_HASH_BITS);
+    if (!head)
+        return 0;
+
+    memset(head, 0xFF, sizeof(int32_t) << DEFLATE_HASH_BITS);
+
+    BitWriter w = { out, 0, 0, 0 };
+    out[w.pos++] = 0x78;
+    out[w.pos++] = 0x01;
+
+    PutBits(&w, 1, 1);
+    PutBits(&w, 1, 2);
+
+    size_t i = 0;
+    while (i < size)
+    {
+        int length = 0, distance = 0;
+
+        if (i + DEFLATE_MIN_MATCH <= size)
+        {
+            uint32_t h = ((src[i] << 16 | src[i + 1] << 8 | src[i + 2]) * 2654435761u) >> (32 - DEFLATE_HASH_BITS);
+            int32_t candidate = head[h];
+            head[h] = (int32_t)i;
+
+            if (candidate >= 0 && i - candidate <= DEFLATE_WINDOW)
+            {
+                size_t max = size - i < DEFLATE_MAX_MATCH ? size - i : DEFLATE_MAX_MATCH;
+                while ((size_t)length < max && src[candidate + length] == src[i + length])
+                    length++;
+
+                distance = (int)(i - candidate);
+            }
+        }
+
+        if (length >= DEFLATE_MIN_MATCH)
+        {
+            PutMatch(&w, length, distance);
+            i += length;
+        }
+        else
+        {
+            PutSymbol(&w, src[i]);
+            i++;
+        }
+    }
+
+    PutSymbol(&w, 256);
+    PutBits(&w, 0, 7);
+
+    uint32_t a = 1, b = 0;
+    for (size_t k = 0; k < size; k++)
+    {
+        a = (a + src[k]) % 65521;
+        b = (b + a) % 65521;
+    }
+
+    w.out[w.pos++] = (uint8_t)(b >> 8);
+    w.out[w.pos++] = (uint8_t)b;
+    w.out[w.pos++] = (uint8_t)(a >> 8);
+    w.out[w.pos++] = (uint8_t)a;
+
+    free(head);
+    return w.pos;
+}
+
+static uint32_t Crc(uint32_t crc, const uint8_t *data, size_t size)
+{
+    static uint32_t table[256];
+
+    if (!table[1])
+    {
+        for (uint32_t n = 0; n < 256; n++)
+        {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++)
+                c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            table[n] = c;
+        }
+    }
+
+    crc = ~crc;
+    while (size--)
+        crc = table[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+static void PutBE32(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static void WriteChunk(FILE *fp, const char *type, const uint8_t *data, uint32_t size)
+{
+    uint8_t buf[8];
+    PutBE32(buf, size);
+    memcpy(buf + 4, type, 4);
+    fwrite(buf, 1, 8, fp);
+
+    if (size)
+        fwrite(data, 1, size, fp);
+
+    PutBE32(buf, Crc(Crc(0, (const uint8_t *)type, 4), data, size));
+    fwrite(buf, 1, 4, fp);
+}
+
+/* rgb holds width * 3 bytes per row, top row first */
+int Png_Write(const char *path, const uint8_t *rgb, int width, int height)
+{
+    size_t stride = (size_t)width * 3 + 1;
+    size_t raw = stride * height;
+    uint8_t *filtered = malloc(raw);
+    uint8_t *z = malloc(raw + raw / 8 + 64);
+    size_t zBytes = 0;
+    FILE *fp = NULL;
+
+    if (filtered && z)
+    {
+        for (int y = 0; y < height; y++)
+        {
+            const uint8_t *row = rgb + (size_t)y * width * 3;
+            uint8_t *out = filtered + y * stride;
+
+            out[0] = 1;
+            for (int x = 0; x < width * 3; x++)
+                out[x + 1] = (uint8_t)(row[x] - (x >= 3 ? row[x - 3] : 0));
+        }
+
+        zBytes = Deflate(filtered, raw, z);
+    }
+
+    if (zBytes && (fp = fopen(path, "wb")))
+    {
+        uint8_t ihdr[13] = { 0 };
+        PutBE32(ihdr, width);
+        PutBE32(ihdr + 4, height);
+        ihdr[8] = 8;
+        ihdr[9] = 2;
+
+        fwrite("\x89PNG\r\n\x1a\n", 1, 8, fp);
+        WriteChunk(fp, "IHDR", ihdr, sizeof(ihdr));
+        WriteChunk(fp, "IDAT", z, (uint32_t)zBytes);
+        WriteChunk(fp, "IEND", NULL, 0);
+        fclose(fp);
+    }
+
+    free(filtered);
+    free(z);
+    return fp != NULL;
+}
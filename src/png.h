@@ -0,0 +1,8 @@
+#ifndef _PNG_
+#define _PNG_
+
+#include <stdint.h>
+
+int Png_Write(const char *path, const uint8_t *rgb, int width, int height);
+
+#endif
@@ -0,0 +1,280 @@
+#include <windows.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "main.h"
+#include "affinity.h"
+#include "pool.h"
+
+/* Small fixed size pool for pixel work. Each worker has a deque, it takes its
+ * own tasks from the bottom and steals from the top of the others when it runs
+ * out. Callers push their tasks round robin, run the first one themselves and
+ * take back whatever is still queued of their own job, so a job never waits on
+ * a sleeping worker. Jobs too small to be worth it run inline. The workers
+ * live as long as the process, like the screenshot worker. */
+
+#define POOL_MAX_THREADS 8
+#define POOL_DEQUE_SIZE 64
+#define POOL_MAX_TASKS 32
+#define POOL_MIN_BAND_BYTES (64 * 1024)
+
+typedef struct
+{
+    PoolTaskProc proc;
+    void *ctx;
+    volatile LONG pending;
+} PoolJob;
+
+typedef struct
+{
+    PoolJob *job;
+    int index;
+} PoolTask;
+
+typedef struct
+{
+    CRITICAL_SECTION lock;
+    PoolTask tasks[POOL_DEQUE_SIZE];
+    int top;
+    int bottom;
+} PoolDeque;
+
+typedef struct
+{
+    PoolRowsProc proc;
+    void *ctx;
+    int rows;
+    int bands;
+} PoolRows;
+
+static struct
+{
+    int threadCount;
+    volatile LONG next;
+    HANDLE threads[POOL_MAX_THREADS];
+    HANDLE wake;
+    PoolDeque deques[POOL_MAX_THREADS];
+} pool;
+
+static BOOL Pool_Push(PoolDeque *deque, PoolJob *job, int index)
+{
+    BOOL pushed = FALSE;
+
+    EnterCriticalSection(&deque->lock);
+    if (deque->top == deque->bottom)
+        deque->top = deque->bottom = 0;
+
+    if (deque->bottom - deque->top < POOL_DEQUE_SIZE)
+    {
+        PoolTask *task = &deque->tasks[deque->bottom % POOL_DEQUE_SIZE];
+        task->job = job;
+        task->index = index;
+        deque->bottom++;
+        pushed = TRUE;
+    }
+    LeaveCriticalSection(&deque->lock);
+
+    return pushed;
+}
+
+/* Owner end, the most recently pushed task */
+static BOOL Pool_Pop(PoolDeque *deque, PoolTask *task)
+{
+    BOOL popped = FALSE;
+
+    EnterCriticalSection(&deque->lock);
+    if (deque->bottom > deque->top)
+    {
+        deque->bottom--;
+        *task = deque->tasks[deque->bottom % POOL_DEQUE_SIZE];
+        popped = TRUE;
+    }
+    LeaveCriticalSection(&deque->lock);
+
+    return popped;
+}
+
+/* Thief end, job limits it to the tasks of one job */
+static BOOL Pool_Steal(PoolDeque *deque, PoolTask *task, PoolJob *job)
+{
+    BOOL stolen = FALSE;
+
+    EnterCriticalSection(&deque->lock);
+    if (deque->bottom > deque->top && (!job || deque->tasks[deque->top % POOL_DEQUE_SIZE].job == job))
+    {
+        *task = deque->tasks[deque->top % POOL_DEQUE_SIZE];
+        deque->top++;
+        stolen = TRUE;
+    }
+    LeaveCriticalSection(&deque->lock);
+
+    return stolen;
+}
+
+static void Pool_Execute(const PoolTask *task)
+{
+    task->job->proc(task->job->ctx, task->index);
+    InterlockedDecrement(&task->job->pending);
+}
+
+static DWORD WINAPI Pool_Worker(LPVOID param)
+{
+    int self = (int)(intptr_t)param;
+
+    // PoolAffinity has to be inside the process mask, SingleProcAffinity decides that
+    if (!PoolAffinity || !SetThreadAffinityMask(GetCurrentThread(), PoolAffinity))
+        Affinity_PlaceThread(AFFINITY_WORKER);
+
+    for (;;)
+    {
+        PoolTask task;
+        BOOL found = Pool_Pop(&pool.deques[self], &task);
+
+        for (int i = 1; !found && i < pool.threadCount; i++)
+            found = Pool_Steal(&pool.deques[(self + i) % pool.threadCount], &task, NULL);
+
+        if (found)
+            Pool_Execute(&task);
+        else
+            WaitForSingleObject(pool.wake, INFINITE);
+    }
+
+    return 0;
+}
+
+BOOL Pool_Init(int threads)
+{
+    if (pool.threadCount)
+        return TRUE;
+
+    if (threads < 0)
+    {
+        SYSTEM_INFO si;
+        GetSystemInfo(&si);
+
+        // Whoever submits a job runs a share of it too
+        int processors = Affinity_RenderProcessors();
+        if (!processors)
+            processors = SingleProcAffinity ? 1 : (int)si.dwNumberOfProcessors;
+
+        threads = processors - 1;
+        if (threads > 4)
+            threads = 4;
+    }
+
+    if (threads > POOL_MAX_THREADS)
+        threads = POOL_MAX_THREADS;
+
+    if (threads <= 0)
+    {
+        dprintf("Pool_Init: no worker threads, pixel work runs inline\n");
+        return TRUE;
+    }
+
+    pool.wake = CreateSemaphore(NULL, 0, 0x7FFFFFFF, NULL);
+    if (!pool.wake)
+        return FALSE;
+
+    for (int i = 0; i < threads; i++)
+        InitializeCriticalSectionAndSpinCount(&pool.deques[i].lock, 4000);
+
+    for (int i = 0; i < threads; i++)
+    {
+        pool.threads[i] = CreateThread(NULL, 0, Pool_Worker, (LPVOID)(intptr_t)i, CREATE_SUSPENDED, NULL);
+        if (!pool.threads[i])
+            break;
+
+        pool.threadCount++;
+    }
+
+    for (int i = 0; i < pool.threadCount; i++)
+        ResumeThread(pool.threads[i]);
+
+    dprintf("Pool_Init: %d worker threads%s\n", pool.threadCount, PoolAffinity ? " (PoolAffinity)" : "");
+    return pool.threadCount > 0;
+}
+
+int Pool_Threads()
+{
+    return pool.threadCount;
+}
+
+/* Runs proc(ctx, 0 .. count - 1) and returns when all of them are done */
+void Pool_Run(int count, PoolTaskProc proc, void *ctx)
+{
+    if (pool.threadCount == 0 || count <= 1)
+    {
+        for (int i = 0; i < count; i++)
+            proc(ctx, i);
+        return;
+    }
+
+    PoolJob job = { proc, ctx, count };
+    DWORD first = (DWORD)InterlockedIncrement(&pool.next);
+    int queued = 0;
+
+    for (int i = 1; i < count; i++)
+    {
+        PoolTask task = { &job, i };
+
+        if (Pool_Push(&pool.deques[(first + i) % pool.threadCount], &job, i))
+            queued++;
+        else
+            Pool_Execute(&task);
+    }
+
+    if (queued > 0)
+        ReleaseSemaphore(pool.wake, queued < pool.threadCount ? queued : pool.threadCount, NULL);
+
+    PoolTask own = { &job, 0 };
+    Pool_Execute(&own);
+
+    // Take back what the workers haven't started, then wait for the rest
+    while (InterlockedExchangeAdd(&job.pending, 0) > 0)
+    {
+        PoolTask task;
+        BOOL found = FALSE;
+
+        for (int i = 0; !found && i < pool.threadCount; i++)
+            found = Pool_Steal(&pool.deques[i], &task, &job);
+
+        if (found)
+            Pool_Execute(&task);
+        else
+            SwitchToThread();
+    }
+}
+
+static void Pool_RowsTask(void *ctx, int band)
+{
+    PoolRows *rows = ctx;
+
+    rows->proc(rows->ctx, rows->rows * band / rows->bands, rows->rows * (band + 1) / rows->bands);
+}
+
+/* Splits rows into bands of at least 64 KB, a few more than there are threads
+ * so that stealing can even them out */
+void Pool_ParallelRows(int rows, int rowBytes, PoolRowsProc proc, void *ctx)
+{
+    int bands = rowBytes > 0 ? (int)((long long)rows * rowBytes / POOL_MIN_BAND_BYTES) : rows;
+    int maxBands = (pool.threadCount + 1) * 2;
+
+    if (bands > maxBands)
+        bands = maxBands;
+
+    if (bands > POOL_MAX_TASKS)
+        bands = POOL_MAX_TASKS;
+
+    if (bands > rows)
+        bands = rows;
+
+    if (pool.threadCount == 0 || bands <= 1)
+    {
+        if (rows > 0)
+            proc(ctx, 0, rows);
+        return;
+    }
+
+    PoolRows job = { proc, ctx, rows, bands };
+    Pool_Run(bands, Pool_RowsTask, &job);
+}
@@ -0,0 +1,14 @@
+#ifndef _POOL_
+#define _POOL_
+
+#include <windows.h>
+
+typedef void (*PoolTaskProc)(void *ctx, int index);
+typedef void (*PoolRowsProc)(void *ctx, int firstRow, int endRow);
+
+BOOL Pool_Init(int threads);
+int Pool_Threads();
+void Pool_Run(int count, PoolTaskProc proc, void *ctx);
+void Pool_ParallelRows(int rows, int rowBytes, PoolRowsProc proc, void *ctx);
+
+#endif
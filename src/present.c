@@ -0,0 +1,300 @@
+#include <windows.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "opengl.h"
+#include "main.h"
+#include "IDirectDrawSurface.h"
+#include "affinity.h"
+#include "present.h"
+
+/* Pipelined presenting for the OpenGL renderer (PresentPipeline). A prepare
+ * thread copies the visible part of the primary, with the GDI FPS text drawn
+ * on it, into one of two slots. The render thread uploads the newest slot, frees
+ * it and asks for the next frame before it draws and swaps, so a slow swap
+ * overlaps the copy of the following frame instead of delaying it. */
+
+#define PRESENT_SLOTS 2
+#define PRESENT_STATS_FRAMES 120
+
+#define SLOT_FREE 0
+#define SLOT_PREPARING 1
+#define SLOT_READY 2
+#define SLOT_SUBMITTING 3
+
+typedef struct
+{
+    volatile LONG state;
+    uint8_t *bits;
+    size_t capacity;
+    int x;
+    int y;
+    int width;
+    int height;
+    int pitch;
+    DWORD sequence;
+    LONGLONG prepared;
+} PresentSlot;
+
+static struct
+{
+    IDirectDrawSurfaceImpl *surface;
+    HANDLE thread;
+    HANDLE request;
+    HANDLE ready;
+    volatile LONG quit;
+    PresentSlot slots[PRESENT_SLOTS];
+    DWORD sequence;
+
+    CRITICAL_SECTION textLock;
+    char text[256];
+
+    LONGLONG frequency;
+    LONGLONG inFlight;
+    double latencySum;
+    double depthSum;
+    int samples;
+    int dropped;
+    int late;
+    double latency;
+    double depth;
+} present;
+
+static void Present_Prepare(PresentSlot *slot)
+{
+    IDirectDrawSurfaceImpl *this = present.surface;
+    char text[sizeof(present.text)];
+
+    EnterCriticalSection(&present.textLock);
+    memcpy(text, present.text, sizeof(text));
+    LeaveCriticalSection(&present.textLock);
+
+    EnterCriticalSection(&this->lock);
+
+    int rowBytes = this->dd->width * this->lXPitch;
+    int pitch = (rowBytes + 3) & ~3;
+    size_t bytes = (size_t)pitch * this->dd->height;
+
+    if (slot->capacity < bytes)
+    {
+        free(slot->bits);
+        slot->bits = malloc(bytes);
+        slot->capacity = slot->bits ? bytes : 0;
+    }
+
+    if (this->surface && slot->bits)
+    {
+        WindowGeometry geometry;
+        Geometry_Read(this->dd, &geometry);
+
+        slot->x = geometry.client.left;
+        slot->y = geometry.client.top;
+        slot->width = this->dd->width;
+        slot->height = this->dd->height;
+        slot->pitch = pitch;
+
+        if (text[0])
+        {
+            RECT textRect = { slot->x, slot->y, 0, 0 };
+            DrawText(this->hDC, text, -1, &textRect, DT_NOCLIP);
+            GdiFlush();
+        }
+
+        const uint8_t *src = (const uint8_t *)this->surface + slot->y * this->lPitch + slot->x * this->lXPitch;
+        for (int y = 0; y < slot->height; y++)
+            memcpy(slot->bits + (size_t)y * pitch, src + (size_t)y * this->lPitch, rowBytes);
+    }
+    else
+    {
+        slot->width = slot->height = 0;
+    }
+
+    LeaveCriticalSection(&this->lock);
+
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    slot->prepared = now.QuadPart;
+    slot->sequence = ++present.sequence;
+}
+
+static DWORD WINAPI Present_Thread(LPVOID unused)
+{
+    Affinity_PlaceThread(AFFINITY_RENDER);
+
+    // One frame is prepared for every frame the render thread takes
+    while (WaitForSingleObject(present.request, INFINITE) == WAIT_OBJECT_0 && !InterlockedExchangeAdd(&present.quit, 0))
+    {
+        for (int i = 0; i < PRESENT_SLOTS; i++)
+        {
+            PresentSlot *slot = &present.slots[i];
+
+            if (InterlockedCompareExchange(&slot->state, SLOT_PREPARING, SLOT_FREE) != SLOT_FREE)
+                continue;
+
+            Present_Prepare(slot);
+
+            InterlockedExchange(&slot->state, SLOT_READY);
+            SetEvent(present.ready);
+            break;
+        }
+    }
+
+    return 0;
+}
+
+BOOL Present_Init(IDirectDrawSurfaceImpl *surface)
+{
+    memset(&present, 0, sizeof(present));
+    present.surface = surface;
+
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    present.frequency = frequency.QuadPart;
+
+    InitializeCriticalSection(&present.textLock);
+    present.request = CreateEvent(NULL, FALSE, TRUE, NULL);
+    present.ready = CreateEvent(NULL, FALSE, FALSE, NULL);
+
+    if (present.request && present.ready)
+        present.thread = CreateThread(NULL, 0, Present_Thread, NULL, 0, NULL);
+
+    if (!present.thread)
+    {
+        Present_Free();
+        return FALSE;
+    }
+
+    dprintf("Present: pipelined, %d slots\n", PRESENT_SLOTS);
+    return TRUE;
+}
+
+void Present_Free()
+{
+    if (present.thread)
+    {
+        InterlockedExchange(&present.quit, TRUE);
+        SetEvent(present.request);
+        WaitForSingleObject(present.thread, INFINITE);
+        CloseHandle(present.thread);
+
+        dprintf("Present: %d frames dropped, %d late\n", present.dropped, present.late);
+    }
+
+    if (present.request)
+        CloseHandle(present.request);
+
+    if (present.ready)
+        CloseHandle(present.ready);
+
+    for (int i = 0; i < PRESENT_SLOTS; i++)
+        free(present.slots[i].bits);
+
+    if (present.surface)
+        DeleteCriticalSection(&present.textLock);
+
+    memset(&present, 0, sizeof(present));
+}
+
+/* FPS text the prepare stage draws on the next frame, NULL for none */
+void Present_SetText(const char *text)
+{
+    EnterCriticalSection(&present.textLock);
+    _snprintf(present.text, sizeof(present.text) - 1, "%s", text ? text : "");
+    LeaveCriticalSection(&present.textLock);
+}
+
+/* The newest prepared slot, older ones are dropped. Waits up to timeout ms. */
+static PresentSlot *Present_Take(DWORD timeout)
+{
+    for (;;)
+    {
+        PresentSlot *newest = NULL;
+        int ready = 0;
+
+        for (int i = 0; i < PRESENT_SLOTS; i++)
+        {
+            PresentSlot *slot = &present.slots[i];
+
+            if (InterlockedExchangeAdd(&slot->state, 0) != SLOT_READY)
+                continue;
+
+            ready++;
+            if (!newest || slot->sequence > newest->sequence)
+                newest = slot;
+        }
+
+        if (newest)
+        {
+            for (int i = 0; i < PRESENT_SLOTS; i++)
+            {
+                if (&present.slots[i] != newest && InterlockedCompareExchange(&present.slots[i].state, SLOT_FREE, SLOT_READY) == SLOT_READY)
+                    present.dropped++;
+            }
+
+            InterlockedExchange(&newest->state, SLOT_SUBMITTING);
+            present.depthSum += ready;
+            return newest;
+        }
+
+        if (WaitForSingleObject(present.ready, timeout) != WAIT_OBJECT_0)
+            return NULL;
+    }
+}
+
+/* Uploads the next prepared frame into the bound texture. Returns FALSE when the
+ * prepare stage didn't make it in time, the last frame is drawn again then. */
+BOOL Present_Upload(GLenum format, GLenum type, DWORD timeout)
+{
+    PresentSlot *slot = Present_Take(timeout);
+    if (!slot)
+    {
+        present.late++;
+        return FALSE;
+    }
+
+    if (slot->width > 0)
+    {
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, slot->pitch / present.surface->lXPitch);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, slot->x, slot->y, slot->width, slot->height, format, type, slot->bits);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    }
+
+    present.inFlight = slot->prepared;
+
+    // The driver has its own copy now, the slot can take the next frame while this one is drawn
+    InterlockedExchange(&slot->state, SLOT_FREE);
+    SetEvent(present.request);
+    return TRUE;
+}
+
+/* Called after SwapBuffers, measures prepare to present latency */
+void Present_Swapped()
+{
+    if (!present.inFlight)
+        return;
+
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+
+    present.latencySum += (double)(now.QuadPart - present.inFlight) * 1000.0 / present.frequency;
+    present.inFlight = 0;
+
+    if (++present.samples == PRESENT_STATS_FRAMES)
+    {
+        present.latency = present.latencySum / present.samples;
+        present.depth = present.depthSum / present.samples;
+
+#ifdef _DEBUG
+        dprintf("Present: latency %.2f ms, queue depth %.2f, %d dropped, %d late\n",
+            present.latency, present.depth, present.dropped, present.late);
+#endif
+        present.latencySum = present.depthSum = 0.0;
+        present.samples = 0;
+    }
+}
+
+void Present_Stats(double *latency, double *depth)
+{
+    *latency = present.latency;
+    *depth = present.depth;
+}
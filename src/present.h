@@ -0,0 +1,15 @@
+#ifndef _PRESENT_
+#define _PRESENT_
+
+#include <windows.h>
+#include "opengl.h"
+#include "IDirectDrawSurface.h"
+
+BOOL Present_Init(IDirectDrawSurfaceImpl *surface);
+void Present_Free();
+void Present_SetText(const char *text);
+BOOL Present_Upload(GLenum format, GLenum type, DWORD timeout);
+void Present_Swapped();
+void Present_Stats(double *latency, double *depth);
+
+#endif
@@ -0,0 +1,245 @@
+#include <string.h>
+#include "recformat.h"
+
+/* Frame codec of the recordings. Deltas between frames are mostly zero, a zero
+ * run length pass shrinks a static frame to a few bytes and a small LZ77 pass
+ * (LZ4 style sequences, 64 KB window) takes care of the changed areas. */
+
+#define LZ_HASH_BITS 14
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+
+static uint8_t *PutVarint(uint8_t *p, size_t v)
+{
+    while (v >= 0x80)
+    {
+        *p++ = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+static const uint8_t *GetVarint(const uint8_t *p, const uint8_t *end, size_t *v)
+{
+    *v = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7)
+    {
+        uint8_t b = *p++;
+        *v |= (size_t)(b & 0x7F) << shift;
+        if (!(b & 0x80))
+            return p;
+    }
+    return NULL;
+}
+
+/* Runs of zeros and literals: varint zeros, varint literals, literal bytes */
+static size_t Rle(const uint8_t *src, size_t size, uint8_t *dst)
+{
+    uint8_t *out = dst;
+    size_t i = 0;
+
+    while (i < size)
+    {
+        size_t start = i;
+        uint64_t word;
+
+        while (start + 8 <= size && (memcpy(&word, src + start, 8), word == 0))
+            start += 8;
+        while (start < size && src[start] == 0)
+            start++;
+
+        // Short zero runs are cheaper as literals
+        size_t end = start;
+        while (end < size && !(end + 4 <= size && !src[end] && !src[end + 1] && !src[end + 2] && !src[end + 3]))
+            end++;
+
+        out = PutVarint(out, start - i);
+        out = PutVarint(out, end - start);
+        memcpy(out, src + start, end - start);
+        out += end - start;
+
+        i = end;
+    }
+
+    return out - dst;
+}
+
+static int Unrle(const uint8_t *src, size_t size, uint8_t *dst, size_t rawBytes)
+{
+    const uint8_t *end = src + size;
+    size_t o = 0;
+
+    while (src < end)
+    {
+        size_t zeros, literals;
+
+        if (!(src = GetVarint(src, end, &zeros)) || !(src = GetVarint(src, end, &literals)))
+            return 0;
+
+        if (zeros > rawBytes - o || literals > rawBytes - o - zeros || literals > (size_t)(end - src))
+            return 0;
+
+        memset(dst + o, 0, zeros);
+        o += zeros;
+        memcpy(dst + o, src, literals);
+        o += literals;
+        src += literals;
+    }
+
+    return o == rawBytes;
+}
+
+static uint32_t Read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static uint8_t *PutLength(uint8_t *p, size_t length)
+{
+    while (length >= 255)
+    {
+        *p++ = 255;
+        length -= 255;
+    }
+    *p++ = (uint8_t)length;
+    return p;
+}
+
+static uint8_t *PutLiterals(uint8_t *op, uint8_t *token, const uint8_t *literals, size_t count)
+{
+    *token = (uint8_t)((count >= 15 ? 15 : count) << 4);
+    if (count >= 15)
+        op = PutLength(op, count - 15);
+
+    memcpy(op, literals, count);
+    return op + count;
+}
+
+static size_t Lz(const uint8_t *src, size_t size, uint8_t *dst)
+{
+    uint32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    const uint8_t *ip = src;
+    const uint8_t *anchor = src;
+    const uint8_t *end = src + size;
+    uint8_t *op = dst;
+
+    while (ip + LZ_MIN_MATCH <= end)
+    {
+        uint32_t h = (Read32(ip) * 2654435761u) >> (32 - LZ_HASH_BITS);
+        const uint8_t *ref = src + table[h];
+        table[h] = (uint32_t)(ip - src);
+
+        if (ref >= ip || ip - ref > LZ_MAX_OFFSET || Read32(ref) != Read32(ip))
+        {
+            ip++;
+            continue;
+        }
+
+        size_t length = LZ_MIN_MATCH;
+        while (ip + length < end && ref[length] == ip[length])
+            length++;
+
+        uint8_t *token = op++;
+        op = PutLiterals(op, token, anchor, ip - anchor);
+
+        *op++ = (uint8_t)(ip - ref);
+        *op++ = (uint8_t)((ip - ref) >> 8);
+
+        length -= LZ_MIN_MATCH;
+        *token |= (uint8_t)(length >= 15 ? 15 : length);
+        if (length >= 15)
+            op = PutLength(op, length - 15);
+
+        ip += length + LZ_MIN_MATCH;
+        anchor = ip;
+    }
+
+    // The last sequence only has literals
+    uint8_t *token = op++;
+    op = PutLiterals(op, token, anchor, end - anchor);
+
+    return op - dst;
+}
+
+static size_t Unlz(const uint8_t *src, size_t size, uint8_t *dst, size_t capacity)
+{
+    const uint8_t *ip = src;
+    const uint8_t *end = src + size;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + capacity;
+
+    while (ip < end)
+    {
+        unsigned token = *ip++;
+        size_t literals = token >> 4;
+        uint8_t b;
+
+        if (literals == 15)
+        {
+            do
+            {
+                if (ip >= end)
+                    return (size_t)-1;
+                b = *ip++;
+                literals += b;
+            } while (b == 255);
+        }
+
+        if (literals > (size_t)(end - ip) || literals > (size_t)(oend - op))
+            return (size_t)-1;
+
+        memcpy(op, ip, literals);
+        op += literals;
+        ip += literals;
+
+        if (ip >= end)
+            break;
+
+        if (end - ip < 2)
+            return (size_t)-1;
+
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+
+        size_t length = token & 15;
+        if (length == 15)
+        {
+            do
+            {
+                if (ip >= end)
+                    return (size_t)-1;
+                b = *ip++;
+                length += b;
+            } while (b == 255);
+        }
+        length += LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > (size_t)(op - dst) || length > (size_t)(oend - op))
+            return (size_t)-1;
+
+        // Matches may overlap their own output
+        const uint8_t *ref = op - offset;
+        while (length--)
+            *op++ = *ref++;
+    }
+
+    return op - dst;
+}
+
+/* dst must hold REC_LZ_BOUND(REC_RLE_BOUND(size)) bytes and scratch REC_RLE_BOUND(size) */
+size_t RecFormat_Pack(const uint8_t *src, size_t size, uint8_t *dst, uint8_t *scratch)
+{
+    return Lz(scratch, Rle(src, size, scratch), dst);
+}
+
+int RecFormat_Unpack(const uint8_t *src, size_t size, uint8_t *dst, size_t rawBytes, uint8_t *scratch, size_t scratchBytes)
+{
+    size_t rleBytes = Unlz(src, size, scratch, scratchBytes);
+
+    return rleBytes != (size_t)-1 && Unrle(scratch, rleBytes, dst, rawBytes);
+}
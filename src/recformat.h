@@ -0,0 +1,65 @@
+#ifndef _RECFORMAT_
+#define _RECFORMAT_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Recording container, written by recorder.c and read by tools/recdecode.c.
+ *
+ * A RecFileHeader is followed by frames, each a RecFrameHeader, a 256 entry
+ * RGBQUAD palette if REC_FRAME_PALETTE is set and packedBytes of compressed data.
+ * Frame data is the XOR of the frame with the one before it (with nothing for
+ * keyframes), zero run length coded and then LZ compressed. A recording that
+ * was closed properly ends in an index of its keyframes and a RecIndexFooter. */
+
+#define REC_FILE_MAGIC 0x31525354 /* "TSR1" */
+#define REC_FRAME_MAGIC 0x4D524654 /* "TFRM" */
+#define REC_INDEX_MAGIC 0x58444954 /* "TIDX" */
+#define REC_VERSION 1
+
+#define REC_FRAME_KEYFRAME 1
+#define REC_FRAME_PALETTE 2
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    int64_t frequency;
+} RecFileHeader;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t frame;
+    int64_t timestamp;
+    uint16_t width;
+    uint16_t height;
+    uint8_t bpp;
+    uint8_t flags;
+    uint16_t reserved;
+    uint32_t rawBytes;
+    uint32_t packedBytes;
+} RecFrameHeader;
+
+typedef struct
+{
+    uint32_t frame;
+    uint32_t reserved;
+    int64_t offset;
+} RecIndexEntry;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t count;
+    int64_t offset;
+} RecIndexFooter;
+
+/* Worst case sizes of the two stages for size input bytes */
+#define REC_RLE_BOUND(size) ((size) + (size) / 64 + 16)
+#define REC_LZ_BOUND(size) ((size) + (size) / 255 + 16)
+
+size_t RecFormat_Pack(const uint8_t *src, size_t size, uint8_t *dst, uint8_t *scratch);
+int RecFormat_Unpack(const uint8_t *src, size_t size, uint8_t *dst, size_t rawBytes, uint8_t *scratch, size_t scratchBytes);
+
+#endif
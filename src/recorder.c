@@ -0,0 +1,335 @@
+#include <windows.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "main.h"
+#include "recformat.h"
+#include "recorder.h"
+#include "affinity.h"
+
+/* Lossless recording of the presented frames for bug reports. The render thread
+ * only copies the visible area into one of a few buffers, a background thread
+ * deltas it against the previous frame, compresses it (recformat.c) and appends
+ * it to the recording. Frames are dropped, not waited for, if the writer falls
+ * behind. tools/recdecode.c turns recordings into PNG or Y4M. */
+
+#define RECORDER_BUFFERS 4
+#define RECORDER_KEYFRAME_INTERVAL 300
+
+typedef struct
+{
+    uint8_t *bits;
+    size_t capacity;
+    int width;
+    int height;
+    int bpp;
+    LONGLONG timestamp;
+    RGBQUAD palette[256];
+} RecorderBuffer;
+
+static struct
+{
+    HANDLE thread;
+    HANDLE wake;
+    volatile LONG stop;
+    FILE *file;
+
+    RecorderBuffer buffers[RECORDER_BUFFERS];
+    int head;
+    int tail;
+    volatile LONG queued;
+    int dropped;
+
+    RecorderBuffer prev;
+    uint8_t *delta;
+    uint8_t *scratch;
+    uint8_t *packed;
+    size_t workBytes;
+
+    uint32_t frame;
+    int64_t offset;
+    RecIndexEntry *index;
+    int indexCount;
+    int indexCapacity;
+
+    double rawBytes;
+    double writtenBytes;
+    LONGLONG firstTimestamp;
+    LONGLONG frequency;
+} rec;
+
+static BOOL Recorder_Write(const void *data, size_t bytes)
+{
+    if (fwrite(data, 1, bytes, rec.file) != bytes)
+        return FALSE;
+
+    rec.offset += bytes;
+    rec.writtenBytes += bytes;
+    return TRUE;
+}
+
+static BOOL Recorder_Reserve(size_t bytes)
+{
+    if (rec.workBytes >= bytes)
+        return TRUE;
+
+    free(rec.delta);
+    free(rec.scratch);
+    free(rec.packed);
+
+    rec.delta = malloc(bytes);
+    rec.scratch = malloc(REC_RLE_BOUND(bytes));
+    rec.packed = malloc(REC_LZ_BOUND(REC_RLE_BOUND(bytes)));
+    rec.workBytes = rec.delta && rec.scratch && rec.packed ? bytes : 0;
+
+    return rec.workBytes != 0;
+}
+
+static void Recorder_Encode(RecorderBuffer *buf)
+{
+    size_t bytes = (size_t)buf->width * (buf->bpp / 8) * buf->height;
+
+    if (!rec.file || !Recorder_Reserve(bytes))
+        return;
+
+    BOOL keyframe = rec.frame % RECORDER_KEYFRAME_INTERVAL == 0 || !rec.prev.bits ||
+        rec.prev.width != buf->width || rec.prev.height != buf->height || rec.prev.bpp != buf->bpp;
+
+    const uint8_t *src = buf->bits;
+
+    if (!keyframe)
+    {
+        const uint8_t *prev = rec.prev.bits;
+        size_t i = 0;
+
+        for (; i + sizeof(size_t) <= bytes; i += sizeof(size_t))
+            *(size_t *)(rec.delta + i) = *(const size_t *)(src + i) ^ *(const size_t *)(prev + i);
+        for (; i < bytes; i++)
+            rec.delta[i] = src[i] ^ prev[i];
+
+        src = rec.delta;
+    }
+
+    RecFrameHeader header = { 0 };
+    header.magic = REC_FRAME_MAGIC;
+    header.frame = rec.frame;
+    header.timestamp = buf->timestamp;
+    header.width = (uint16_t)buf->width;
+    header.height = (uint16_t)buf->height;
+    header.bpp = (uint8_t)buf->bpp;
+    header.rawBytes = (uint32_t)bytes;
+    header.packedBytes = (uint32_t)RecFormat_Pack(src, bytes, rec.packed, rec.scratch);
+
+    if (keyframe)
+        header.flags |= REC_FRAME_KEYFRAME;
+
+    if (buf->bpp == 8 && (keyframe || memcmp(buf->palette, rec.prev.palette, sizeof(buf->palette)) != 0))
+        header.flags |= REC_FRAME_PALETTE;
+
+    if (keyframe)
+    {
+        if (rec.indexCount == rec.indexCapacity)
+        {
+            int capacity = rec.indexCapacity ? rec.indexCapacity * 2 : 64;
+            RecIndexEntry *index = realloc(rec.index, capacity * sizeof(RecIndexEntry));
+
+            if (index)
+            {
+                rec.index = index;
+                rec.indexCapacity = capacity;
+            }
+        }
+
+        if (rec.indexCount < rec.indexCapacity)
+        {
+            rec.index[rec.indexCount].frame = rec.frame;
+            rec.index[rec.indexCount].reserved = 0;
+            rec.index[rec.indexCount].offset = rec.offset;
+            rec.indexCount++;
+        }
+    }
+
+    if (!Recorder_Write(&header, sizeof(header)) ||
+        ((header.flags & REC_FRAME_PALETTE) && !Recorder_Write(buf->palette, sizeof(buf->palette))) ||
+        !Recorder_Write(rec.packed, header.packedBytes))
+    {
+        dprintf("Recorder: write failed, recording stopped\n");
+        fclose(rec.file);
+        rec.file = NULL;
+        return;
+    }
+
+    // The frame becomes the reference for the next delta, the old reference goes back to the render thread
+    RecorderBuffer prev = rec.prev;
+    rec.prev = *buf;
+    buf->bits = prev.bits;
+    buf->capacity = prev.capacity;
+
+    if (rec.frame == 0)
+        rec.firstTimestamp = header.timestamp;
+
+    rec.frame++;
+    rec.rawBytes += bytes;
+
+#ifdef _DEBUG
+    if (rec.frame % 600 == 0 && header.timestamp > rec.firstTimestamp)
+    {
+        double seconds = (double)(header.timestamp - rec.firstTimestamp) / rec.frequency;
+
+        dprintf("Recorder: %u frames, %d dropped, %.2f MB/s written, %.1f:1\n",
+            rec.frame, rec.dropped, rec.writtenBytes / 1048576.0 / seconds,
+            rec.writtenBytes > 0.0 ? rec.rawBytes / rec.writtenBytes : 0.0);
+    }
+#endif
+}
+
+static DWORD WINAPI Recorder_Thread(LPVOID unused)
+{
+    Affinity_PlaceThread(AFFINITY_WORKER);
+
+    for (;;)
+    {
+        WaitForSingleObject(rec.wake, INFINITE);
+
+        while (InterlockedExchangeAdd(&rec.queued, 0) > 0)
+        {
+            Recorder_Encode(&rec.buffers[rec.tail]);
+
+            rec.tail = (rec.tail + 1) % RECORDER_BUFFERS;
+            InterlockedDecrement(&rec.queued);
+        }
+
+        if (InterlockedExchangeAdd(&rec.stop, 0))
+            break;
+    }
+
+    return 0;
+}
+
+BOOL Recorder_Start(const char *prefix)
+{
+    if (rec.thread)
+        return TRUE;
+
+    SYSTEMTIME st;
+    GetLocalTime(&st);
+
+    char path[MAX_PATH];
+    _snprintf(path, sizeof(path), "%s-%04d%02d%02d-%02d%02d%02d.tsr",
+        prefix, st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond);
+
+    rec.file = fopen(path, "wb");
+    if (!rec.file)
+    {
+        dprintf("Recorder: can't create %s\n", path);
+        return FALSE;
+    }
+
+    setvbuf(rec.file, NULL, _IOFBF, 1024 * 1024);
+
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    rec.frequency = frequency.QuadPart;
+
+    RecFileHeader header = { REC_FILE_MAGIC, REC_VERSION, rec.frequency };
+    Recorder_Write(&header, sizeof(header));
+
+    rec.wake = CreateEvent(NULL, FALSE, FALSE, NULL);
+    rec.thread = CreateThread(NULL, 0, Recorder_Thread, NULL, 0, NULL);
+
+    if (!rec.thread)
+    {
+        Recorder_Stop();
+        return FALSE;
+    }
+
+    // Encoding must never take time from the game or the renderer
+    SetThreadPriority(rec.thread, THREAD_PRIORITY_BELOW_NORMAL);
+
+    dprintf("Recorder: recording to %s\n", path);
+    return TRUE;
+}
+
+void Recorder_Stop()
+{
+    if (rec.thread)
+    {
+        InterlockedExchange(&rec.stop, TRUE);
+        SetEvent(rec.wake);
+        WaitForSingleObject(rec.thread, INFINITE);
+        CloseHandle(rec.thread);
+    }
+
+    if (rec.wake)
+        CloseHandle(rec.wake);
+
+    if (rec.file)
+    {
+        RecIndexFooter footer = { REC_INDEX_MAGIC, rec.indexCount, rec.offset };
+
+        Recorder_Write(rec.index, rec.indexCount * sizeof(RecIndexEntry));
+        Recorder_Write(&footer, sizeof(footer));
+        fclose(rec.file);
+
+        dprintf("Recorder: %u frames, %d dropped, %d MB raw, %d MB written\n",
+            rec.frame, rec.dropped, (int)(rec.rawBytes / 1048576.0), (int)(rec.writtenBytes / 1048576.0));
+    }
+
+    for (int i = 0; i < RECORDER_BUFFERS; i++)
+        free(rec.buffers[i].bits);
+
+    free(rec.prev.bits);
+    free(rec.delta);
+    free(rec.scratch);
+    free(rec.packed);
+    free(rec.index);
+
+    memset(&rec, 0, sizeof(rec));
+}
+
+/* Called by the render thread with the surface locked */
+void Recorder_Capture(const void *src, int pitch, int width, int height, int bpp, const RGBQUAD *palette)
+{
+    if (!rec.thread || !src || (bpp != 8 && bpp != 16 && bpp != 32))
+        return;
+
+    if (InterlockedExchangeAdd(&rec.queued, 0) == RECORDER_BUFFERS)
+    {
+        rec.dropped++;
+        return;
+    }
+
+    RecorderBuffer *buf = &rec.buffers[rec.head];
+    size_t rowBytes = (size_t)width * (bpp / 8);
+
+    if (buf->capacity < rowBytes * height)
+    {
+        free(buf->bits);
+        buf->bits = malloc(rowBytes * height);
+        buf->capacity = buf->bits ? rowBytes * height : 0;
+
+        if (!buf->bits)
+        {
+            rec.dropped++;
+            return;
+        }
+    }
+
+    for (int y = 0; y < height; y++)
+        memcpy(buf->bits + y * rowBytes, (const uint8_t *)src + (size_t)y * pitch, rowBytes);
+
+    if (bpp == 8)
+        memcpy(buf->palette, palette, sizeof(buf->palette));
+
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+
+    buf->width = width;
+    buf->height = height;
+    buf->bpp = bpp;
+    buf->timestamp = now.QuadPart;
+
+    rec.head = (rec.head + 1) % RECORDER_BUFFERS;
+    InterlockedIncrement(&rec.queued);
+    SetEvent(rec.wake);
+}
@@ -0,0 +1,10 @@
+#ifndef _RECORDER_
+#define _RECORDER_
+
+#include <windows.h>
+
+BOOL Recorder_Start(const char *prefix);
+void Recorder_Stop();
+void Recorder_Capture(const void *src, int pitch, int width, int height, int bpp, const RGBQUAD *palette);
+
+#endif
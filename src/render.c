@@ -4,6 +4,19 @@
 #include <stdint.h>
 #include <stdio.h>
 #include "counter.h"
+#include "hud.h"
+#include "gpublit.h"
+#include "shaderchain.h"
+#include "scaler.h"
+#include "convert.h"
+#include "childwin.h"
+#include "frameexport.h"
+#include "recorder.h"
+#include "screenshot.h"
+#include "affinity.h"
+#include "present.h"
+#include "vblank.h"
+#include "Settings.h"
 
 #include "opengl.h"
 #include <GL/gl.h>
@@ -56,64 +69,46 @@ const GLchar *ConvFragShaderSrc =
     "    FragColor = colors;\n"
     "}\n";
 
-BOOL CALLBACK EnumChildProc(HWND hWnd, LPARAM lParam)
-{
-    IDirectDrawSurfaceImpl *this = (IDirectDrawSurfaceImpl *)lParam;
-
-    HDC hDC = GetDC(hWnd);
-
-    RECT size;
-    GetClientRect(hWnd, &size);
-
-    RECT pos;
-    GetWindowRect(hWnd, &pos);
-
-    LONG renderer = InterlockedExchangeAdd(&Renderer, 0);
-
-    if (this->usingPBO && renderer == RENDERER_OPENGL)
-    {
-        //the GDI struggle is real
-        // Copy the scanlines of menu windows from pboSurface to the gdi surface
-        SelectObject(this->hDC, this->bitmap);
-        memcpy((uint8_t*)this->systemSurface + (pos.top * this->lPitch),
-               (uint8_t*)this->surface + (pos.top * this->lPitch),
-               (pos.bottom - pos.top) * this->lPitch);
-
-    }
-
-    BitBlt(hDC, 0, 0, size.right, size.bottom, this->hDC, pos.left, pos.top, SRCCOPY);
-
-    if (this->usingPBO && renderer == RENDERER_OPENGL)
-    {
-        SelectObject(this->hDC, this->defaultBM);
-    }
-
-    ReleaseDC(hWnd, hDC);
-
-    return FALSE;
-}
-
+const GLchar *PaletteFragShaderSrc =
+    "#version 130\n"
+    "out vec4 FragColor;\n"
+    "uniform sampler2D SurfaceTex;\n"
+    "uniform sampler2D PaletteTex;\n"
+    "in vec4 TEX0;\n"
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    float index = texture(SurfaceTex, TEX0.xy).r;\n"
+    "    FragColor = texture(PaletteTex, vec2(index * (255.0 / 256.0) + (0.5 / 256.0), 0.5));\n"
+    "}\n";
 
 BOOL ShouldStretch(IDirectDrawSurfaceImpl *this)
 {
-    if (!this->dd->render.stretched)
-        return FALSE;
-
-    CURSORINFO pci;
-    pci.cbSize = sizeof(CURSORINFO);
-    if (GetCursorInfo(&pci))
-        return pci.flags == 0;
+    // Input is translated to the game's resolution, a visible cursor doesn't matter anymore
+    return this->dd->render.stretched;
+}
 
-    return TRUE;
+/* TargetFPS 0, and VSync with OpenGL, follow the refresh rate */
+static void ResolveTargetFPS(IDirectDrawSurfaceImpl *this)
+{
+    if (TargetFPS == 0.0 || (InterlockedExchangeAdd(&Renderer, 0) == RENDERER_OPENGL && SwapInterval > 0))
+    {
+        if ( (this->dd->mode.dmFields & DM_DISPLAYFREQUENCY) )
+            TargetFPS = (double)this->dd->mode.dmDisplayFrequency;
+        else
+            TargetFPS = 60.0;
+    }
 }
 
 
 DWORD WINAPI render(IDirectDrawSurfaceImpl *this)
 {
     GdiSetBatchLimit(1);
+    Affinity_PlaceThread(AFFINITY_RENDER);
 
     // Begin OpenGL Setup
     bool failToGDI = false;
+    bool noContext = false;
     BOOL gotOpenglV3 = false;
     GLuint convProgram = 0;
     GLenum texFormat = GL_RGB, texType = GL_RGB, texInternal = GL_RG8;
@@ -121,6 +116,23 @@ DWORD WINAPI render(IDirectDrawSurfaceImpl *this)
     GLint vertexCoordAttrLoc, texCoordAttrLoc;
     GLsync sync_obj;
     float ScaleW = 1.0, ScaleH = 1.0;
+    BOOL hudReady = false;
+    BOOL gpuBlitReady = false;
+    BOOL shaderChainReady = false;
+    BOOL scalerReady = false;
+    BOOL frameExportReady = false;
+    BOOL recorderReady = false;
+    BOOL presentReady = false;
+    ConvertTarget gdiTarget;
+    BOOL gdiRepaint = true;
+    int firstRow, lastRow;
+    int gpuBlitQuads = 0;
+    GLuint paletteTex = 0;
+    PALETTEENTRY paletteEntries[256];
+    RGBQUAD colorTable[256] = { { 0 } };
+
+    memset(&gdiTarget, 0, sizeof(gdiTarget));
+    Convert_Init();
 
     if (InterlockedExchangeAdd(&Renderer, 0) == RENDERER_OPENGL)
     {
@@ -132,7 +144,12 @@ DWORD WINAPI render(IDirectDrawSurfaceImpl *this)
         this->dd->glInfo.hRC_render = wglCreateContext(this->dd->hDC);
         wglShareLists(this->dd->glInfo.hRC_render, this->dd->glInfo.hRC_main);
 
-        wglMakeCurrent(this->dd->hDC, this->dd->glInfo.hRC_render);
+        if (!this->dd->glInfo.hRC_render || !wglMakeCurrent(this->dd->hDC, this->dd->glInfo.hRC_render))
+        {
+            failToGDI = noContext = true;
+            dprintf("wglMakeCurrent failed, %x\n", (int)GetLastError());
+        }
+
         OpenGL_Init();
 
         this->pboCount = InterlockedExchangeAdd(&PrimarySurfacePBO, 0);
@@ -157,7 +174,16 @@ DWORD WINAPI render(IDirectDrawSurfaceImpl *this)
             glEnableVertexAttribArray && glUniform2fv && glUniformMatrix4fv && glGenVertexArrays && glBindVertexArray &&
             glGetUniformLocation && glFenceSync && glClientWaitSync && glversion && glversion[0] != '2';
 
-        if (gotOpenglV3)
+        if (gotOpenglV3 && this->bpp == 8)
+        {
+            convProgram = OpenGL_BuildProgram(PassthroughVertShaderSrc, PaletteFragShaderSrc);
+        }
+        else if (gotOpenglV3 && this->bpp == 32)
+        {
+            // XRGB8888 uploads directly as BGRA, nothing to convert
+            convProgram = OpenGL_BuildProgram(PassthroughVertShaderSrc, PassthroughFragShaderSrc);
+        }
+        else if (gotOpenglV3)
         {
             if (ConvertOnGPU)
                 convProgram = OpenGL_BuildProgram(PassthroughVertShaderSrc, ConvFragShaderSrc);
@@ -253,7 +279,30 @@ setup_shaders:
             if (gle != GL_NO_ERROR)
                 dprintf("glBindTexture, %x\n", gle);
 
-            if (convProgram && ConvertOnGPU)
+            if (this->bpp == 8)
+            {
+                if (!convProgram ||
+                    !TextureUploadTest(this->textureWidth, this->textureHeight,
+                                       texInternal = GL_R8, texFormat = GL_RED, texType = GL_UNSIGNED_BYTE))
+                {
+                    failToGDI = true;
+                    dprintf("8 bpp surfaces need a palette shader and R8 textures\n");
+                }
+                else
+                    dprintf("Renderer: Palette lookup on GPU\n");
+            }
+            else if (this->bpp == 32)
+            {
+                if (!TextureUploadTest(this->textureWidth, this->textureHeight,
+                                       texInternal = GL_RGBA8, texFormat = GL_BGRA, texType = GL_UNSIGNED_INT_8_8_8_8_REV))
+                {
+                    failToGDI = true;
+                    dprintf("BGRA texture upload has failed\n");
+                }
+                else
+                    dprintf("Renderer: Direct XRGB8888 upload\n");
+            }
+            else if (convProgram && ConvertOnGPU)
             {
                 if (!TextureUploadTest(this->textureWidth, this->textureHeight, texInternal = GL_RG8, texFormat = GL_RG, texType = GL_UNSIGNED_BYTE)
                     ||
@@ -318,6 +367,27 @@ setup_shaders:
                 dprintf("glTexParameteri MAX, %x\n", gle);
         }
 
+        if (this->bpp == 8 && convProgram && !failToGDI)
+        {
+            // 256x1 palette on the second texture unit, only re-uploaded when the entries change
+            glGenTextures(1, &paletteTex);
+            glActiveTexture(GL_TEXTURE1);
+            glBindTexture(GL_TEXTURE_2D, paletteTex);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+            memset(paletteEntries, 0, sizeof(paletteEntries));
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 256, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, paletteEntries);
+            glActiveTexture(GL_TEXTURE0);
+
+            glUniform1i(glGetUniformLocation(convProgram, "SurfaceTex"), 0);
+            glUniform1i(glGetUniformLocation(convProgram, "PaletteTex"), 1);
+
+            failToGDI = failToGDI || ((gle = glGetError()) != GL_NO_ERROR);
+            if (gle != GL_NO_ERROR)
+                dprintf("palette texture, %x\n", gle);
+        }
+
         if (!convProgram)
             glEnable(GL_TEXTURE_2D);
 
@@ -325,6 +395,26 @@ setup_shaders:
         if (gle != GL_NO_ERROR)
             dprintf("glEnable, %x\n", gle);
 
+        // Must happen before the PBO is bound, the atlas is uploaded from client memory
+        if (!failToGDI)
+        {
+            hudReady = Hud_Init(convProgram != 0);
+
+            // Exported and recorded frames are read from the surface, blits can't be left to the GPU
+            if (GpuBlitCache && !FrameExport[0] && !Record[0])
+                gpuBlitReady = GpuBlit_Init(convProgram, texInternal, texFormat, texType);
+
+            if (ShaderChain[0] && convProgram)
+                shaderChainReady = ShaderChain_Init(ShaderChain);
+
+            if (convProgram)
+            {
+                glUseProgram(convProgram);
+                glBindVertexArray(vao);
+            }
+            glGetError();
+        }
+
 
         if (glGenBuffers)
         {
@@ -401,6 +491,10 @@ setup_shaders:
     {
         InterlockedExchange(&Renderer, RENDERER_GDI);
 
+        // Only a driver without a usable context is remembered, the mode checks are for this session
+        if (AutoRenderer && noContext)
+            SettingsSave("Renderer", "gdi");
+
         this->surface = this->systemSurface;
         this->dd->glInfo.glSupported = false;
         if (this->usingPBO)
@@ -425,13 +519,7 @@ setup_shaders:
         SendMessage(this->dd->hWnd, WM_ACTIVATE, WA_ACTIVE, 0);
     }
 
-    if (TargetFPS == 0.0 || (InterlockedExchangeAdd(&Renderer, 0) == RENDERER_OPENGL && SwapInterval > 0))
-    {
-        if ( (this->dd->mode.dmFields & DM_DISPLAYFREQUENCY) )
-            TargetFPS = (double)this->dd->mode.dmDisplayFrequency;
-        else
-            TargetFPS = 60.0;
-    }
+    ResolveTargetFPS(this);
 
     LONG renderer = InterlockedExchangeAdd(&Renderer, 0);
     QPCounter renderCounter;
@@ -455,6 +543,21 @@ setup_shaders:
     bool hideWarning = true;
     double avg_fps = 0;
 
+#ifdef _DEBUG
+    double uploadTime = 0.0;
+    int uploadCount = 0;
+#endif
+
+    if (FrameExport[0])
+        frameExportReady = FrameExport_Init(FrameExport, this->dd->width, this->dd->height);
+
+    if (Record[0])
+        recorderReady = Recorder_Start(Record);
+
+    // The pipeline copies the surface itself, PBO surfaces and queued GPU blits need the upload in step with the game
+    if (PresentPipeline && renderer == RENDERER_OPENGL && !this->usingPBO && !gpuBlitReady)
+        presentReady = Present_Init(this);
+
     CounterStart(&renderCounter);
     CounterStart(&warningCounter);
 
@@ -477,120 +580,278 @@ setup_shaders:
 
         renderer = InterlockedExchangeAdd(&Renderer, 0);
 
+        // One consistent window position for the whole frame
+        WindowGeometry geometry;
+        Geometry_Read(this->dd, &geometry);
+
+        BOOL paletteChanged = false;
+        if (this->bpp == 8)
+        {
+            EnterCriticalSection(&this->lock);
+            if (this->palette && this->palette->generation != this->paletteGeneration)
+            {
+                this->paletteGeneration = IDirectDrawPaletteImpl_Snapshot(this->palette, paletteEntries);
+
+                for (int i = 0; i < 256; i++)
+                {
+                    colorTable[i].rgbRed = paletteEntries[i].peRed;
+                    colorTable[i].rgbGreen = paletteEntries[i].peGreen;
+                    colorTable[i].rgbBlue = paletteEntries[i].peBlue;
+                    colorTable[i].rgbReserved = 0;
+                }
+
+                // GDI presents, child windows and GetDC all go through the DIB color tables
+                if (this->usingPBO)
+                    SelectObject(this->hDC, this->bitmap);
+                SetDIBColorTable(this->hDC, 0, 256, colorTable);
+                if (this->usingPBO)
+                    SelectObject(this->hDC, this->defaultBM);
+
+                if (this->overlayDC)
+                    SetDIBColorTable(this->overlayDC, 0, 256, colorTable);
+
+                paletteChanged = true;
+            }
+            LeaveCriticalSection(&this->lock);
+        }
+
         {
             switch (renderer)
             {
             case RENDERER_GDI:
+                if (InterlockedExchange(&this->gpuBlitEnabled, false))
+                    IDirectDrawSurfaceImpl_FlushGpuBlits(this);
+
                 EnterCriticalSection(&this->lock);
                 if (DrawFPS)
                 {
-                    textRect.left = this->dd->winRect.left;
-                    textRect.top = this->dd->winRect.top;
+                    textRect.left = geometry.client.left;
+                    textRect.top = geometry.client.top;
                     DrawText(this->hDC, fpsGDIString, -1, &textRect, DT_NOCLIP);
                 }
                 else if (!hideWarning)
                 {
-                    textRect.left = this->dd->winRect.left;
-                    textRect.top = this->dd->winRect.top;
+                    textRect.left = geometry.client.left;
+                    textRect.top = geometry.client.top;
                     DrawText(this->hDC, warningText, -1, &textRect, DT_NOCLIP);
                 }
 
                 if (ShouldStretch(this))
                 {
+                    gdiRepaint = true;
+
                     if (this->dd->render.invalidate)
                     {
                         this->dd->render.invalidate = FALSE;
                         RECT rc = { 0, 0, this->dd->render.width, this->dd->render.height };
                         FillRect(this->dd->hDC, &rc, (HBRUSH)GetStockObject(BLACK_BRUSH));
+                        ChildWindows_Repaint();
                     }
                     else
                     {
-                        StretchBlt(this->dd->hDC,
-                            this->dd->render.viewport.x, this->dd->render.viewport.y,
-                            this->dd->render.viewport.width, this->dd->render.viewport.height,
-                            this->hDC, this->dd->winRect.left, this->dd->winRect.top, this->dd->width, this->dd->height, SRCCOPY);
+                        if (GdiScaler != SCALER_STRETCHBLT && !scalerReady && !(scalerReady = Scaler_Init(GdiScalerThreads)))
+                            GdiScaler = SCALER_STRETCHBLT;
+
+                        if (GdiScaler == SCALER_STRETCHBLT ||
+                            !Scaler_Present(this->dd->hDC,
+                                this->dd->render.viewport.x, this->dd->render.viewport.y,
+                                this->dd->render.viewport.width, this->dd->render.viewport.height,
+                                (uint8_t *)this->surface + geometry.client.top * this->lPitch + geometry.client.left * this->lXPitch,
+                                this->lPitch, this->bpp, this->dd->width, this->dd->height, colorTable, GdiScaler))
+                        {
+                            StretchBlt(this->dd->hDC,
+                                this->dd->render.viewport.x, this->dd->render.viewport.y,
+                                this->dd->render.viewport.width, this->dd->render.viewport.height,
+                                this->hDC, geometry.client.left, geometry.client.top, this->dd->width, this->dd->height, SRCCOPY);
+                        }
                     }
                 }
                 else
                 {
-                    if (this->dd->render.stretched)
-                        this->dd->render.invalidate = TRUE;
-
-                    BitBlt(this->dd->hDC, 0, 0, this->width, this->height, this->hDC,
-                        this->dd->winRect.left, this->dd->winRect.top, SRCCOPY);
+                    if (this->bpp == 32 && !this->usingPBO)
+                    {
+                        // Same format as the desktop, hand the bits straight to the device
+                        SetDIBitsToDevice(this->dd->hDC, 0, 0, this->width, this->height,
+                            geometry.client.left, geometry.client.top, 0, this->height,
+                            this->surface, this->bmi, DIB_RGB_COLORS);
+                    }
+                    else if (this->bpp == 16 &&
+                             ConvertTarget_Update(&gdiTarget, this->surface, this->lPitch, this->width, this->height, &firstRow, &lastRow))
+                    {
+                        // Only the rows that changed are copied unless the window needs a full repaint
+                        if (InterlockedExchange(&this->dd->render.repaint, FALSE) || gdiRepaint)
+                        {
+                            firstRow = 0;
+                            lastRow = this->height - 1;
+                            gdiRepaint = false;
+                        }
+
+                        if (firstRow <= lastRow)
+                        {
+                            BitBlt(this->dd->hDC, 0, firstRow - geometry.client.top, this->width, lastRow - firstRow + 1,
+                                gdiTarget.hDC, geometry.client.left, firstRow, SRCCOPY);
+                        }
+                    }
+                    else
+                    {
+                        BitBlt(this->dd->hDC, 0, 0, this->width, this->height, this->hDC,
+                            geometry.client.left, geometry.client.top, SRCCOPY);
+                    }
                 }
                 LeaveCriticalSection(&this->lock);
                 break;
 
             case RENDERER_OPENGL:
+                gdiRepaint = true;
 
-                EnterCriticalSection(&this->lock);
-                if (DrawFPS)
+                // A readback started last frame has had a whole frame to finish
+                Screenshot_GlCollect();
+
+                if (gpuBlitReady && !this->gpuBlitEnabled)
+                    InterlockedExchange(&this->gpuBlitEnabled, true);
+
+                if (presentReady)
                 {
-                    textRect.left = this->dd->winRect.left;
-                    textRect.top = this->dd->winRect.top;
+                    // The prepare thread has copied the frame and drawn the text on it
+                    Present_SetText(DrawFPS && !hudReady ? fpsOglString : NULL);
 
-                    if (this->usingPBO && this->surface)
+                    glBindTexture(GL_TEXTURE_2D, this->textures[texIndex]);
+                    Present_Upload(texFormat, texType, (DWORD)TargetFrameLen);
+                }
+                else
+                {
+                    EnterCriticalSection(&this->lock);
+                    if (DrawFPS && !hudReady)
                     {
-                        // Copy the scanlines that will be behind the FPS counter to the GDI surface
-                        memcpy((uint8_t*)this->systemSurface + (textRect.top * this->lPitch),
-                            (uint8_t*)this->surface + (textRect.top * this->lPitch),
-                            textRect.bottom * this->lPitch);
-                        SelectObject(this->hDC, this->bitmap);
+                        textRect.left = geometry.client.left;
+                        textRect.top = geometry.client.top;
+
+                        if (this->usingPBO && this->surface)
+                        {
+                            // Copy the scanlines that will be behind the FPS counter to the GDI surface
+                            memcpy((uint8_t*)this->systemSurface + (textRect.top * this->lPitch),
+                                (uint8_t*)this->surface + (textRect.top * this->lPitch),
+                                textRect.bottom * this->lPitch);
+                            SelectObject(this->hDC, this->bitmap);
+                        }
+
+                        textRect.bottom = DrawText(this->hDC, fpsOglString, -1, &textRect, DT_NOCLIP);
+
+                        if (this->usingPBO && this->surface)
+                        {
+                            // Copy the scanlines from the gdi surface back to pboSurface
+                            memcpy((uint8_t*)this->surface + (textRect.top * this->lPitch),
+                                (uint8_t*)this->systemSurface + (textRect.top * this->lPitch),
+                                textRect.bottom * this->lPitch);
+                            SelectObject(this->hDC, this->defaultBM);
+                        }
                     }
 
-                    textRect.bottom = DrawText(this->hDC, fpsOglString, -1, &textRect, DT_NOCLIP);
+                    glBindTexture(GL_TEXTURE_2D, this->textures[texIndex]);
 
-                    if (this->usingPBO && this->surface)
+#ifdef _DEBUG
+                    QPCounter uploadCounter;
+                    CounterStart(&uploadCounter);
+#endif
+                    // Rows may be padded (AlignedPitch), the driver is told the real stride
+                    glPixelStorei(GL_UNPACK_ROW_LENGTH, this->lPitch / this->lXPitch);
+
+                    if (this->usingPBO)
                     {
-                        // Copy the scanlines from the gdi surface back to pboSurface
-                        memcpy((uint8_t*)this->surface + (textRect.top * this->lPitch),
-                            (uint8_t*)this->systemSurface + (textRect.top * this->lPitch),
-                            textRect.bottom * this->lPitch);
-                        SelectObject(this->hDC, this->defaultBM);
+                        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->pbo[this->pboIndex]);
+
+                        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+                        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, this->width, this->height, texFormat, texType, 0);
+                        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+
+                        this->pboIndex++;
+                        if (this->pboIndex >= this->pboCount)
+                            this->pboIndex = 0;
+
+                        if (this->pboCount > 1)
+                        {
+                            glBindBuffer(GL_PIXEL_PACK_BUFFER, this->pbo[this->pboIndex]);
+                            glGetTexImage(GL_TEXTURE_2D, 0, texFormat, texType, 0);
+                        }
+                        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->pbo[this->pboIndex]);
+                        this->surface = (void*)glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_READ_WRITE);
                     }
-                }
+                    else
+                    {
+                        glPixelStorei(GL_UNPACK_SKIP_PIXELS, geometry.client.left);
+                        glPixelStorei(GL_UNPACK_SKIP_ROWS, geometry.client.top);
 
-                glBindTexture(GL_TEXTURE_2D, this->textures[texIndex]);
-                if (this->usingPBO)
-                {
-                    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->pbo[this->pboIndex]);
+                        glTexSubImage2D(GL_TEXTURE_2D, 0, geometry.client.left, geometry.client.top, this->dd->width, this->dd->height, texFormat, texType, this->surface);
 
-                    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
-                    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, this->textureWidth, this->textureHeight, texFormat, texType, 0);
+                        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+                        glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
+                        glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+                    }
 
-                    this->pboIndex++;
-                    if (this->pboIndex >= this->pboCount)
-                        this->pboIndex = 0;
+#ifdef _DEBUG
+                    uploadTime += CounterGet(&uploadCounter);
+                    if (++uploadCount == 600)
+                    {
+                        dprintf("Upload: %.1f MB/s, %.3f ms per frame, pitch %d\n",
+                            uploadTime > 0.0 ? (double)this->lPitch * this->height * uploadCount / 1048.576 / uploadTime : 0.0,
+                            uploadTime / uploadCount, (int)this->lPitch);
+                        uploadTime = 0.0;
+                        uploadCount = 0;
+                    }
+#endif
 
-                    if (this->pboCount > 1)
+                    if (gpuBlitReady)
                     {
-                        glBindBuffer(GL_PIXEL_PACK_BUFFER, this->pbo[this->pboIndex]);
-                        glGetTexImage(GL_TEXTURE_2D, 0, texFormat, texType, 0);
+                        if (this->usingPBO)
+                            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+                        gpuBlitQuads = GpuBlit_Prepare(this);
+                        glBindTexture(GL_TEXTURE_2D, this->textures[texIndex]);
+
+                        if (this->usingPBO)
+                            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->pbo[this->pboIndex]);
                     }
-                    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->pbo[this->pboIndex]);
-                    this->surface = (void*)glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_READ_WRITE);
+
+                    LeaveCriticalSection(&this->lock);
                 }
-                else
+
+                if (paletteChanged && paletteTex)
                 {
-                    glPixelStorei(GL_UNPACK_ROW_LENGTH, this->width);
-                    glPixelStorei(GL_UNPACK_SKIP_PIXELS, this->dd->winRect.left);
-                    glPixelStorei(GL_UNPACK_SKIP_ROWS, this->dd->winRect.top);
+                    // palette animation only costs this 1 KB upload
+                    if (this->usingPBO)
+                        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 
-                    glTexSubImage2D(GL_TEXTURE_2D, 0, this->dd->winRect.left, this->dd->winRect.top, this->dd->width, this->dd->height, texFormat, texType, this->surface);
+                    glActiveTexture(GL_TEXTURE1);
+                    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 256, 1, GL_RGBA, GL_UNSIGNED_BYTE, paletteEntries);
+                    glActiveTexture(GL_TEXTURE0);
 
-                    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
-                    glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
-                    glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+                    if (this->usingPBO)
+                        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->pbo[this->pboIndex]);
                 }
 
-                LeaveCriticalSection(&this->lock);
-
+                int viewX = -geometry.client.left, viewY, viewWidth, viewHeight;
                 if (ShouldStretch(this))
-                    glViewport(-this->dd->winRect.left, this->dd->winRect.bottom - this->dd->render.viewport.height,
-                        this->dd->render.viewport.width, this->dd->render.viewport.height);
+                {
+                    viewX += this->dd->render.viewport.x;
+                    viewY = geometry.client.bottom - this->dd->render.viewport.y - this->dd->render.viewport.height;
+                    viewWidth = this->dd->render.viewport.width;
+                    viewHeight = this->dd->render.viewport.height;
+
+                    // Black bars around a centered viewport (MaintainAspectRatio, Windowboxing, Borderless)
+                    if (this->dd->render.viewport.x > 0 || this->dd->render.viewport.y > 0)
+                        glClear(GL_COLOR_BUFFER_BIT);
+                }
                 else
-                    glViewport(-this->dd->winRect.left, this->dd->winRect.bottom - this->height, this->width, this->height);
+                {
+                    viewY = geometry.client.bottom - this->height;
+                    viewWidth = this->width;
+                    viewHeight = this->height;
+                }
+
+                // With a shader chain the primary is drawn at its own size and the chain scales it
+                BOOL chained = shaderChainReady && ShaderChain_Begin(this->width, this->height);
+                if (!chained)
+                    glViewport(viewX, viewY, viewWidth, viewHeight);
 
                 if (convProgram)
                 {
@@ -606,10 +867,82 @@ setup_shaders:
                     glEnd();
                 }
 
+                if (gpuBlitQuads > 0)
+                {
+                    GpuBlit_Draw();
+
+                    if (convProgram)
+                        glBindVertexArray(vao);
+                }
+
+                if (chained)
+                {
+                    ShaderChain_End(viewX, viewY, viewWidth, viewHeight);
+
+                    glUseProgram(convProgram);
+                    glBindVertexArray(vao);
+                }
+
+                // ScreenshotScaled, taken before the HUD is drawn on top
+                if (Screenshot_Requested())
+                    Screenshot_GlReadback(viewX, viewY, viewWidth, viewHeight,
+                        geometry.client.right - geometry.client.left, geometry.client.bottom - geometry.client.top);
+
+                if (DrawFPS && hudReady)
+                {
+                    int textWidth, textHeight;
+                    int hudWidth = geometry.client.right - geometry.client.left;
+                    int hudHeight = geometry.client.bottom - geometry.client.top;
+
+                    Hud_MeasureText(fpsOglString, &textWidth, &textHeight);
+
+                    Hud_Begin(hudWidth, hudHeight);
+                    Hud_Rect(0, 0, textWidth + 4, textHeight + 4, HUD_RGBA(0, 0, 0, 160));
+                    Hud_Text(2, 2, fpsOglString, HUD_RGBA(255, 255, 255, 255));
+
+                    // DrawFPS=2 adds a frame time graph below the counter
+                    if (DrawFPS > 1)
+                    {
+                        int graphTop = textHeight + 8;
+                        int graphHeight = 48;
+                        double msPerPixel = (TargetFrameLen * 2.0) / graphHeight;
+
+                        Hud_Rect(0, graphTop, FRAME_SAMPLES * 3 + 4, graphHeight + 4, HUD_RGBA(0, 0, 0, 160));
+
+                        for (int i = 0; i < FRAME_SAMPLES; i++)
+                        {
+                            double frameLen = recent_frames[(rIndex + i) % FRAME_SAMPLES];
+                            if (frameLen <= 0)
+                                continue;
+
+                            int barHeight = (int)(frameLen / msPerPixel);
+                            if (barHeight > graphHeight)
+                                barHeight = graphHeight;
+
+                            Hud_Rect(2 + i * 3, graphTop + 2 + graphHeight - barHeight, 2, barHeight,
+                                frameLen > TargetFrameLen * 1.5 ? HUD_RGBA(255, 64, 64, 255) : HUD_RGBA(64, 255, 64, 255));
+                        }
+
+                        // Target frame length sits at the middle of the graph
+                        Hud_Rect(2, graphTop + 2 + graphHeight / 2, FRAME_SAMPLES * 3, 1, HUD_RGBA(255, 255, 255, 128));
+                    }
+
+                    Hud_End();
+
+                    if (convProgram)
+                    {
+                        glUseProgram(convProgram);
+                        glBindVertexArray(vao);
+                    }
+                }
+
                 SwapBuffers(this->dd->hDC);
 
                 if (GlFinish || SwapInterval > 0)
                     glFinish();
+
+                if (presentReady)
+                    Present_Swapped();
                 static int errorCheckCount = 0;
                 if (AutoRenderer && errorCheckCount < 3)
                 {
@@ -654,7 +987,21 @@ setup_shaders:
             }
 
 
-            EnumChildWindows(this->dd->hWnd, EnumChildProc, (LPARAM)this);
+            ChildWindows_Present(this);
+        }
+
+        if ((frameExportReady || recorderReady) && this->surface)
+        {
+            EnterCriticalSection(&this->lock);
+            uint8_t *visible = (uint8_t *)this->surface + geometry.client.top * this->lPitch + geometry.client.left * this->lXPitch;
+
+            if (frameExportReady)
+                FrameExport_Publish(visible, this->lPitch, this->dd->width, this->dd->height, this->bpp, colorTable);
+
+            if (recorderReady)
+                Recorder_Capture(visible, this->lPitch, this->dd->width, this->dd->height, this->bpp, colorTable);
+
+            LeaveCriticalSection(&this->lock);
         }
 
         tick_time = CounterGet(&renderCounter);
@@ -684,9 +1031,53 @@ setup_shaders:
         if (DrawFPS)
         {
             _snprintf(fpsOglString, 254, "OpenGL%d\nFPS: %3.0f\nTGT: %3.0f\nRender Time: %2.3f ms", convProgram?3:1, avg_fps, TargetFPS, avg_len);
+
+            if (presentReady)
+            {
+                double latency, depth;
+                size_t length = strlen(fpsOglString);
+
+                Present_Stats(&latency, &depth);
+                _snprintf(fpsOglString + length, 254 - length, "\nLatency: %2.3f ms\nQueue: %1.2f", latency, depth);
+            }
             _snprintf(fpsGDIString, 254, "GDI\nFPS: %3.0f\nTGT: %3.0f\nRender Time: %2.3f ms", avg_fps, TargetFPS, avg_len);
         }
 
+        // ddraw.ini was saved, DrawFPS, GlFinish, GlFenceSync and GdiScaler are read every frame anyway
+        DWORD changed = SettingsReload();
+
+        if (changed & (SETTINGS_TARGETFPS | SETTINGS_VSYNC))
+            ResolveTargetFPS(this);
+
+        if (changed && InterlockedExchangeAdd(&Renderer, 0) == RENDERER_OPENGL && !failToGDI)
+        {
+            if ((changed & SETTINGS_VSYNC) && wglSwapIntervalEXT)
+                wglSwapIntervalEXT(SwapInterval);
+
+            if ((changed & SETTINGS_SHADERCHAIN) && convProgram)
+            {
+                // The chain's render targets are allocated from client memory, not from a bound PBO
+                GLint unpackBuffer = 0;
+                if (glBindBuffer)
+                {
+                    glGetIntegerv(GL_PIXEL_UNPACK_BUFFER_BINDING, &unpackBuffer);
+                    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+                }
+
+                if (shaderChainReady)
+                    ShaderChain_Free();
+
+                shaderChainReady = ShaderChain[0] && ShaderChain_Init(ShaderChain);
+
+                if (glBindBuffer)
+                    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, unpackBuffer);
+
+                glUseProgram(convProgram);
+                glBindVertexArray(vao);
+                glGetError();
+            }
+        }
+
         if (startTargetFPS != TargetFPS)
         {
             // TargetFPS was changed externally
@@ -705,9 +1096,17 @@ setup_shaders:
             while (CounterGet(&renderCounter) < TargetFrameLen);
         }
 
+        // The frame deadline is the emulated vblank games wait for
+        VBlank_Present(TargetFrameLen);
+
         if (InterlockedCompareExchange(&this->dd->focusGained, false, true))
         {
+            gdiRepaint = true;
+
             EnterCriticalSection(&this->lock);
+            if (this->palette)
+                this->paletteGeneration = this->palette->generation - 1;
+
             switch (InterlockedExchangeAdd(&Renderer, 0))
             {
             case RENDERER_OPENGL:
@@ -733,5 +1132,36 @@ setup_shaders:
         CounterStart(&renderCounter);
     }
 
+    // GL objects can only be deleted while their context is current, after a runtime
+    // fallback to GDI it isn't anymore and they stay with the context
+    BOOL glCurrent = this->dd->glInfo.hRC_render && wglGetCurrentContext() == this->dd->glInfo.hRC_render;
+
+    if (hudReady && glCurrent)
+        Hud_Free();
+
+    if (gpuBlitReady && glCurrent)
+        GpuBlit_Free();
+
+    if (shaderChainReady && glCurrent)
+        ShaderChain_Free();
+
+    if (scalerReady)
+        Scaler_Free();
+
+    if (recorderReady)
+        Recorder_Stop();
+
+    if (presentReady)
+        Present_Free();
+
+    Screenshot_GlFree();
+
+    ConvertTarget_Free(&gdiTarget);
+    ChildWindows_Free(this);
+    SettingsUnwatch();
+
+    if (paletteTex && glCurrent)
+        glDeleteTextures(1, &paletteTex);
+
     return 0;
 }
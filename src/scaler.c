@@ -0,0 +1,403 @@
+#include <windows.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "main.h"
+#include "scaler.h"
+#include "convert.h"
+#include "pool.h"
+
+/* CPU scaler for the GDI renderer. Converts the primary to XRGB8888 and scales
+ * it in the same pass into a 32 bpp DIB that is presented with one BitBlt. The
+ * output rows are split into bands that run on the pixel pool (pool.c), the
+ * render thread takes one of them itself. */
+
+#define SCALER_MAX_THREADS 7
+
+static struct
+{
+    BOOL initialized;
+    int threadCount;
+
+    HDC hDC;
+    HBITMAP bitmap;
+    HGDIOBJ defaultBM;
+    uint32_t *bits;
+    int width;
+    int height;
+
+    int *xTable;
+    int *xWeight;
+    int tableSrcWidth;
+    int tableDstWidth;
+    int tableMode;
+    uint32_t *lines[SCALER_MAX_THREADS + 1][2];
+    int lineWidth;
+
+    uint32_t palette[256];
+
+    // Current job
+    const uint8_t *src;
+    int srcPitch;
+    int bpp;
+    int srcWidth;
+    int srcHeight;
+    int mode;
+    int outX;
+    int outY;
+    int outWidth;
+    int outHeight;
+} scaler;
+
+/* 16.16 fixed point source position of the center of output pixel i, without
+ * the 64-bit division that would need libgcc in the -nostdlib release build */
+static int Scaler_Center(int i, int src, int out)
+{
+    unsigned n = (unsigned)(i * 2 + 1) * src;
+    return (int)(((n / out) << 15) + (((n % out) << 15) / out)) - 0x8000;
+}
+
+static inline uint32_t Rgb565ToXrgb(uint16_t p)
+{
+    uint32_t r = (p >> 11) & 0x1F;
+    uint32_t g = (p >> 5) & 0x3F;
+    uint32_t b = p & 0x1F;
+
+    return ((r << 3) | (r >> 2)) << 16 | ((g << 2) | (g >> 4)) << 8 | ((b << 3) | (b >> 2));
+}
+
+static void ConvertRow(const uint8_t *src, uint32_t *dst, int width)
+{
+    switch (scaler.bpp)
+    {
+    case 8:
+        for (int x = 0; x < width; x++)
+            dst[x] = scaler.palette[src[x]];
+        break;
+
+    case 32:
+        memcpy(dst, src, width * 4);
+        break;
+
+    default:
+        Convert_Rgb565ToXrgb8888(dst, (const uint16_t *)src, width);
+        break;
+    }
+}
+
+static void NearestRow(const uint8_t *src, uint32_t *dst)
+{
+    const int *xTable = scaler.xTable;
+    int width = scaler.outWidth;
+
+    switch (scaler.bpp)
+    {
+    case 8:
+        for (int x = 0; x < width; x++)
+            dst[x] = scaler.palette[src[xTable[x]]];
+        break;
+
+    case 32:
+        for (int x = 0; x < width; x++)
+            dst[x] = ((const uint32_t *)src)[xTable[x]];
+        break;
+
+    default:
+        for (int x = 0; x < width; x++)
+            dst[x] = Rgb565ToXrgb(((const uint16_t *)src)[xTable[x]]);
+        break;
+    }
+}
+
+static inline uint32_t Lerp(uint32_t a, uint32_t b, int w)
+{
+    // Red and blue, then green, 8 bit weights
+    uint32_t rb = ((a & 0xFF00FF) * (256 - w) + (b & 0xFF00FF) * w) >> 8;
+    uint32_t g = ((a & 0x00FF00) * (256 - w) + (b & 0x00FF00) * w) >> 8;
+
+    return (rb & 0xFF00FF) | (g & 0x00FF00);
+}
+
+static void ScaleBand(int band)
+{
+    int bands = scaler.threadCount + 1;
+    int y0 = scaler.outHeight * band / bands;
+    int y1 = scaler.outHeight * (band + 1) / bands;
+    int pitch = scaler.width;
+
+    if (scaler.mode == SCALER_BILINEAR)
+    {
+        uint32_t *lines[2] = { scaler.lines[band][0], scaler.lines[band][1] };
+        int lineRows[2] = { -1, -1 };
+
+        for (int y = y0; y < y1; y++)
+        {
+            uint32_t *dst = scaler.bits + (scaler.outY + y) * pitch + scaler.outX;
+
+            // 16.16 fixed point position of the output pixel center in the source
+            int fy = Scaler_Center(y, scaler.srcHeight, scaler.outHeight);
+            if (fy < 0)
+                fy = 0;
+
+            int sy = fy >> 16;
+            int wy = (fy >> 8) & 0xFF;
+            int sy1 = sy + 1 < scaler.srcHeight ? sy + 1 : sy;
+
+            // Converted source rows are reused while the output walks down
+            if (lineRows[0] != sy)
+            {
+                if (lineRows[1] == sy)
+                {
+                    uint32_t *tmp = lines[0]; lines[0] = lines[1]; lines[1] = tmp;
+                    lineRows[1] = lineRows[0];
+                    lineRows[0] = sy;
+                }
+                else
+                {
+                    ConvertRow(scaler.src + sy * scaler.srcPitch, lines[0], scaler.srcWidth);
+                    lineRows[0] = sy;
+                }
+            }
+
+            if (lineRows[1] != sy1)
+            {
+                ConvertRow(scaler.src + sy1 * scaler.srcPitch, lines[1], scaler.srcWidth);
+                lineRows[1] = sy1;
+            }
+
+            for (int x = 0; x < scaler.outWidth; x++)
+            {
+                int sx = scaler.xTable[x];
+                int sx1 = sx + 1 < scaler.srcWidth ? sx + 1 : sx;
+                int wx = scaler.xWeight[x];
+
+                uint32_t top = Lerp(lines[0][sx], lines[0][sx1], wx);
+                uint32_t bottom = Lerp(lines[1][sx], lines[1][sx1], wx);
+                dst[x] = Lerp(top, bottom, wy);
+            }
+        }
+    }
+    else
+    {
+        int lastRow = -1;
+
+        for (int y = y0; y < y1; y++)
+        {
+            uint32_t *dst = scaler.bits + (scaler.outY + y) * pitch + scaler.outX;
+            int row = y * scaler.srcHeight / scaler.outHeight;
+
+            // Upscaling repeats rows, copy the one that was just scaled
+            if (row == lastRow)
+                memcpy(dst, dst - pitch, scaler.outWidth * 4);
+            else
+                NearestRow(scaler.src + row * scaler.srcPitch, dst);
+
+            lastRow = row;
+        }
+    }
+}
+
+static void Scaler_Band(void *ctx, int band)
+{
+    ScaleBand(band);
+}
+
+BOOL Scaler_Init(int threads)
+{
+    memset(&scaler, 0, sizeof(scaler));
+
+    // One band per pool thread that may help, the render thread takes one band itself
+    if (threads < 0 || threads > Pool_Threads())
+        threads = Pool_Threads();
+
+    if (threads > SCALER_MAX_THREADS)
+        threads = SCALER_MAX_THREADS;
+
+    scaler.threadCount = threads;
+    scaler.hDC = CreateCompatibleDC(NULL);
+    scaler.initialized = scaler.hDC != NULL;
+
+    dprintf("Scaler_Init: %d bands\n", threads + 1);
+    return scaler.initialized;
+}
+
+void Scaler_Free()
+{
+    if (scaler.hDC)
+    {
+        if (scaler.bitmap)
+        {
+            SelectObject(scaler.hDC, scaler.defaultBM);
+            DeleteObject(scaler.bitmap);
+        }
+        DeleteDC(scaler.hDC);
+    }
+
+    free(scaler.xTable);
+    free(scaler.xWeight);
+
+    for (int i = 0; i <= SCALER_MAX_THREADS; i++)
+    {
+        free(scaler.lines[i][0]);
+        free(scaler.lines[i][1]);
+    }
+
+    memset(&scaler, 0, sizeof(scaler));
+}
+
+static BOOL Scaler_Resize(int width, int height)
+{
+    if (scaler.bitmap)
+    {
+        SelectObject(scaler.hDC, scaler.defaultBM);
+        DeleteObject(scaler.bitmap);
+        scaler.bitmap = NULL;
+    }
+
+    BITMAPINFO bmi;
+    memset(&bmi, 0, sizeof(bmi));
+    bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+    bmi.bmiHeader.biWidth = width;
+    bmi.bmiHeader.biHeight = -height;
+    bmi.bmiHeader.biPlanes = 1;
+    bmi.bmiHeader.biBitCount = 32;
+    bmi.bmiHeader.biCompression = BI_RGB;
+
+    scaler.bitmap = CreateDIBSection(scaler.hDC, &bmi, DIB_RGB_COLORS, (void **)&scaler.bits, NULL, 0);
+    if (!scaler.bitmap)
+    {
+        scaler.width = scaler.height = 0;
+        return FALSE;
+    }
+
+    scaler.defaultBM = SelectObject(scaler.hDC, scaler.bitmap);
+    scaler.width = width;
+    scaler.height = height;
+    return TRUE;
+}
+
+static BOOL Scaler_BuildTables()
+{
+    if (scaler.tableSrcWidth == scaler.srcWidth && scaler.tableDstWidth == scaler.outWidth && scaler.tableMode == scaler.mode)
+        return TRUE;
+
+    free(scaler.xTable);
+    free(scaler.xWeight);
+    scaler.xTable = malloc(scaler.outWidth * sizeof(int));
+    scaler.xWeight = malloc(scaler.outWidth * sizeof(int));
+
+    if (!scaler.xTable || !scaler.xWeight)
+    {
+        scaler.tableSrcWidth = scaler.tableDstWidth = 0;
+        return FALSE;
+    }
+
+    for (int x = 0; x < scaler.outWidth; x++)
+    {
+        if (scaler.mode == SCALER_BILINEAR)
+        {
+            int fx = Scaler_Center(x, scaler.srcWidth, scaler.outWidth);
+            if (fx < 0)
+                fx = 0;
+
+            scaler.xTable[x] = fx >> 16;
+            scaler.xWeight[x] = (fx >> 8) & 0xFF;
+        }
+        else
+        {
+            scaler.xTable[x] = x * scaler.srcWidth / scaler.outWidth;
+            scaler.xWeight[x] = 0;
+        }
+    }
+
+    if (scaler.lineWidth < scaler.srcWidth)
+    {
+        for (int i = 0; i <= SCALER_MAX_THREADS; i++)
+        {
+            free(scaler.lines[i][0]);
+            free(scaler.lines[i][1]);
+            scaler.lines[i][0] = scaler.lines[i][1] = NULL;
+        }
+
+        for (int i = 0; i <= scaler.threadCount; i++)
+        {
+            scaler.lines[i][0] = malloc(scaler.srcWidth * 4);
+            scaler.lines[i][1] = malloc(scaler.srcWidth * 4);
+
+            if (!scaler.lines[i][0] || !scaler.lines[i][1])
+            {
+                scaler.lineWidth = 0;
+                scaler.tableSrcWidth = scaler.tableDstWidth = 0;
+                return FALSE;
+            }
+        }
+
+        scaler.lineWidth = scaler.srcWidth;
+    }
+
+    scaler.tableSrcWidth = scaler.srcWidth;
+    scaler.tableDstWidth = scaler.outWidth;
+    scaler.tableMode = scaler.mode;
+    return TRUE;
+}
+
+/* Scales src into the rectangle x, y, width, height of hDC. Returns FALSE when the
+ * caller should fall back to StretchBlt. */
+BOOL Scaler_Present(HDC hDC, int x, int y, int width, int height,
+    const void *src, int srcPitch, int bpp, int srcWidth, int srcHeight, const RGBQUAD *palette, int mode)
+{
+    if (!scaler.initialized || !src || width <= 0 || height <= 0 || srcWidth <= 0 || srcHeight <= 0)
+        return FALSE;
+
+    if (scaler.width != width || scaler.height != height)
+    {
+        if (!Scaler_Resize(width, height))
+            return FALSE;
+
+        memset(scaler.bits, 0, width * height * 4);
+    }
+
+    int outX = 0, outY = 0, outWidth = width, outHeight = height;
+
+    if (mode == SCALER_INTEGER)
+    {
+        int scaleX = width / srcWidth;
+        int scaleY = height / srcHeight;
+        int scale = scaleX < scaleY ? scaleX : scaleY;
+        if (scale < 1)
+            scale = 1;
+
+        outWidth = srcWidth * scale < width ? srcWidth * scale : width;
+        outHeight = srcHeight * scale < height ? srcHeight * scale : height;
+        outX = (width - outWidth) / 2;
+        outY = (height - outHeight) / 2;
+    }
+
+    // The borders of an integer scaled picture stay black
+    if (outX != scaler.outX || outY != scaler.outY || outWidth != scaler.outWidth || outHeight != scaler.outHeight)
+        memset(scaler.bits, 0, width * height * 4);
+
+    scaler.src = src;
+    scaler.srcPitch = srcPitch;
+    scaler.bpp = bpp;
+    scaler.srcWidth = srcWidth;
+    scaler.srcHeight = srcHeight;
+    scaler.mode = mode;
+    scaler.outX = outX;
+    scaler.outY = outY;
+    scaler.outWidth = outWidth;
+    scaler.outHeight = outHeight;
+
+    if (!Scaler_BuildTables())
+        return FALSE;
+
+    if (bpp == 8 && palette)
+    {
+        for (int i = 0; i < 256; i++)
+            scaler.palette[i] = palette[i].rgbRed << 16 | palette[i].rgbGreen << 8 | palette[i].rgbBlue;
+    }
+
+    Pool_Run(scaler.threadCount + 1, Scaler_Band, NULL);
+
+    return BitBlt(hDC, x, y, width, height, scaler.hDC, 0, 0, SRCCOPY);
+}
@@ -0,0 +1,11 @@
+#ifndef _SCALER_
+#define _SCALER_
+
+#include <windows.h>
+
+BOOL Scaler_Init(int threads);
+void Scaler_Free();
+BOOL Scaler_Present(HDC hDC, int x, int y, int width, int height,
+    const void *src, int srcPitch, int bpp, int srcWidth, int srcHeight, const RGBQUAD *palette, int mode);
+
+#endif
@@ -0,0 +1,344 @@
+#include <windows.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "opengl.h"
+#include "main.h"
+#include "png.h"
+#include "screenshot.h"
+#include "affinity.h"
+#include "pool.h"
+#include "convert.h"
+
+/* Screenshots (RCtrl+S). The primary is copied into a free job buffer under its
+ * lock, or with ScreenshotScaled the OpenGL back buffer is read into a pixel pack
+ * buffer and collected a frame later. PNG encoding and the file write happen on
+ * a worker thread, neither the game nor the renderer ever waits for them. */
+
+#define SCREENSHOT_JOBS 2
+#define SCREENSHOT_CHUNK 256
+
+#define JOB_FREE 0
+#define JOB_FILLING 1
+#define JOB_QUEUED 2
+
+typedef struct
+{
+    volatile LONG state;
+    uint8_t *bits;
+    size_t capacity;
+    int width;
+    int height;
+    int pitch;
+    int bpp;
+    BOOL bottomUp;
+    PALETTEENTRY palette[256];
+    SYSTEMTIME time;
+} ScreenshotJob;
+
+static struct
+{
+    HANDLE thread;
+    HANDLE wake;
+    ScreenshotJob jobs[SCREENSHOT_JOBS];
+    volatile LONG requested;
+
+    GLuint pbo;
+    size_t pboBytes;
+    int pboWidth;
+    int pboHeight;
+    BOOL pboPending;
+} shot;
+
+typedef struct
+{
+    const ScreenshotJob *job;
+    uint8_t *rgb;
+} ScreenshotRows;
+
+static void Screenshot_ToRgb(void *ctx, int y0, int y1)
+{
+    const ScreenshotJob *job = ((ScreenshotRows *)ctx)->job;
+    uint8_t *rgb = ((ScreenshotRows *)ctx)->rgb + (size_t)y0 * job->width * 3;
+
+    uint32_t xrgb[SCREENSHOT_CHUNK];
+
+    for (int y = y0; y < y1; y++)
+    {
+        const uint8_t *row = job->bits + (size_t)(job->bottomUp ? job->height - 1 - y : y) * job->pitch;
+
+        for (int x = 0; x < job->width; x++, rgb += 3)
+        {
+            if (job->bpp == 8)
+            {
+                rgb[0] = job->palette[row[x]].peRed;
+                rgb[1] = job->palette[row[x]].peGreen;
+                rgb[2] = job->palette[row[x]].peBlue;
+            }
+            else if (job->bpp == 16)
+            {
+                // Widened in chunks with the shared converter, the same colors as the renderer
+                if (x % SCREENSHOT_CHUNK == 0)
+                {
+                    int count = job->width - x < SCREENSHOT_CHUNK ? job->width - x : SCREENSHOT_CHUNK;
+                    Convert_Rgb565ToXrgb8888(xrgb, (const uint16_t *)row + x, count);
+                }
+
+                uint32_t p = xrgb[x % SCREENSHOT_CHUNK];
+                rgb[0] = (uint8_t)(p >> 16);
+                rgb[1] = (uint8_t)(p >> 8);
+                rgb[2] = (uint8_t)p;
+            }
+            else
+            {
+                rgb[0] = row[x * 4 + 2];
+                rgb[1] = row[x * 4 + 1];
+                rgb[2] = row[x * 4];
+            }
+        }
+    }
+}
+
+static DWORD WINAPI Screenshot_Thread(LPVOID unused)
+{
+    Affinity_PlaceThread(AFFINITY_WORKER);
+
+    for (;;)
+    {
+        WaitForSingleObject(shot.wake, INFINITE);
+
+        for (int i = 0; i < SCREENSHOT_JOBS; i++)
+        {
+            ScreenshotJob *job = &shot.jobs[i];
+
+            if (InterlockedExchangeAdd(&job->state, 0) != JOB_QUEUED)
+                continue;
+
+            char path[MAX_PATH];
+            _snprintf(path, sizeof(path), "%s-%04d%02d%02d-%02d%02d%02d-%03d.png", Screenshot,
+                job->time.wYear, job->time.wMonth, job->time.wDay,
+                job->time.wHour, job->time.wMinute, job->time.wSecond, job->time.wMilliseconds);
+
+            uint8_t *rgb = malloc((size_t)job->width * job->height * 3);
+            if (rgb)
+            {
+                ScreenshotRows rows = { job, rgb };
+                Pool_ParallelRows(job->height, job->width * 3, Screenshot_ToRgb, &rows);
+
+                if (!Png_Write(path, rgb, job->width, job->height))
+                    dprintf("Screenshot: can't write %s\n", path);
+                else
+                    dprintf("Screenshot: %s (%dx%d)\n", path, job->width, job->height);
+
+                free(rgb);
+            }
+
+            InterlockedExchange(&job->state, JOB_FREE);
+        }
+    }
+
+    return 0;
+}
+
+void Screenshot_Init()
+{
+    if (shot.thread)
+        return;
+
+    shot.wake = CreateEvent(NULL, FALSE, FALSE, NULL);
+    shot.thread = CreateThread(NULL, 0, Screenshot_Thread, NULL, 0, NULL);
+
+    if (shot.thread)
+        SetThreadPriority(shot.thread, THREAD_PRIORITY_BELOW_NORMAL);
+}
+
+/* A free job with room for bytes, NULL while both are still being encoded */
+static ScreenshotJob *Screenshot_AcquireJob(size_t bytes)
+{
+    if (!shot.thread)
+        return NULL;
+
+    for (int i = 0; i < SCREENSHOT_JOBS; i++)
+    {
+        ScreenshotJob *job = &shot.jobs[i];
+
+        if (InterlockedCompareExchange(&job->state, JOB_FILLING, JOB_FREE) != JOB_FREE)
+            continue;
+
+        if (job->capacity < bytes)
+        {
+            free(job->bits);
+            job->bits = malloc(bytes);
+            job->capacity = job->bits ? bytes : 0;
+        }
+
+        if (job->bits)
+        {
+            GetLocalTime(&job->time);
+            return job;
+        }
+
+        InterlockedExchange(&job->state, JOB_FREE);
+        break;
+    }
+
+    dprintf("Screenshot: still busy, skipped\n");
+    return NULL;
+}
+
+static void Screenshot_Queue(ScreenshotJob *job)
+{
+    InterlockedExchange(&job->state, JOB_QUEUED);
+    SetEvent(shot.wake);
+}
+
+/* Native resolution copy, the caller holds the surface lock */
+void Screenshot_Capture(const void *src, int pitch, int width, int height, int bpp, const PALETTEENTRY *palette)
+{
+    if (!src || (bpp != 8 && bpp != 16 && bpp != 32))
+        return;
+
+    int rowBytes = width * (bpp / 8);
+    ScreenshotJob *job = Screenshot_AcquireJob((size_t)rowBytes * height);
+    if (!job)
+        return;
+
+    for (int y = 0; y < height; y++)
+        memcpy(job->bits + (size_t)y * rowBytes, (const uint8_t *)src + (size_t)y * pitch, rowBytes);
+
+    if (bpp == 8 && palette)
+        memcpy(job->palette, palette, sizeof(job->palette));
+
+    job->width = width;
+    job->height = height;
+    job->pitch = rowBytes;
+    job->bpp = bpp;
+    job->bottomUp = FALSE;
+
+    Screenshot_Queue(job);
+}
+
+void Screenshot_Request()
+{
+    InterlockedExchange(&shot.requested, TRUE);
+}
+
+BOOL Screenshot_Requested()
+{
+    return InterlockedExchange(&shot.requested, FALSE);
+}
+
+/* Starts an asynchronous read of the back buffer, called before SwapBuffers. The
+ * rectangle is clipped to the client area, the back buffer isn't any larger. */
+void Screenshot_GlReadback(int x, int y, int width, int height, int clientWidth, int clientHeight)
+{
+    if (x < 0)
+    {
+        width += x;
+        x = 0;
+    }
+
+    if (y < 0)
+    {
+        height += y;
+        y = 0;
+    }
+
+    if (x + width > clientWidth)
+        width = clientWidth - x;
+
+    if (y + height > clientHeight)
+        height = clientHeight - y;
+
+    size_t bytes = (size_t)width * height * 4;
+
+    if (shot.pboPending || width <= 0 || height <= 0)
+        return;
+
+    if (!glGenBuffers || !glMapBuffer)
+    {
+        // No pack buffers, read synchronously, it is only one frame
+        ScreenshotJob *job = Screenshot_AcquireJob(bytes);
+        if (!job)
+            return;
+
+        glReadPixels(x, y, width, height, GL_BGRA, GL_UNSIGNED_BYTE, job->bits);
+
+        job->width = width;
+        job->height = height;
+        job->pitch = width * 4;
+        job->bpp = 32;
+        job->bottomUp = TRUE;
+
+        Screenshot_Queue(job);
+        return;
+    }
+
+    if (!shot.pbo)
+        glGenBuffers(1, &shot.pbo);
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, shot.pbo);
+
+    if (shot.pboBytes < bytes)
+    {
+        glBufferData(GL_PIXEL_PACK_BUFFER, bytes, NULL, GL_STREAM_READ);
+        shot.pboBytes = bytes;
+    }
+
+    glReadPixels(x, y, width, height, GL_BGRA, GL_UNSIGNED_BYTE, 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    shot.pboWidth = width;
+    shot.pboHeight = height;
+    shot.pboPending = TRUE;
+}
+
+/* Picks up the readback started on the previous frame */
+void Screenshot_GlCollect()
+{
+    if (!shot.pboPending)
+        return;
+
+    shot.pboPending = FALSE;
+
+    size_t bytes = (size_t)shot.pboWidth * shot.pboHeight * 4;
+    ScreenshotJob *job = Screenshot_AcquireJob(bytes);
+    if (!job)
+        return;
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, shot.pbo);
+    void *pixels = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+
+    if (pixels)
+    {
+        memcpy(job->bits, pixels, bytes);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    }
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    if (!pixels)
+    {
+        InterlockedExchange(&job->state, JOB_FREE);
+        return;
+    }
+
+    job->width = shot.pboWidth;
+    job->height = shot.pboHeight;
+    job->pitch = shot.pboWidth * 4;
+    job->bpp = 32;
+    job->bottomUp = TRUE;
+
+    Screenshot_Queue(job);
+}
+
+/* Render thread teardown, the worker stays for later screenshots */
+void Screenshot_GlFree()
+{
+    if (shot.pbo && wglGetCurrentContext())
+        glDeleteBuffers(1, &shot.pbo);
+
+    shot.pbo = 0;
+    shot.pboBytes = 0;
+    shot.pboPending = FALSE;
+}
@@ -0,0 +1,14 @@
+#ifndef _SCREENSHOT_
+#define _SCREENSHOT_
+
+#include <windows.h>
+
+void Screenshot_Init();
+void Screenshot_Capture(const void *src, int pitch, int width, int height, int bpp, const PALETTEENTRY *palette);
+void Screenshot_Request();
+BOOL Screenshot_Requested();
+void Screenshot_GlReadback(int x, int y, int width, int height, int clientWidth, int clientHeight);
+void Screenshot_GlCollect();
+void Screenshot_GlFree();
+
+#endif
@@ -0,0 +1,409 @@
+#include <windows.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "opengl.h"
+#include "main.h"
+#include "shaderchain.h"
+
+/* Scaling shader chain from ddraw.ini, for example
+ *
+ *   ShaderChain=shaders\passthrough.glsl*int*nearest; shaders\passthrough.glsl*linear
+ *
+ * Passes are separated with ';', options follow the file name after '*':
+ *   int       largest integer multiple of the input that fits the window
+ *   view      size of the window viewport (always used for the last pass)
+ *   <number>  input size times number (default 1)
+ *   linear, nearest  filter used when the pass samples its input (default nearest)
+ *
+ * The primary is first drawn with the regular program into a source texture at
+ * its own resolution, each pass then renders into its own texture and the last
+ * one into the window. Shader files use the same uniforms and attributes as the
+ * built in programs: VertexCoord, TexCoord, MVPMatrix, Texture, TextureSize,
+ * InputSize, OutputSize and FrameCount. */
+
+#define SHADER_CHAIN_MAX_PASSES 8
+
+#define SCALE_SOURCE 0
+#define SCALE_INTEGER 1
+#define SCALE_VIEWPORT 2
+
+typedef struct
+{
+    GLuint program;
+    GLuint vao;
+    GLuint fbo;
+    GLuint texture;
+    int width;
+    int height;
+    int scaleType;
+    float scale;
+    GLint filter;
+    GLint textureSizeLoc;
+    GLint inputSizeLoc;
+    GLint outputSizeLoc;
+    GLint frameCountLoc;
+} ShaderPass;
+
+static struct
+{
+    BOOL initialized;
+    GLuint vbo;
+    GLuint sourceFbo;
+    GLuint sourceTexture;
+    int sourceWidth;
+    int sourceHeight;
+    int passCount;
+    ShaderPass passes[SHADER_CHAIN_MAX_PASSES];
+    int frameCount;
+} chain;
+
+static BOOL ShaderChain_ResizeTarget(GLuint fbo, GLuint texture, int width, int height)
+{
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+
+    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    if (status != GL_FRAMEBUFFER_COMPLETE)
+    {
+        dprintf("ShaderChain: framebuffer %dx%d incomplete, %x\n", width, height, status);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void ShaderChain_CreateTarget(GLuint *fbo, GLuint *texture)
+{
+    glGenFramebuffers(1, fbo);
+    glGenTextures(1, texture);
+
+    glBindTexture(GL_TEXTURE_2D, *texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+}
+
+static BOOL ShaderChain_AddPass(char *spec, BOOL last)
+{
+    ShaderPass *pass = &chain.passes[chain.passCount];
+
+    pass->scaleType = SCALE_SOURCE;
+    pass->scale = 1.0f;
+    pass->filter = GL_NEAREST;
+
+    char *option = strchr(spec, '*');
+    if (option)
+        *option++ = 0;
+
+    while (option && *option)
+    {
+        char *next = strchr(option, '*');
+        if (next)
+            *next++ = 0;
+
+        if (_strcmpi(option, "int") == 0 || _strcmpi(option, "integer") == 0)
+            pass->scaleType = SCALE_INTEGER;
+        else if (_strcmpi(option, "view") == 0 || _strcmpi(option, "viewport") == 0)
+            pass->scaleType = SCALE_VIEWPORT;
+        else if (_strcmpi(option, "linear") == 0)
+            pass->filter = GL_LINEAR;
+        else if (_strcmpi(option, "nearest") == 0)
+            pass->filter = GL_NEAREST;
+        else if (atof(option) > 0)
+        {
+            pass->scaleType = SCALE_SOURCE;
+            pass->scale = (float)atof(option);
+        }
+        else
+            dprintf("ShaderChain: unknown option '%s' for %s\n", option, spec);
+
+        option = next;
+    }
+
+    if (last)
+        pass->scaleType = SCALE_VIEWPORT;
+
+    pass->program = OpenGL_BuildProgramFromFile(spec);
+    if (!pass->program)
+    {
+        dprintf("ShaderChain: failed to build %s\n", spec);
+        return FALSE;
+    }
+
+    glUseProgram(pass->program);
+
+    float mvpMatrix[16] = {
+        1,0,0,0,
+        0,1,0,0,
+        0,0,1,0,
+        0,0,0,1,
+    };
+    glUniformMatrix4fv(glGetUniformLocation(pass->program, "MVPMatrix"), 1, GL_FALSE, mvpMatrix);
+    glUniform1i(glGetUniformLocation(pass->program, "Texture"), 0);
+
+    pass->textureSizeLoc = glGetUniformLocation(pass->program, "TextureSize");
+    pass->inputSizeLoc = glGetUniformLocation(pass->program, "InputSize");
+    pass->outputSizeLoc = glGetUniformLocation(pass->program, "OutputSize");
+    pass->frameCountLoc = glGetUniformLocation(pass->program, "FrameCount");
+
+    GLint vertexCoordAttrLoc = glGetAttribLocation(pass->program, "VertexCoord");
+    GLint texCoordAttrLoc = glGetAttribLocation(pass->program, "TexCoord");
+
+    glGenVertexArrays(1, &pass->vao);
+    glBindVertexArray(pass->vao);
+    glBindBuffer(GL_ARRAY_BUFFER, chain.vbo);
+
+    if (vertexCoordAttrLoc != -1)
+    {
+        glVertexAttribPointer(vertexCoordAttrLoc, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), (void *)0);
+        glEnableVertexAttribArray(vertexCoordAttrLoc);
+    }
+
+    if (texCoordAttrLoc != -1)
+    {
+        glVertexAttribPointer(texCoordAttrLoc, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), (void *)(2 * sizeof(GLfloat)));
+        glEnableVertexAttribArray(texCoordAttrLoc);
+    }
+
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindVertexArray(0);
+
+    if (!last)
+        ShaderChain_CreateTarget(&pass->fbo, &pass->texture);
+
+    dprintf("ShaderChain: pass %d %s, scale type %d x%.2f, %s input\n", chain.passCount, spec,
+        pass->scaleType, pass->scale, pass->filter == GL_LINEAR ? "linear" : "nearest");
+
+    chain.passCount++;
+    return TRUE;
+}
+
+BOOL ShaderChain_Init(const char *spec)
+{
+    memset(&chain, 0, sizeof(chain));
+
+    if (!glGenFramebuffers || !glBindFramebuffer || !glFramebufferTexture2D || !glCheckFramebufferStatus)
+    {
+        dprintf("ShaderChain: no framebuffer object support\n");
+        return FALSE;
+    }
+
+    char *copy = _strdup(spec);
+    if (!copy)
+        return FALSE;
+
+    char *files[SHADER_CHAIN_MAX_PASSES];
+    int fileCount = 0;
+
+    for (char *token = strtok(copy, ";"); token && fileCount < SHADER_CHAIN_MAX_PASSES; token = strtok(NULL, ";"))
+    {
+        while (*token == ' ' || *token == '\t')
+            token++;
+
+        char *end = token + strlen(token);
+        while (end > token && (end[-1] == ' ' || end[-1] == '\t'))
+            *--end = 0;
+
+        if (*token)
+            files[fileCount++] = token;
+    }
+
+    // Full window quad, the passes render upside down into their textures and the
+    // texture coordinates follow so that the picture is upright in the window
+    GLfloat vertices[] = {
+        -1.0f, -1.0f, 0.0f, 0.0f,
+         1.0f, -1.0f, 1.0f, 0.0f,
+         1.0f,  1.0f, 1.0f, 1.0f,
+        -1.0f,  1.0f, 0.0f, 1.0f,
+    };
+
+    glGenBuffers(1, &chain.vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, chain.vbo);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    BOOL result = fileCount > 0;
+    for (int i = 0; i < fileCount && result; i++)
+        result = ShaderChain_AddPass(files[i], i == fileCount - 1);
+
+    free(copy);
+
+    if (result)
+        ShaderChain_CreateTarget(&chain.sourceFbo, &chain.sourceTexture);
+
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glUseProgram(0);
+
+    GLenum gle = glGetError();
+    if (!result || gle != GL_NO_ERROR)
+    {
+        dprintf("ShaderChain_Init failed, %x\n", gle);
+        ShaderChain_Free();
+        return FALSE;
+    }
+
+    chain.initialized = TRUE;
+    dprintf("ShaderChain_Init: %d passes\n", chain.passCount);
+    return TRUE;
+}
+
+void ShaderChain_Free()
+{
+    for (int i = 0; i < chain.passCount; i++)
+    {
+        ShaderPass *pass = &chain.passes[i];
+
+        if (pass->program)
+            glDeleteProgram(pass->program);
+
+        if (pass->vao)
+            glDeleteVertexArrays(1, &pass->vao);
+
+        if (pass->fbo)
+            glDeleteFramebuffers(1, &pass->fbo);
+
+        if (pass->texture)
+            glDeleteTextures(1, &pass->texture);
+    }
+
+    if (chain.sourceFbo)
+        glDeleteFramebuffers(1, &chain.sourceFbo);
+
+    if (chain.sourceTexture)
+        glDeleteTextures(1, &chain.sourceTexture);
+
+    if (chain.vbo)
+        glDeleteBuffers(1, &chain.vbo);
+
+    memset(&chain, 0, sizeof(chain));
+}
+
+/* Redirects drawing into the source texture, the caller draws the primary as usual */
+BOOL ShaderChain_Begin(int width, int height)
+{
+    if (!chain.initialized)
+        return FALSE;
+
+    if (chain.sourceWidth != width || chain.sourceHeight != height)
+    {
+        if (!ShaderChain_ResizeTarget(chain.sourceFbo, chain.sourceTexture, width, height))
+            return FALSE;
+
+        chain.sourceWidth = width;
+        chain.sourceHeight = height;
+    }
+    else
+        glBindFramebuffer(GL_FRAMEBUFFER, chain.sourceFbo);
+
+    glViewport(0, 0, width, height);
+    return TRUE;
+}
+
+/* Runs the passes, the last one draws into the window at the given viewport */
+void ShaderChain_End(int x, int y, int width, int height)
+{
+    GLuint input = chain.sourceTexture;
+    int inputWidth = chain.sourceWidth;
+    int inputHeight = chain.sourceHeight;
+
+    chain.frameCount++;
+
+    for (int i = 0; i < chain.passCount; i++)
+    {
+        ShaderPass *pass = &chain.passes[i];
+        BOOL last = i == chain.passCount - 1;
+        int outputWidth, outputHeight;
+
+        switch (pass->scaleType)
+        {
+        case SCALE_VIEWPORT:
+            outputWidth = width;
+            outputHeight = height;
+            break;
+
+        case SCALE_INTEGER:
+        {
+            int scaleX = width / inputWidth;
+            int scaleY = height / inputHeight;
+            int scale = scaleX < scaleY ? scaleX : scaleY;
+            if (scale < 1)
+                scale = 1;
+
+            outputWidth = inputWidth * scale;
+            outputHeight = inputHeight * scale;
+            break;
+        }
+
+        default:
+            outputWidth = (int)(inputWidth * pass->scale);
+            outputHeight = (int)(inputHeight * pass->scale);
+            break;
+        }
+
+        if (outputWidth < 1)
+            outputWidth = 1;
+
+        if (outputHeight < 1)
+            outputHeight = 1;
+
+        if (last)
+        {
+            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+            glViewport(x, y, width, height);
+        }
+        else
+        {
+            if (pass->width != outputWidth || pass->height != outputHeight)
+            {
+                if (!ShaderChain_ResizeTarget(pass->fbo, pass->texture, outputWidth, outputHeight))
+                    break;
+
+                pass->width = outputWidth;
+                pass->height = outputHeight;
+            }
+            else
+                glBindFramebuffer(GL_FRAMEBUFFER, pass->fbo);
+
+            glViewport(0, 0, outputWidth, outputHeight);
+        }
+
+        glUseProgram(pass->program);
+        glBindVertexArray(pass->vao);
+
+        glBindTexture(GL_TEXTURE_2D, input);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, pass->filter);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, pass->filter);
+
+        GLfloat inputSize[2] = { (GLfloat)inputWidth, (GLfloat)inputHeight };
+        GLfloat outputSize[2] = { (GLfloat)outputWidth, (GLfloat)outputHeight };
+
+        if (pass->textureSizeLoc != -1)
+            glUniform2fv(pass->textureSizeLoc, 1, inputSize);
+
+        if (pass->inputSizeLoc != -1)
+            glUniform2fv(pass->inputSizeLoc, 1, inputSize);
+
+        if (pass->outputSizeLoc != -1)
+            glUniform2fv(pass->outputSizeLoc, 1, outputSize);
+
+        if (pass->frameCountLoc != -1)
+            glUniform1i(pass->frameCountLoc, chain.frameCount);
+
+        glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+
+        input = pass->texture;
+        inputWidth = outputWidth;
+        inputHeight = outputHeight;
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glBindVertexArray(0);
+}
@@ -0,0 +1,12 @@
+#ifndef _SHADERCHAIN_
+#define _SHADERCHAIN_
+
+#include <windows.h>
+#include "opengl.h"
+
+BOOL ShaderChain_Init(const char *chain);
+void ShaderChain_Free();
+BOOL ShaderChain_Begin(int width, int height);
+void ShaderChain_End(int x, int y, int width, int height);
+
+#endif
@@ -0,0 +1,185 @@
+#include <windows.h>
+#include <stdio.h>
+#include <string.h>
+#include "main.h"
+#include "surfacepool.h"
+#include "guardpage.h"
+
+/* Tiberian Sun and RA2 create and release lots of short lived surfaces in menus
+ * and while loading. Released backing stores are kept in free lists by size
+ * class, up to SurfacePoolSize megabytes, and handed out again to surfaces of
+ * the same width, height and bpp. */
+
+#define SURFACE_POOL_CLASSES 16
+#define SURFACE_POOL_MAX 128
+
+typedef struct PoolEntry
+{
+    struct PoolEntry *next;
+    DWORD released;
+    SurfaceMemory mem;
+} PoolEntry;
+
+static struct
+{
+    CRITICAL_SECTION lock;
+    BOOL initialized;
+    PoolEntry *classes[SURFACE_POOL_CLASSES];
+    PoolEntry entries[SURFACE_POOL_MAX];
+    PoolEntry *unused;
+    size_t bytes;
+    DWORD clock;
+    int hits;
+    int misses;
+    int evictions;
+} pool;
+
+static int SurfacePool_Class(size_t bytes)
+{
+    // Power of two size classes from 4 KB up
+    int sizeClass = 0;
+    for (bytes >>= 12; bytes > 1 && sizeClass < SURFACE_POOL_CLASSES - 1; bytes >>= 1)
+        sizeClass++;
+
+    return sizeClass;
+}
+
+static void SurfacePool_Destroy(SurfaceMemory *mem)
+{
+    SelectObject(mem->hDC, mem->defaultBM);
+    GuardPages_DeleteDIBSection(mem->bitmap, mem->section);
+    DeleteDC(mem->hDC);
+    free(mem->bmi);
+}
+
+void SurfacePool_Init()
+{
+    if (pool.initialized)
+        return;
+
+    InitializeCriticalSection(&pool.lock);
+
+    for (int i = 0; i < SURFACE_POOL_MAX; i++)
+    {
+        pool.entries[i].next = pool.unused;
+        pool.unused = &pool.entries[i];
+    }
+
+    pool.initialized = TRUE;
+}
+
+BOOL SurfacePool_Acquire(int width, int height, int bpp, SurfaceMemory *mem)
+{
+    if (!pool.initialized || SurfacePoolSize <= 0)
+        return FALSE;
+
+    BOOL hit = FALSE;
+    size_t bytes = (size_t)width * height * (bpp / 8);
+
+    EnterCriticalSection(&pool.lock);
+
+    for (PoolEntry **link = &pool.classes[SurfacePool_Class(bytes)]; *link; link = &(*link)->next)
+    {
+        PoolEntry *entry = *link;
+
+        if (entry->mem.width == width && entry->mem.height == height && entry->mem.bpp == bpp)
+        {
+            *mem = entry->mem;
+            *link = entry->next;
+
+            entry->next = pool.unused;
+            pool.unused = entry;
+
+            pool.bytes -= mem->bytes;
+            hit = TRUE;
+            break;
+        }
+    }
+
+    if (hit)
+        pool.hits++;
+    else
+        pool.misses++;
+
+    if ((pool.hits + pool.misses) % 100 == 0)
+    {
+        dprintf("SurfacePool: %d hits, %d misses, %d evictions, %d KB pooled\n",
+            pool.hits, pool.misses, pool.evictions, (int)(pool.bytes / 1024));
+    }
+
+    LeaveCriticalSection(&pool.lock);
+    return hit;
+}
+
+static BOOL SurfacePool_EvictOldest()
+{
+    PoolEntry **oldest = NULL;
+
+    for (int i = 0; i < SURFACE_POOL_CLASSES; i++)
+    {
+        for (PoolEntry **link = &pool.classes[i]; *link; link = &(*link)->next)
+        {
+            if (!oldest || (*link)->released < (*oldest)->released)
+                oldest = link;
+        }
+    }
+
+    if (!oldest)
+        return FALSE;
+
+    PoolEntry *entry = *oldest;
+    *oldest = entry->next;
+
+    pool.bytes -= entry->mem.bytes;
+    pool.evictions++;
+    SurfacePool_Destroy(&entry->mem);
+
+    entry->next = pool.unused;
+    pool.unused = entry;
+    return TRUE;
+}
+
+/* Returns TRUE when the pool took over the backing store */
+BOOL SurfacePool_Release(SurfaceMemory *mem)
+{
+    size_t cap = (size_t)SurfacePoolSize * 1024 * 1024;
+
+    if (!pool.initialized || mem->bytes > cap)
+        return FALSE;
+
+    EnterCriticalSection(&pool.lock);
+
+    while ((pool.bytes + mem->bytes > cap || !pool.unused) && SurfacePool_EvictOldest());
+
+    PoolEntry *entry = pool.unused;
+    pool.unused = entry->next;
+
+    entry->mem = *mem;
+    entry->released = ++pool.clock;
+
+    int sizeClass = SurfacePool_Class((size_t)mem->width * mem->height * (mem->bpp / 8));
+    entry->next = pool.classes[sizeClass];
+    pool.classes[sizeClass] = entry;
+
+    pool.bytes += mem->bytes;
+
+    LeaveCriticalSection(&pool.lock);
+    return TRUE;
+}
+
+void SurfacePool_Flush()
+{
+    if (!pool.initialized)
+        return;
+
+    EnterCriticalSection(&pool.lock);
+
+    dprintf("SurfacePool: %d hits, %d misses, %d evictions, flushing %d KB\n",
+        pool.hits, pool.misses, pool.evictions, (int)(pool.bytes / 1024));
+
+    while (SurfacePool_EvictOldest());
+
+    pool.evictions = 0;
+
+    LeaveCriticalSection(&pool.lock);
+}
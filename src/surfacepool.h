@@ -0,0 +1,26 @@
+#ifndef _SURFACEPOOL_
+#define _SURFACEPOOL_
+
+#include <windows.h>
+
+/* Backing store of an offscreen surface: DC, DIB section and its BITMAPINFO */
+typedef struct
+{
+    int width;
+    int height;
+    int bpp;
+    size_t bytes;
+    HDC hDC;
+    HBITMAP bitmap;
+    HANDLE section;
+    HGDIOBJ defaultBM;
+    PBITMAPINFO bmi;
+    void *bits;
+} SurfaceMemory;
+
+void SurfacePool_Init();
+BOOL SurfacePool_Acquire(int width, int height, int bpp, SurfaceMemory *mem);
+BOOL SurfacePool_Release(SurfaceMemory *mem);
+void SurfacePool_Flush();
+
+#endif
@@ -0,0 +1,179 @@
+#include <windows.h>
+#include <stdio.h>
+#include <math.h>
+#include "main.h"
+#include "vblank.h"
+
+/* Emulated vertical blank for WaitForVerticalBlank, GetScanLine,
+ * GetVerticalBlankStatus and GetMonitorFrequency. A window has no retrace of its
+ * own, so the frame deadlines of the render thread are the refresh: each one
+ * starts a blank interval and the scanline then runs through the game's
+ * resolution until the next. Waits wake up on our presents, and when the
+ * renderer stalls the last period keeps the clock going. */
+
+#define VBLANK_DEFAULT_RATE 60.0
+
+static struct
+{
+    CRITICAL_SECTION lock;
+    HANDLE presented;
+    volatile LONG count;
+    double frequency;
+    LONGLONG anchor;
+    double period;
+} vblank;
+
+/* Lives as long as the process, like the screenshot worker */
+void VBlank_Init()
+{
+    if (vblank.presented)
+        return;
+
+    LARGE_INTEGER li;
+    QueryPerformanceFrequency(&li);
+    vblank.frequency = (double)li.QuadPart / 1000.0;
+    QueryPerformanceCounter(&li);
+    vblank.anchor = li.QuadPart;
+    vblank.period = 1000.0 / VBLANK_DEFAULT_RATE;
+
+    InitializeCriticalSection(&vblank.lock);
+    vblank.presented = CreateEvent(NULL, FALSE, FALSE, NULL);
+}
+
+/* Render thread, at every frame deadline. frameLen is the pacing interval in ms. */
+void VBlank_Present(double frameLen)
+{
+    if (!vblank.presented)
+        return;
+
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+
+    EnterCriticalSection(&vblank.lock);
+    vblank.anchor = now.QuadPart;
+    if (frameLen > 0.0)
+        vblank.period = frameLen;
+    LeaveCriticalSection(&vblank.lock);
+
+    InterlockedIncrement(&vblank.count);
+    SetEvent(vblank.presented);
+}
+
+/* Milliseconds since the last real or predicted vblank. Times are kept in
+ * double like counter.c, 64-bit division needs libgcc in the release build. */
+static double VBlank_Phase(double *period)
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+
+    EnterCriticalSection(&vblank.lock);
+    double elapsed = (double)(now.QuadPart - vblank.anchor) / vblank.frequency;
+    *period = vblank.period;
+    LeaveCriticalSection(&vblank.lock);
+
+    return elapsed > 0.0 ? elapsed - floor(elapsed / *period) * *period : 0.0;
+}
+
+/* Lines per refresh, about the ratio of the VGA timings (480 visible of 525) */
+static DWORD VBlank_Total(DWORD visible)
+{
+    return visible + visible / 12 + 1;
+}
+
+static double VBlank_Now()
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return (double)now.QuadPart / vblank.frequency;
+}
+
+static void VBlank_Sleep(double ms)
+{
+    double end = VBlank_Now() + ms;
+
+    if (ms >= 1.0)
+        Sleep((DWORD)ms);
+
+    // Finish sub-millisecond sleep
+    while (VBlank_Now() < end);
+}
+
+/* Blocks until the next vblank starts, or with end until the current or next one is over */
+void VBlank_Wait(BOOL end, DWORD visible)
+{
+    if (!vblank.presented)
+        return;
+
+    if (!visible)
+        visible = 480;
+
+    double period, phase = VBlank_Phase(&period);
+    double blank = period * (VBlank_Total(visible) - visible) / VBlank_Total(visible);
+
+    if (end && phase < blank)
+    {
+        VBlank_Sleep(blank - phase);
+        return;
+    }
+
+    LONG count = InterlockedExchangeAdd(&vblank.count, 0);
+    double deadline = VBlank_Now() + period - phase;
+
+    // A present ends the wait early, the prediction covers a renderer that is late or gone
+    while (InterlockedExchangeAdd(&vblank.count, 0) == count)
+    {
+        double remaining = deadline - VBlank_Now();
+        if (remaining <= 0.0)
+            break;
+
+        if (remaining >= 1.0)
+            WaitForSingleObject(vblank.presented, (DWORD)remaining);
+        else
+            YieldProcessor();
+    }
+
+    if (end)
+        VBlank_Sleep(blank);
+}
+
+/* FALSE during the blank interval, line counts on past the visible lines then */
+BOOL VBlank_ScanLine(DWORD visible, DWORD *line)
+{
+    if (!vblank.presented)
+    {
+        *line = 0;
+        return TRUE;
+    }
+
+    if (!visible)
+        visible = 480;
+
+    double period, phase = VBlank_Phase(&period);
+    DWORD total = VBlank_Total(visible);
+    DWORD blank = total - visible;
+    DWORD current = (DWORD)(phase * total / period);
+
+    if (current >= total)
+        current = total - 1;
+
+    if (current < blank)
+    {
+        *line = visible + current;
+        return FALSE;
+    }
+
+    *line = current - blank;
+    return TRUE;
+}
+
+DWORD VBlank_Rate()
+{
+    if (!vblank.presented)
+        return (DWORD)VBLANK_DEFAULT_RATE;
+
+    EnterCriticalSection(&vblank.lock);
+    double period = vblank.period;
+    LeaveCriticalSection(&vblank.lock);
+
+    return (DWORD)(1000.0 / period + 0.5);
+}
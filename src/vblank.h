@@ -0,0 +1,12 @@
+#ifndef _VBLANK_
+#define _VBLANK_
+
+#include <windows.h>
+
+void VBlank_Init();
+void VBlank_Present(double frameLen);
+void VBlank_Wait(BOOL end, DWORD visible);
+BOOL VBlank_ScanLine(DWORD visible, DWORD *line);
+DWORD VBlank_Rate();
+
+#endif
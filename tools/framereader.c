@@ -0,0 +1,190 @@
+/* Reference consumer for the FrameExport shared memory ring.
+ *
+ * usage: framereader [name] [frames]
+ *
+ * Waits for frames published under name (default ts-ddraw), prints one line per
+ * frame and saves the last one to frame.bmp. */
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "frameexport.h"
+
+static void SaveBitmap(const char *path, const FrameExportSlot *slot, const void *data)
+{
+    BITMAPFILEHEADER file = { 0 };
+    struct
+    {
+        BITMAPINFOHEADER header;
+        DWORD masks[3];
+    } info = { { 0 } };
+
+    info.header.biSize = sizeof(BITMAPINFOHEADER);
+    info.header.biWidth = slot->width;
+    info.header.biHeight = -slot->height;
+    info.header.biPlanes = 1;
+
+    if (slot->format == FRAME_EXPORT_RGB565)
+    {
+        info.header.biBitCount = 16;
+        info.header.biCompression = BI_BITFIELDS;
+        info.masks[0] = 0xF800;
+        info.masks[1] = 0x07E0;
+        info.masks[2] = 0x001F;
+    }
+    else
+    {
+        info.header.biBitCount = 32;
+        info.header.biCompression = BI_RGB;
+    }
+
+    DWORD infoSize = sizeof(BITMAPINFOHEADER) + (slot->format == FRAME_EXPORT_RGB565 ? sizeof(info.masks) : 0);
+    DWORD dataSize = slot->pitch * slot->height;
+
+    file.bfType = 0x4D42;
+    file.bfOffBits = sizeof(file) + infoSize;
+    file.bfSize = file.bfOffBits + dataSize;
+
+    FILE *fp = fopen(path, "wb");
+    if (!fp)
+        return;
+
+    fwrite(&file, sizeof(file), 1, fp);
+    fwrite(&info, infoSize, 1, fp);
+    fwrite(data, dataSize, 1, fp);
+    fclose(fp);
+}
+
+/* Maps the ring, NULL while nothing is exported under the name */
+static const FrameExportHeader *OpenRing(const char *name, HANDLE *mapping)
+{
+    char objectName[MAX_PATH];
+    _snprintf(objectName, sizeof(objectName), "Local\\%s-frames", name);
+
+    *mapping = OpenFileMapping(FILE_MAP_READ, FALSE, objectName);
+    if (!*mapping)
+        return NULL;
+
+    const FrameExportHeader *header = MapViewOfFile(*mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!header || header->magic != FRAME_EXPORT_MAGIC || header->version != FRAME_EXPORT_VERSION)
+    {
+        if (header)
+            UnmapViewOfFile(header);
+
+        CloseHandle(*mapping);
+        *mapping = NULL;
+        return NULL;
+    }
+
+    return header;
+}
+
+static void CloseRing(const FrameExportHeader *header, HANDLE mapping)
+{
+    if (header)
+        UnmapViewOfFile(header);
+    if (mapping)
+        CloseHandle(mapping);
+}
+
+int main(int argc, char **argv)
+{
+    const char *name = argc > 1 ? argv[1] : "ts-ddraw";
+    int frames = argc > 2 ? atoi(argv[2]) : 300;
+    char objectName[MAX_PATH];
+
+    HANDLE mapping;
+    const FrameExportHeader *header = OpenRing(name, &mapping);
+
+    _snprintf(objectName, sizeof(objectName), "Local\\%s-frame", name);
+    HANDLE event = OpenEvent(SYNCHRONIZE, FALSE, objectName);
+
+    if (!header || !event)
+    {
+        fprintf(stderr, "%s is not being exported, is FrameExport=%s set?\n", name, name);
+        return 1;
+    }
+
+    // Reads go to scratch, the two are swapped once a read turned out consistent
+    void *frame = malloc(header->slotBytes);
+    void *scratch = malloc(header->slotBytes);
+    FrameExportSlot last = { 0 };
+    DWORD lastFrame = 0;
+    int received = 0, torn = 0;
+
+    while (received < frames && WaitForSingleObject(event, 5000) == WAIT_OBJECT_0)
+    {
+        // The game changed to a larger mode and the ring was recreated
+        if (header->magic != FRAME_EXPORT_MAGIC)
+        {
+            CloseRing(header, mapping);
+
+            for (int i = 0; i < 50 && !(header = OpenRing(name, &mapping)); i++)
+                Sleep(100);
+
+            if (!header)
+            {
+                fprintf(stderr, "%s is not exported anymore\n", name);
+                break;
+            }
+
+            // The last consistent frame stays, it is smaller than the new slots
+            frame = realloc(frame, header->slotBytes);
+            scratch = realloc(scratch, header->slotBytes);
+            continue;
+        }
+
+        LONG index = header->latest;
+        if (index < 0)
+            continue;
+
+        const FrameExportSlot *slot = &header->slots[index];
+        LONG sequence = slot->sequence;
+        MemoryBarrier();
+
+        FrameExportSlot copy = *slot;
+        size_t bytes = (size_t)copy.pitch * copy.height;
+
+        if (bytes <= header->slotBytes)
+            memcpy(scratch, (const BYTE *)header + header->dataOffset + (size_t)index * header->slotBytes, bytes);
+
+        // scratch only holds a consistent copy if the slot wasn't rewritten meanwhile
+        MemoryBarrier();
+        if ((sequence & 1) || sequence != slot->sequence || bytes > header->slotBytes)
+        {
+            torn++;
+            continue;
+        }
+
+        void *swap = frame;
+        frame = scratch;
+        scratch = swap;
+
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+
+        // Changed rows are relative to the frame before, they don't apply after a skip
+        BOOL consecutive = copy.frame == lastFrame + 1;
+
+        printf("frame %lu %ldx%ld %s, %.2f ms old, changed rows %ld-%ld%s\n",
+            copy.frame, copy.width, copy.height, copy.format == FRAME_EXPORT_RGB565 ? "RGB565" : "XRGB8888",
+            (now.QuadPart - copy.timestamp) * 1000.0 / header->frequency,
+            copy.firstRow, copy.lastRow, consecutive ? "" : " (skipped frames)");
+
+        lastFrame = copy.frame;
+        last = copy;
+        received++;
+    }
+
+    if (received > 0)
+        SaveBitmap("frame.bmp", &last, frame);
+
+    printf("%d frames received, %d torn reads\n", received, torn);
+
+    free(frame);
+    free(scratch);
+    CloseRing(header, mapping);
+    CloseHandle(event);
+    return 0;
+}
@@ -0,0 +1,220 @@
+/* Decoder for recordings made with Record=<prefix>.
+ *
+ * usage: recdecode <recording.tsr> <out.y4m> [first] [count] [fps]
+ *        recdecode <recording.tsr> <prefix>  [first] [count]
+ *
+ * An output name ending in .y4m gets a single 4:4:4 Y4M stream, anything else
+ * is used as the prefix of numbered PNG files. first seeks through the keyframe
+ * index when the recording has one. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "recformat.h"
+#include "png.h"
+
+typedef struct
+{
+    uint8_t b, g, r, x;
+} Color;
+
+static void ToRgb(const uint8_t *src, const RecFrameHeader *h, const Color *palette, uint8_t *rgb)
+{
+    for (size_t i = 0, n = (size_t)h->width * h->height; i < n; i++, rgb += 3)
+    {
+        if (h->bpp == 8)
+        {
+            Color c = palette[src[i]];
+            rgb[0] = c.r;
+            rgb[1] = c.g;
+            rgb[2] = c.b;
+        }
+        else if (h->bpp == 16)
+        {
+            uint16_t p = src[i * 2] | (src[i * 2 + 1] << 8);
+            uint8_t r = (p >> 11) & 0x1F, g = (p >> 5) & 0x3F, b = p & 0x1F;
+            rgb[0] = (uint8_t)((r << 3) | (r >> 2));
+            rgb[1] = (uint8_t)((g << 2) | (g >> 4));
+            rgb[2] = (uint8_t)((b << 3) | (b >> 2));
+        }
+        else
+        {
+            rgb[0] = src[i * 4 + 2];
+            rgb[1] = src[i * 4 + 1];
+            rgb[2] = src[i * 4];
+        }
+    }
+}
+
+static void WriteY4mFrame(FILE *fp, const uint8_t *rgb, int width, int height, uint8_t *planes)
+{
+    size_t n = (size_t)width * height;
+
+    // BT.601 studio range
+    for (size_t i = 0; i < n; i++)
+    {
+        int r = rgb[i * 3], g = rgb[i * 3 + 1], b = rgb[i * 3 + 2];
+        planes[i] = (uint8_t)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+        planes[n + i] = (uint8_t)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+        planes[2 * n + i] = (uint8_t)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+    }
+
+    fputs("FRAME\n", fp);
+    fwrite(planes, 1, n * 3, fp);
+}
+
+/* Offset of the last keyframe at or before first, 0 without an index */
+static long long SeekKeyframe(FILE *fp, uint32_t first)
+{
+    RecIndexFooter footer;
+    long long offset = sizeof(RecFileHeader);
+
+    if (fseek(fp, -(long)sizeof(footer), SEEK_END) != 0 || fread(&footer, sizeof(footer), 1, fp) != 1 ||
+        footer.magic != REC_INDEX_MAGIC || fseek(fp, (long)footer.offset, SEEK_SET) != 0)
+        return offset;
+
+    for (uint32_t i = 0; i < footer.count; i++)
+    {
+        RecIndexEntry entry;
+        if (fread(&entry, sizeof(entry), 1, fp) != 1 || entry.frame > first)
+            break;
+        offset = entry.offset;
+    }
+
+    return offset;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "usage: %s <recording.tsr> <out.y4m | png prefix> [first] [count] [fps]\n", argv[0]);
+        return 1;
+    }
+
+    uint32_t first = argc > 3 ? (uint32_t)atoi(argv[3]) : 0;
+    uint32_t count = argc > 4 ? (uint32_t)atoi(argv[4]) : 0xFFFFFFFF;
+    int fps = argc > 5 ? atoi(argv[5]) : 60;
+    size_t outLength = strlen(argv[2]);
+    int y4m = outLength > 4 && strcmp(argv[2] + outLength - 4, ".y4m") == 0;
+
+    FILE *fp = fopen(argv[1], "rb");
+    RecFileHeader fileHeader;
+
+    if (!fp || fread(&fileHeader, sizeof(fileHeader), 1, fp) != 1 ||
+        fileHeader.magic != REC_FILE_MAGIC || fileHeader.version != REC_VERSION)
+    {
+        fprintf(stderr, "%s is not a recording\n", argv[1]);
+        return 1;
+    }
+
+    fseek(fp, (long)SeekKeyframe(fp, first), SEEK_SET);
+
+    FILE *out = NULL;
+    Color palette[256] = { { 0 } };
+    uint8_t *frame = NULL, *raw = NULL, *packed = NULL, *scratch = NULL, *rgb = NULL, *planes = NULL;
+    size_t frameBytes = 0, packedBytes = 0, pixels = 0;
+    int width = 0, height = 0;
+    uint32_t written = 0;
+    RecFrameHeader h;
+
+    while (written < count && fread(&h, sizeof(h), 1, fp) == 1 && h.magic == REC_FRAME_MAGIC)
+    {
+        if ((h.flags & REC_FRAME_PALETTE) && fread(palette, sizeof(palette), 1, fp) != 1)
+            break;
+
+        if (h.rawBytes != (size_t)h.width * h.height * (h.bpp / 8))
+            break;
+
+        if (h.rawBytes > frameBytes)
+        {
+            frameBytes = h.rawBytes;
+            frame = realloc(frame, frameBytes);
+            raw = realloc(raw, frameBytes);
+            scratch = realloc(scratch, REC_RLE_BOUND(frameBytes));
+        }
+
+        if ((size_t)h.width * h.height > pixels)
+        {
+            pixels = (size_t)h.width * h.height;
+            rgb = realloc(rgb, pixels * 3);
+            planes = realloc(planes, pixels * 3);
+        }
+
+        if (h.packedBytes > packedBytes)
+        {
+            packedBytes = h.packedBytes;
+            packed = realloc(packed, packedBytes);
+        }
+
+        if (!frame || !raw || !scratch || !rgb || !planes || !packed ||
+            fread(packed, 1, h.packedBytes, fp) != h.packedBytes ||
+            !RecFormat_Unpack(packed, h.packedBytes, raw, h.rawBytes, scratch, REC_RLE_BOUND(frameBytes)))
+        {
+            fprintf(stderr, "frame %u is damaged\n", h.frame);
+            break;
+        }
+
+        if (h.flags & REC_FRAME_KEYFRAME)
+        {
+            memcpy(frame, raw, h.rawBytes);
+        }
+        else
+        {
+            for (size_t i = 0; i < h.rawBytes; i++)
+                frame[i] ^= raw[i];
+        }
+
+        if (h.frame < first)
+            continue;
+
+        ToRgb(frame, &h, palette, rgb);
+
+        if (y4m)
+        {
+            // Y4M can't change size midstream, the rest goes to a new file
+            if (out && (h.width != width || h.height != height))
+            {
+                fprintf(stderr, "frame %u changes the size to %ux%u, stopping\n", h.frame, h.width, h.height);
+                break;
+            }
+
+            if (!out)
+            {
+                out = fopen(argv[2], "wb");
+                if (!out)
+                    break;
+
+                width = h.width;
+                height = h.height;
+                fprintf(out, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", width, height, fps);
+            }
+
+            WriteY4mFrame(out, rgb, h.width, h.height, planes);
+        }
+        else
+        {
+            char path[1024];
+            snprintf(path, sizeof(path), "%s%06u.png", argv[2], h.frame);
+
+            if (!Png_Write(path, rgb, h.width, h.height))
+                break;
+        }
+
+        written++;
+    }
+
+    printf("%u frames written\n", written);
+
+    if (out)
+        fclose(out);
+    fclose(fp);
+    free(frame);
+    free(raw);
+    free(packed);
+    free(scratch);
+    free(rgb);
+    free(planes);
+    return 0;
+}